@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+namespace mcga::proc::bench {
+
+// Collects one duration per iteration, and reports their percentiles as the
+// p50_ns and p99_ns counters.
+class LatencyRecorder {
+  public:
+    void record(std::chrono::nanoseconds latency) {
+        samples.push_back(latency.count());
+    }
+
+    void report(benchmark::State& state) {
+        if (samples.empty()) {
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        state.counters["p50_ns"] = percentile(0.50);
+        state.counters["p99_ns"] = percentile(0.99);
+    }
+
+  private:
+    double percentile(double fraction) const {
+        auto index = static_cast<std::size_t>(fraction * (samples.size() - 1));
+        return static_cast<double>(samples[index]);
+    }
+
+    std::vector<std::int64_t> samples;
+};
+
+// Number of read and write system calls made by this process so far, from
+// /proc/self/io (Linux only). Calls that don't go through the VFS, such as
+// recvmsg() and futex(), are not counted.
+inline std::optional<std::uint64_t> numIOSyscalls() {
+    std::ifstream file("/proc/self/io");
+    if (!file) {
+        return std::nullopt;
+    }
+    std::string key;
+    std::uint64_t value;
+    std::uint64_t total = 0;
+    while (file >> key >> value) {
+        if (key == "syscr:" || key == "syscw:") {
+            total += value;
+        }
+    }
+    return total;
+}
+
+// Reports the read and write system calls made between construction and
+// report(), per message, as the io_syscalls_per_msg counter.
+class IOSyscallCounter {
+  public:
+    IOSyscallCounter(): start(numIOSyscalls()) {
+    }
+
+    void report(benchmark::State& state, std::int64_t numMessages) {
+        auto end = numIOSyscalls();
+        if (!start.has_value() || !end.has_value() || numMessages == 0) {
+            return;
+        }
+        state.counters["io_syscalls_per_msg"]
+          = static_cast<double>(*end - *start)
+            / static_cast<double>(numMessages);
+    }
+
+  private:
+    std::optional<std::uint64_t> start;
+};
+
+// Message sizes covered by the size-parameterized benchmarks.
+constexpr std::int64_t kMinMessageSize = 16;
+constexpr std::int64_t kMaxMessageSize = std::int64_t{64} << 20;
+
+}  // namespace mcga::proc::bench
@@ -0,0 +1,76 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "mcga/proc/message.hpp"
+#include "mcga/proc/serialization_std.hpp"
+
+#include "bench_stats.hpp"
+
+using namespace mcga::proc;
+using namespace mcga::proc::bench;
+
+namespace {
+
+// Serializes a message holding `payload` into `buffer`, which is reused.
+void writeMessage(std::vector<std::uint8_t>& buffer,
+                  const std::vector<std::uint8_t>& payload) {
+    buffer.clear();
+    Message::Write(
+      [&buffer](const void* data, std::size_t size) {
+          auto bytes = static_cast<const std::uint8_t*>(data);
+          buffer.insert(buffer.end(), bytes, bytes + size);
+      },
+      payload);
+}
+
+void BM_MessageWrite(benchmark::State& state) {
+    std::vector<std::uint8_t> payload(state.range(0), 7);
+    std::vector<std::uint8_t> buffer;
+    for (auto _: state) {
+        writeMessage(buffer, payload);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MessageWrite)
+  ->RangeMultiplier(16)
+  ->Range(kMinMessageSize, kMaxMessageSize);
+
+void BM_MessageRead(benchmark::State& state) {
+    std::vector<std::uint8_t> payload(state.range(0), 7);
+    std::vector<std::uint8_t> buffer;
+    writeMessage(buffer, payload);
+    for (auto _: state) {
+        auto message = Message::Read(buffer.data(), buffer.size());
+        auto received = message.read<std::vector<std::uint8_t>>();
+        benchmark::DoNotOptimize(received.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MessageRead)
+  ->RangeMultiplier(16)
+  ->Range(kMinMessageSize, kMaxMessageSize);
+
+// Same as BM_MessageRead, without copying the message out of the buffer.
+void BM_MessageViewRead(benchmark::State& state) {
+    std::vector<std::uint8_t> payload(state.range(0), 7);
+    std::vector<std::uint8_t> buffer;
+    writeMessage(buffer, payload);
+    for (auto _: state) {
+        auto view = MessageView::Read(buffer.data(), buffer.size());
+        auto received = view.read<std::vector<std::uint8_t>>();
+        benchmark::DoNotOptimize(received.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MessageViewRead)
+  ->RangeMultiplier(16)
+  ->Range(kMinMessageSize, kMaxMessageSize);
+
+}  // namespace
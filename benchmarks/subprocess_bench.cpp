@@ -0,0 +1,93 @@
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "mcga/proc/subprocess.hpp"
+#include "mcga/proc/worker_pool.hpp"
+#include "mcga/proc/worker_subprocess.hpp"
+
+#include "bench_stats.hpp"
+
+using namespace mcga::proc;
+using namespace mcga::proc::bench;
+
+namespace {
+
+void BM_ForkAndWait(benchmark::State& state) {
+    LatencyRecorder latencies;
+    for (auto _: state) {
+        auto start = std::chrono::steady_clock::now();
+        auto subprocess = Subprocess::Fork([] {});
+        subprocess->waitBlocking();
+        latencies.record(std::chrono::steady_clock::now() - start);
+    }
+    latencies.report(state);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ForkAndWait)->UseRealTime();
+
+void BM_InvokeAndWait(benchmark::State& state) {
+    char executable[] = "/bin/true";
+    char* argv[] = {executable, nullptr};
+    LatencyRecorder latencies;
+    for (auto _: state) {
+        auto start = std::chrono::steady_clock::now();
+        auto subprocess = Subprocess::Invoke(executable, argv);
+        subprocess->waitBlocking();
+        latencies.record(std::chrono::steady_clock::now() - start);
+    }
+    latencies.report(state);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_InvokeAndWait)->UseRealTime();
+
+// Fork a worker, receive its only message, and reap it.
+void BM_WorkerSubprocessEndToEnd(benchmark::State& state) {
+    LatencyRecorder latencies;
+    for (auto _: state) {
+        auto start = std::chrono::steady_clock::now();
+        WorkerSubprocess worker(
+          std::chrono::seconds(10),
+          [](std::unique_ptr<PipeWriter> writer) { writer->sendMessage(1); });
+        auto message = worker.getNextMessage();
+        benchmark::DoNotOptimize(message);
+        worker.waitBlocking();
+        latencies.record(std::chrono::steady_clock::now() - start);
+    }
+    latencies.report(state);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WorkerSubprocessEndToEnd)->UseRealTime();
+
+// Keeps `4 * range(0)` tasks in flight across `range(0)` workers. The latency
+// percentiles are per batch of results.
+void BM_WorkerPoolTasks(benchmark::State& state) {
+    auto numWorkers = static_cast<std::size_t>(state.range(0));
+    WorkerPool pool(
+      [](Message& task, PipeWriter& results) {
+          results.sendMessage(task.read<std::int64_t>());
+      },
+      {.numWorkers = numWorkers});
+    for (std::size_t i = 0; i < 4 * numWorkers; i++) {
+        pool.submit(std::int64_t(i));
+    }
+    LatencyRecorder latencies;
+    std::int64_t numTasks = 0;
+    for (auto _: state) {
+        auto start = std::chrono::steady_clock::now();
+        auto results = pool.getResults();
+        latencies.record(std::chrono::steady_clock::now() - start);
+        for (auto& result: results) {
+            pool.submit(result.message.read<std::int64_t>());
+        }
+        numTasks += static_cast<std::int64_t>(results.size());
+    }
+    latencies.report(state);
+    state.SetItemsProcessed(numTasks);
+}
+BENCHMARK(BM_WorkerPoolTasks)->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+}  // namespace
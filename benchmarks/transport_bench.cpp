@@ -0,0 +1,158 @@
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "mcga/proc/batch_pipe_writer.hpp"
+#include "mcga/proc/pipe.hpp"
+#include "mcga/proc/serialization_std.hpp"
+
+#include "bench_stats.hpp"
+
+using namespace mcga::proc;
+using namespace mcga::proc::bench;
+
+namespace {
+
+enum Transport : std::int64_t {
+    ANONYMOUS_PIPE,
+    SHARED_MEMORY,
+    LOCAL_SOCKET,
+};
+
+const char* transportName(std::int64_t transport) {
+    static const char* const names[] = {"pipe", "shared_memory", "socket"};
+    return names[transport];
+}
+
+using Channel
+  = std::pair<std::unique_ptr<PipeReader>, std::unique_ptr<PipeWriter>>;
+
+Channel createChannel(std::int64_t transport) {
+    switch (transport) {
+        case ANONYMOUS_PIPE: return createAnonymousPipe();
+        case SHARED_MEMORY: return createSharedMemoryChannel();
+        default: break;
+    }
+    int fd[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) != 0) {
+        throw std::system_error(errno, std::generic_category(), "socketpair");
+    }
+    for (int end: fd) {
+        fcntl(end, F_SETFL, O_NONBLOCK);
+    }
+    return {std::make_unique<internal::PosixPipeReader>(fd[0]),
+            std::make_unique<internal::PosixPipeWriter>(fd[1])};
+}
+
+// One thread sends messages of `range(0)` bytes as fast as the transport
+// accepts them, another one receives them. Each message starts with a flag
+// telling the receiver whether it is the last one.
+void BM_TransportThroughput(benchmark::State& state) {
+    auto [reader, writer] = createChannel(state.range(1));
+    std::vector<std::uint8_t> payload(state.range(0), 7);
+    std::thread receiver([&reader] {
+        while (true) {
+            auto view = reader->getNextMessageView(-1);
+            if (view.read<bool>()) {
+                return;
+            }
+        }
+    });
+    IOSyscallCounter syscalls;
+    for (auto _: state) {
+        writer->sendMessage(false, payload);
+    }
+    writer->sendMessage(true);
+    writer->flush();
+    receiver.join();
+    syscalls.report(state, state.iterations());
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    state.SetLabel(transportName(state.range(1)));
+}
+BENCHMARK(BM_TransportThroughput)
+  ->ArgsProduct({benchmark::CreateRange(kMinMessageSize, kMaxMessageSize, 16),
+                 {ANONYMOUS_PIPE, SHARED_MEMORY, LOCAL_SOCKET}})
+  ->UseRealTime();
+
+// Same as BM_TransportThroughput, through a BatchPipeWriter on one end and
+// PipeReader::getMessages() on the other.
+void BM_BatchedThroughput(benchmark::State& state) {
+    auto [reader, pipeWriter] = createChannel(state.range(1));
+    BatchPipeWriter writer(std::move(pipeWriter));
+    std::vector<std::uint8_t> payload(state.range(0), 7);
+    std::thread receiver([&reader] {
+        std::vector<Message> batch;
+        while (true) {
+            batch.clear();
+            reader->getMessages(batch, std::chrono::seconds(10));
+            for (auto& message: batch) {
+                if (message.read<bool>()) {
+                    return;
+                }
+            }
+        }
+    });
+    IOSyscallCounter syscalls;
+    for (auto _: state) {
+        writer.sendMessage(false, payload);
+    }
+    writer.sendMessage(true);
+    writer.flush();
+    receiver.join();
+    syscalls.report(state, state.iterations());
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    state.SetLabel(transportName(state.range(1)));
+}
+BENCHMARK(BM_BatchedThroughput)
+  ->ArgsProduct({benchmark::CreateRange(kMinMessageSize, 1 << 16, 16),
+                 {ANONYMOUS_PIPE, SHARED_MEMORY, LOCAL_SOCKET}})
+  ->UseRealTime();
+
+// Round trips through a thread that echoes every message back.
+void BM_TransportRoundTrip(benchmark::State& state) {
+    auto [requestReader, requestWriter] = createChannel(state.range(1));
+    auto [replyReader, replyWriter] = createChannel(state.range(1));
+    std::vector<std::uint8_t> payload(state.range(0), 7);
+    std::thread echo([&] {
+        while (true) {
+            auto view = requestReader->getNextMessageView(-1);
+            if (view.read<bool>()) {
+                return;
+            }
+            replyWriter->sendMessage(view.read<std::vector<std::uint8_t>>());
+        }
+    });
+    LatencyRecorder latencies;
+    IOSyscallCounter syscalls;
+    for (auto _: state) {
+        auto start = std::chrono::steady_clock::now();
+        requestWriter->sendMessage(false, payload);
+        auto reply = replyReader->getNextMessageView(-1);
+        benchmark::DoNotOptimize(reply);
+        latencies.record(std::chrono::steady_clock::now() - start);
+    }
+    syscalls.report(state, 2 * state.iterations());
+    requestWriter->sendMessage(true);
+    echo.join();
+    latencies.report(state);
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(2 * state.iterations() * state.range(0));
+    state.SetLabel(transportName(state.range(1)));
+}
+BENCHMARK(BM_TransportRoundTrip)
+  ->ArgsProduct({benchmark::CreateRange(kMinMessageSize, 1 << 20, 16),
+                 {ANONYMOUS_PIPE, SHARED_MEMORY, LOCAL_SOCKET}})
+  ->UseRealTime();
+
+}  // namespace
@@ -1,9 +1,18 @@
 #pragma once
 
-#include "proc/serialization.hpp"
+#include "proc/batch_pipe_writer.hpp"
 #include "proc/buffered_writer.hpp"
-#include "proc/serialization_std.hpp"
+#include "proc/local_socket_server.hpp"
 #include "proc/message.hpp"
+#include "proc/message_allocator.hpp"
+#include "proc/metrics.hpp"
+#include "proc/numa.hpp"
 #include "proc/pipe.hpp"
+#include "proc/pipe_reader_set.hpp"
+#include "proc/serialization.hpp"
+#include "proc/serialization_std.hpp"
+#include "proc/shared_memory_buffer.hpp"
+#include "proc/stream_reader.hpp"
 #include "proc/subprocess.hpp"
+#include "proc/worker_pool.hpp"
 #include "proc/worker_subprocess.hpp"
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+
+#include <atomic>
+#include <system_error>
+
+namespace mcga::proc::internal {
+
+// An anonymous file, with no name left in the file system, to back memory
+// that is mapped more than once. `what` describes the caller in errors. On
+// Linux, a `sealable` file accepts F_ADD_SEALS.
+inline int CreateAnonymousFile(const char* what, bool sealable = false) {
+#ifdef __linux__
+    int fd = memfd_create(
+      "mcga_proc", MFD_CLOEXEC | (sealable ? MFD_ALLOW_SEALING : 0U));
+#else
+    (void)sealable;
+    // Short names, as some systems (e.g. macOS) only allow 31 characters.
+    static std::atomic<std::uint32_t> counter = 0;
+    char name[32];
+    int fd = -1;
+    for (int attempt = 0; attempt < 16 && fd < 0; attempt++) {
+        std::snprintf(name,
+                      sizeof(name),
+                      "/mcga.%x.%x",
+                      static_cast<unsigned>(getpid()),
+                      static_cast<unsigned>(counter.fetch_add(1)));
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno != EEXIST) {
+            break;
+        }
+    }
+    if (fd >= 0) {
+        shm_unlink(name);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+    return fd;
+}
+
+}  // namespace mcga::proc::internal
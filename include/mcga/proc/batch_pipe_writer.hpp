@@ -0,0 +1,143 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "pipe.hpp"
+
+namespace mcga::proc {
+
+struct BatchPipeWriterOptions {
+    // The batch is sent as soon as it holds this many bytes. Larger messages
+    // are sent right away, along with the batch.
+    std::size_t maxBatchBytes = 1 << 16;
+
+    // The batch is also sent by the first message added this long after the
+    // oldest one in it. There is no timer: when no more messages come, call
+    // flush() to send what is left.
+    std::chrono::nanoseconds maxDelay = std::chrono::milliseconds(1);
+};
+
+// Gathers the messages sent through it in one buffer, and hands them to the
+// wrapped writer together, so many small messages only take one system call.
+// The batch is sent when it is full, when it is too old, on flush() and on
+// destruction.
+class BatchPipeWriter : public PipeWriter {
+  public:
+    explicit BatchPipeWriter(std::unique_ptr<PipeWriter> writer,
+                             const BatchPipeWriterOptions& options = {})
+            : writer(std::move(writer)), options(options) {
+        batch.reserve(options.maxBatchBytes);
+    }
+
+    ~BatchPipeWriter() override {
+        try {
+            sendBatch();
+        } catch (const std::system_error&) {
+            // The reading end is gone, nobody is left to receive the data.
+        }
+    }
+
+    void sendBytes(const std::uint8_t* bytes, std::size_t numBytes) override {
+        ByteSpan range(bytes, numBytes);
+        sendBytesVectored(std::span<const ByteSpan>(&range, 1));
+    }
+
+    void sendBytesVectored(std::span<const ByteSpan> ranges) override {
+        std::size_t numBytes = 0;
+        for (auto range: ranges) {
+            numBytes += range.size();
+        }
+        if (batch.size() + numBytes > options.maxBatchBytes) {
+            sendWithBatch(ranges);
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (batch.empty()) {
+            batchStart = now;
+        }
+        for (auto range: ranges) {
+            batch.insert(batch.end(), range.begin(), range.end());
+        }
+        if (batch.size() == options.maxBatchBytes
+            || now - batchStart >= options.maxDelay) {
+            sendBatch();
+        }
+    }
+
+    // Bytes in the batch, plus those the wrapped writer did not send yet.
+    [[nodiscard]] std::size_t getPendingBytes() const override {
+        return batch.size() + writer->getPendingBytes();
+    }
+
+    bool flush(std::chrono::nanoseconds timeout) override {
+        sendBatch();
+        return writer->flush(timeout);
+    }
+
+    void flush() override {
+        sendBatch();
+        writer->flush();
+    }
+
+    [[nodiscard]] int getPollDescriptor() const override {
+        return writer->getPollDescriptor();
+    }
+
+    // The counters of the wrapped writer, which sees one send per batch.
+    [[nodiscard]] WriterMetrics getMetrics() const override {
+        return writer->getMetrics();
+    }
+
+    [[nodiscard]] Framing getFraming() const override {
+        return writer->getFraming();
+    }
+
+    [[nodiscard]] bool canAttachFileDescriptors() const override {
+        return writer->canAttachFileDescriptors();
+    }
+
+    // The batched bytes go first, so the descriptor is received with the
+    // message being sent rather than with an earlier one.
+    void attachFileDescriptor(int fd) override {
+        sendBatch();
+        writer->attachFileDescriptor(fd);
+    }
+
+  private:
+    void sendBatch() {
+        if (batch.empty()) {
+            return;
+        }
+        ByteSpan range(batch.data(), batch.size());
+        writer->sendBytesVectored(std::span<const ByteSpan>(&range, 1));
+        batch.clear();
+    }
+
+    // Sends the batch followed by `ranges` in a single call, without copying
+    // the ranges.
+    void sendWithBatch(std::span<const ByteSpan> ranges) {
+        if (batch.empty()) {
+            writer->sendBytesVectored(ranges);
+            return;
+        }
+        std::vector<ByteSpan> allRanges;
+        allRanges.reserve(ranges.size() + 1);
+        allRanges.emplace_back(batch.data(), batch.size());
+        allRanges.insert(allRanges.end(), ranges.begin(), ranges.end());
+        writer->sendBytesVectored(allRanges);
+        batch.clear();
+    }
+
+    std::unique_ptr<PipeWriter> writer;
+    BatchPipeWriterOptions options;
+    std::vector<std::uint8_t> batch;
+    std::chrono::steady_clock::time_point batchStart;
+};
+
+}  // namespace mcga::proc
@@ -1,5 +1,13 @@
 #pragma once
 
+#include <climits>
+#include <cstring>
+
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <vector>
+
 #include "serialization.hpp"
 
 namespace mcga::proc {
@@ -45,4 +53,125 @@ class BufferedWriter {
 template<binary_writer Writer, std::size_t BufferSize = 256>
 BufferedWriter(Writer) -> BufferedWriter<BufferSize, Writer>;
 
+using ByteSpan = std::span<const std::uint8_t>;
+
+template<class T>
+concept vectored_binary_writer
+  = requires(T& t, std::span<const ByteSpan> ranges) {
+    {t(ranges)};
+};
+
+// Like BufferedWriter, but pieces larger than the buffer's free space (e.g.
+// the contents of strings and vectors) are not copied: they are referenced
+// until flush(), which hands them to the underlying writer together with the
+// buffered bytes, in a single call. Only a message with more ranges than a
+// writev() takes is handed over in several calls.
+//
+// Pieces of up to kMaxTemporarySize bytes are always copied (into more
+// memory, once the buffer is full), so serializers can still write small
+// temporaries such as lengths. Larger ones must outlive the call to flush(),
+// as the arguments of PipeWriter::sendMessage() do.
+template<std::size_t BufferSize, vectored_binary_writer Writer>
+class GatherWriter {
+#ifdef IOV_MAX
+    static constexpr std::size_t kMaxRanges = IOV_MAX;
+#else
+    static constexpr std::size_t kMaxRanges = _XOPEN_IOV_MAX;
+#endif
+
+  public:
+    static constexpr std::size_t kMaxTemporarySize = 64;
+    // Extra memory for copies is allocated in chunks of up to this size.
+    static constexpr std::size_t kMaxChunkSize = 4096;
+
+    explicit GatherWriter(Writer writer): writer(std::move(writer)) {
+    }
+
+    GatherWriter(const GatherWriter&) = delete;
+    GatherWriter& operator=(const GatherWriter&) = delete;
+
+    void operator()(const void* raw_data, std::size_t size) {
+        auto data = static_cast<const std::uint8_t*>(raw_data);
+        if (size > chunkCapacity - chunkSize && size <= kMaxTemporarySize) {
+            // Earlier ranges may point into the chunk, so it cannot be
+            // reused before flush().
+            addChunkRange();
+            if (numRanges == kMaxRanges) {
+                flush();
+            }
+            if (size > chunkCapacity - chunkSize) {
+                chunkCapacity = std::clamp(
+                  2 * chunkCapacity, kMaxTemporarySize, kMaxChunkSize);
+                extraChunks.push_back(Allocate(chunkCapacity));
+                chunk = extraChunks.back().get();
+                chunkSize = 0;
+                chunkRangeStart = 0;
+            }
+        }
+        if (size <= chunkCapacity - chunkSize) {
+            std::memcpy(chunk + chunkSize, data, size);
+            chunkSize += size;
+            return;
+        }
+        // Room for the bytes copied before this piece, the piece, and those
+        // copied after it.
+        if (numRanges + 3 > kMaxRanges) {
+            flush();
+        }
+        addChunkRange();
+        std::construct_at(ranges + numRanges, data, size);
+        numRanges += 1;
+    }
+
+    void flush() {
+        addChunkRange();
+        if (numRanges != 0) {
+            writer(std::span<const ByteSpan>(ranges, numRanges));
+            numRanges = 0;
+        }
+        extraChunks.clear();
+        chunk = buffer;
+        chunkCapacity = BufferSize;
+        chunkSize = 0;
+        chunkRangeStart = 0;
+    }
+
+    // Buffered bytes are still sent after the descriptor is attached, so they
+    // need no flushing here.
+    void attachFileDescriptor(int fd)
+        requires requires(Writer& w) { w.attachFileDescriptor(fd); }
+    {
+        writer.attachFileDescriptor(fd);
+    }
+
+  private:
+    static std::unique_ptr<std::uint8_t[]> Allocate(std::size_t size) {
+        return std::make_unique_for_overwrite<std::uint8_t[]>(size);
+    }
+
+    // Adds the bytes copied to the current chunk since its last range.
+    void addChunkRange() {
+        if (chunkSize != chunkRangeStart) {
+            std::construct_at(ranges + numRanges,
+                              chunk + chunkRangeStart,
+                              chunkSize - chunkRangeStart);
+            numRanges += 1;
+            chunkRangeStart = chunkSize;
+        }
+    }
+
+    Writer writer;
+    std::uint8_t buffer[BufferSize]{};
+    std::vector<std::unique_ptr<std::uint8_t[]>> extraChunks;
+    std::uint8_t* chunk = buffer;
+    std::size_t chunkCapacity = BufferSize;
+    std::size_t chunkSize = 0;
+    std::size_t chunkRangeStart = 0;
+    std::size_t numRanges = 0;
+    // Left uninitialized, ranges are only constructed as they are gathered.
+    union {
+        ByteSpan ranges[kMaxRanges];
+    };
+};
+
 }  // namespace mcga::proc
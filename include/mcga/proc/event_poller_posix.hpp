@@ -0,0 +1,163 @@
+#pragma once
+
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <system_error>
+#include <vector>
+
+namespace mcga::proc::internal {
+
+using Deadline = std::optional<std::chrono::steady_clock::time_point>;
+
+// Returns std::nullopt (wait forever) if the timeout is too large to be
+// represented as a point in time.
+inline Deadline deadlineAfter(std::chrono::nanoseconds timeout) {
+    auto now = std::chrono::steady_clock::now();
+    if (timeout >= std::chrono::steady_clock::time_point::max() - now) {
+        return std::nullopt;
+    }
+    return now + timeout;
+}
+
+inline bool isExpired(const Deadline& deadline) {
+    return deadline.has_value()
+           && std::chrono::steady_clock::now() >= *deadline;
+}
+
+// Timeout argument for poll() / epoll_wait(), rounded up so that we never
+// wake up before the deadline.
+inline int pollTimeoutMs(const Deadline& deadline) {
+    if (!deadline.has_value()) {
+        return -1;
+    }
+    auto remaining = *deadline - std::chrono::steady_clock::now();
+    if (remaining <= std::chrono::nanoseconds::zero()) {
+        return 0;
+    }
+    auto remainingMs
+      = std::chrono::ceil<std::chrono::milliseconds>(remaining).count();
+    return remainingMs > INT_MAX ? INT_MAX : static_cast<int>(remainingMs);
+}
+
+// Waits for readability on many file descriptors at once. Uses epoll where
+// available, so the cost of a wait does not depend on the number of
+// registered descriptors, and falls back to poll() otherwise.
+class EventPoller {
+#ifdef __linux__
+    static constexpr int kMaxEventsPerWait = 256;
+#endif
+
+  public:
+    EventPoller() {
+#ifdef __linux__
+        epollFD = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFD < 0) {
+            throw std::system_error(
+              errno, std::generic_category(), "EventPoller:epoll_create1");
+        }
+#endif
+    }
+
+    EventPoller(const EventPoller&) = delete;
+    EventPoller& operator=(const EventPoller&) = delete;
+
+    ~EventPoller() {
+#ifdef __linux__
+        ::close(epollFD);
+#endif
+    }
+
+    void add(int fd, std::uint64_t token) {
+#ifdef __linux__
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = token;
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) < 0) {
+            throw std::system_error(
+              errno, std::generic_category(), "EventPoller:epoll_ctl");
+        }
+#else
+        pollFDs.push_back(pollfd{fd, POLLIN, 0});
+        tokens.push_back(token);
+#endif
+    }
+
+    void remove(int fd) {
+#ifdef __linux__
+        // The descriptor might already be closed, in which case the kernel
+        // already dropped it from the interest list.
+        epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, nullptr);
+#else
+        auto it = std::find_if(
+          pollFDs.begin(), pollFDs.end(), [fd](const pollfd& pollFD) {
+              return pollFD.fd == fd;
+          });
+        if (it == pollFDs.end()) {
+            return;
+        }
+        auto index = it - pollFDs.begin();
+        std::swap(pollFDs[index], pollFDs.back());
+        std::swap(tokens[index], tokens.back());
+        pollFDs.pop_back();
+        tokens.pop_back();
+#endif
+    }
+
+    // Fills `readyTokens` with the tokens of the descriptors that are readable
+    // (or hung up). A timeout of -1 waits indefinitely.
+    void wait(int timeoutMs, std::vector<std::uint64_t>& readyTokens) {
+        readyTokens.clear();
+#ifdef __linux__
+        epoll_event events[kMaxEventsPerWait];
+        int numEvents = epoll_wait(epollFD,
+                                   static_cast<epoll_event*>(events),
+                                   kMaxEventsPerWait,
+                                   timeoutMs);
+        if (numEvents < 0) {
+            if (errno == EINTR) {
+                return;
+            }
+            throw std::system_error(
+              errno, std::generic_category(), "EventPoller:epoll_wait");
+        }
+        for (int i = 0; i < numEvents; i++) {
+            readyTokens.push_back(events[i].data.u64);
+        }
+#else
+        int numEvents = poll(pollFDs.data(), pollFDs.size(), timeoutMs);
+        if (numEvents < 0) {
+            if (errno == EINTR) {
+                return;
+            }
+            throw std::system_error(
+              errno, std::generic_category(), "EventPoller:poll");
+        }
+        for (std::size_t i = 0; i < pollFDs.size(); i++) {
+            if (pollFDs[i].revents != 0) {
+                readyTokens.push_back(tokens[i]);
+            }
+        }
+#endif
+    }
+
+  private:
+#ifdef __linux__
+    int epollFD;
+#else
+    std::vector<pollfd> pollFDs;
+    std::vector<std::uint64_t> tokens;
+#endif
+};
+
+}  // namespace mcga::proc::internal
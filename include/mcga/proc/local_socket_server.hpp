@@ -0,0 +1,260 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pipe.hpp"
+#include "pipe_reader_set.hpp"
+
+namespace mcga::proc {
+
+struct LocalSocketServerOptions {
+    // Maximum number of connections waiting to be accepted.
+    int backlog = 128;
+
+    // Remove a file left at the socket's path (e.g. by a crashed server)
+    // before binding.
+    bool removeExistingFile = true;
+
+    // Used for every connection.
+    PipeReaderOptions readerOptions = {};
+    PipeWriterOptions writerOptions = {};
+};
+
+// Listens on a UNIX-domain socket, and receives the messages sent by any
+// number of clients (see createLocalClientSocket() and
+// createLocalClientConnection()) with the same framing as the pipes.
+//
+// Connections are accepted while waiting for messages, which are collected
+// through a PipeReaderSet. A closed connection is reported once, as an invalid
+// message, and then forgotten. So is a connection that cannot be read anymore
+// (e.g. it sent a message above PipeReaderOptions::maxMessageSize), which the
+// server closes, along with the error. Failing to accept a connection (e.g.
+// EMFILE) is reported as well, with kNoConnection, and pauses accepting until
+// the next call or until a connection is closed.
+class LocalSocketServer {
+  public:
+    using ConnectionId = std::uint64_t;
+
+    // Connection ids start at 1.
+    static constexpr ConnectionId kNoConnection = 0;
+
+    struct Entry {
+        ConnectionId connection;
+        Message message;
+        // Why the server closed the connection, or failed to accept one.
+        // Empty for messages, and for connections closed by the client.
+        std::error_code error = {};
+    };
+
+    explicit LocalSocketServer(std::string pathname,
+                               LocalSocketServerOptions options = {})
+            : pathname(std::move(pathname)), options(std::move(options)) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (sizeof(address.sun_path) < this->pathname.length() + 1) {
+            throw std::invalid_argument("Cannot bind socket to address: '"
+                                        + this->pathname
+                                        + "', address too long!");
+        }
+        strcpy(static_cast<char*>(address.sun_path), this->pathname.c_str());
+        if (this->options.removeExistingFile) {
+            ::unlink(this->pathname.c_str());
+        }
+        listenFD = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFD < 0) {
+            throw std::system_error(
+              errno, std::generic_category(), "LocalSocketServer:socket");
+        }
+        SetDescriptorFlags(listenFD);
+        if (::bind(listenFD,
+                   reinterpret_cast<sockaddr*>(&address),
+                   sizeof(sockaddr_un))
+            != 0) {
+            int error = errno;
+            ::close(listenFD);
+            throw std::system_error(
+              error, std::generic_category(), "LocalSocketServer:bind");
+        }
+        if (::listen(listenFD, this->options.backlog) != 0) {
+            int error = errno;
+            ::close(listenFD);
+            ::unlink(this->pathname.c_str());
+            throw std::system_error(
+              error, std::generic_category(), "LocalSocketServer:listen");
+        }
+        readerSet.add(listenFD);
+    }
+
+    LocalSocketServer(const LocalSocketServer&) = delete;
+    LocalSocketServer& operator=(const LocalSocketServer&) = delete;
+
+    // Closes every connection, and removes the socket file.
+    ~LocalSocketServer() {
+        connections.clear();
+        ::close(listenFD);
+        ::unlink(pathname.c_str());
+    }
+
+    // Blocks until at least one message is available (or a connection is
+    // closed), then returns everything that is available.
+    std::vector<Entry> getNextMessages() {
+        return waitForMessages(std::nullopt);
+    }
+
+    // Same as getNextMessages(), but waits for at most `timeout`. Returns an
+    // empty vector if the timeout expires.
+    std::vector<Entry> getNextMessages(std::chrono::nanoseconds timeout) {
+        return waitForMessages(internal::deadlineAfter(timeout));
+    }
+
+    // Writer sending messages back to a client, or nullptr if the connection
+    // is closed. Writing to a client that went away raises SIGPIPE.
+    PipeWriter* getWriter(ConnectionId connection) {
+        auto it = connections.find(connection);
+        return it == connections.end() ? nullptr : it->second.writer.get();
+    }
+
+    // Closes a connection without reporting it.
+    void disconnect(ConnectionId connection) {
+        auto it = connections.find(connection);
+        if (it == connections.end()) {
+            return;
+        }
+        readerSet.remove(it->second.reader.get());
+        connectionIds.erase(it->second.reader.get());
+        connections.erase(it);
+        // A descriptor was freed, accepting might work again.
+        readerSet.add(listenFD);
+    }
+
+    [[nodiscard]] std::size_t getNumConnections() const {
+        return connections.size();
+    }
+
+    [[nodiscard]] const std::string& getPathname() const {
+        return pathname;
+    }
+
+  private:
+    struct Connection {
+        std::unique_ptr<PipeReader> reader;
+        std::unique_ptr<PipeWriter> writer;
+    };
+
+    std::vector<Entry> waitForMessages(const internal::Deadline& deadline) {
+        readerSet.add(listenFD);
+        std::vector<Entry> messages;
+        while (true) {
+            auto events = deadline.has_value()
+                            ? readerSet.wait(std::max(
+                              *deadline - std::chrono::steady_clock::now(),
+                              std::chrono::steady_clock::duration::zero()))
+                            : readerSet.wait();
+            for (auto& [reader, message]: events.messages) {
+                auto connection = connectionIds.at(reader);
+                if (!message.isInvalid()) {
+                    messages.push_back({connection, std::move(message)});
+                    continue;
+                }
+                std::error_code error;
+                for (const auto& failure: events.failedReaders) {
+                    if (failure.first == reader) {
+                        error = failure.second;
+                    }
+                }
+                // Already removed from the set.
+                disconnect(connection);
+                messages.push_back({connection, Message(), error});
+            }
+            if (!events.readyDescriptors.empty()) {
+                acceptConnections(messages);
+            }
+            if (!messages.empty() || internal::isExpired(deadline)) {
+                return messages;
+            }
+        }
+    }
+
+    // Makes `fd` close-on-exec and non-blocking, or closes it and throws.
+    static void SetDescriptorFlags(int fd) {
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0
+            || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(
+              error, std::generic_category(), "LocalSocketServer:fcntl");
+        }
+    }
+
+    void acceptConnections(std::vector<Entry>& messages) {
+        while (true) {
+            int fd = ::accept(listenFD, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return;
+                }
+                // The listening socket would stay readable, and wake us up
+                // again right away.
+                readerSet.remove(listenFD);
+                messages.push_back({kNoConnection,
+                                    Message(),
+                                    std::error_code(errno,
+                                                    std::generic_category())});
+                return;
+            }
+            // The reader and the writer each close their own descriptor.
+            int writerFD = -1;
+            if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0
+                || fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+                || (writerFD = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+                int error = errno;
+                ::close(fd);
+                messages.push_back({kNoConnection,
+                                    Message(),
+                                    std::error_code(error,
+                                                    std::generic_category())});
+                continue;
+            }
+            auto connection = nextConnectionId++;
+            auto reader = std::make_unique<internal::PosixPipeReader>(
+              fd, options.readerOptions);
+            readerSet.add(reader.get());
+            connectionIds.emplace(reader.get(), connection);
+            connections.emplace(
+              connection,
+              Connection{std::move(reader),
+                         std::make_unique<internal::PosixPipeWriter>(
+                           writerFD, options.writerOptions)});
+        }
+    }
+
+    std::string pathname;
+    LocalSocketServerOptions options;
+    int listenFD;
+    PipeReaderSet readerSet;
+    std::unordered_map<ConnectionId, Connection> connections;
+    std::unordered_map<PipeReader*, ConnectionId> connectionIds;
+    ConnectionId nextConnectionId = 1;
+};
+
+}  // namespace mcga::proc
@@ -1,65 +1,203 @@
 #pragma once
 
+#include <cerrno>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
 #include <memory>
 #include <optional>
 #include <string>
+#include <system_error>
 #include <type_traits>
+#include <vector>
 
+#include "message_allocator.hpp"
 #include "serialization.hpp"
 
 namespace mcga::proc {
 
+class MessageView;
+
+// How messages are laid out on the wire. Both ends of a channel must use the
+// same framing (see PipeReaderOptions and PipeWriterOptions).
+enum class Framing {
+    // A header of Message::prefixSize bytes, and 8-byte lengths for strings
+    // and containers.
+    STANDARD,
+    // Varint header and lengths: a single byte each below 128, which roughly
+    // halves the size of small messages.
+    COMPACT,
+};
+
+namespace internal {
+
+inline constexpr std::size_t kMaxVarintSize = 10;
+
+// LEB128: 7 bits per byte, least significant first, with the high bit set on
+// every byte but the last. Returns the number of bytes written to `out`.
+inline std::size_t EncodeVarint(std::uint64_t value, std::uint8_t* out) {
+    std::size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = static_cast<std::uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<std::uint8_t>(value);
+    return size;
+}
+
+// Returns the number of bytes decoded, or 0 if the varint does not end within
+// the first `maxSize` bytes of `in` (or within kMaxVarintSize bytes).
+inline std::size_t DecodeVarint(const std::uint8_t* in,
+                                std::size_t maxSize,
+                                std::uint64_t& value) {
+    value = 0;
+    maxSize = std::min(maxSize, kMaxVarintSize);
+    for (std::size_t i = 0; i < maxSize; i++) {
+        value |= static_cast<std::uint64_t>(in[i] & 0x7F) << (7 * i);
+        if ((in[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+}  // namespace internal
+
+// Descriptors received along with a message, closed once the last message
+// referring to them is gone.
+using FileDescriptors = std::shared_ptr<const std::vector<int>>;
+
+// Binary writer used while serializing a message. Where the underlying writer
+// supports it (e.g. the PipeWriter of a UNIX-domain socket), types like
+// SharedMemoryBuffer can also attach descriptors to the message.
+template<binary_writer Writer, Framing framing = Framing::STANDARD>
+class PayloadWriter {
+  public:
+    explicit PayloadWriter(Writer& writer): writer(writer) {
+    }
+
+    void operator()(const void* data, std::size_t size) {
+        writer(data, size);
+    }
+
+    void writeLength(std::size_t length)
+        requires(framing == Framing::COMPACT)
+    {
+        std::uint8_t bytes[internal::kMaxVarintSize];
+        writer(bytes, internal::EncodeVarint(length, bytes));
+    }
+
+    // Returns the index of `fd` among the message's descriptors, to be passed
+    // to PayloadReader::getFileDescriptor() on the receiving end. Counting
+    // the bytes of a message only counts its descriptors.
+    std::size_t attachFileDescriptor(int fd)
+        requires requires(Writer& w) { w.attachFileDescriptor(fd); }
+                 || std::same_as<Writer, byte_counter>
+    {
+        if constexpr (!std::same_as<Writer, byte_counter>) {
+            writer.attachFileDescriptor(fd);
+        }
+        return numFileDescriptors++;
+    }
+
+  private:
+    Writer& writer;
+    std::size_t numFileDescriptors = 0;
+};
+
+// Binary reader used while deserializing a message.
+class PayloadReader {
+  public:
+    PayloadReader(const std::uint8_t* payload,
+                  std::size_t& readHead,
+                  const std::vector<int>* fileDescriptors,
+                  Framing framing = Framing::STANDARD)
+            : payload(payload), readHead(readHead),
+              fileDescriptors(fileDescriptors), framing(framing) {
+    }
+
+    void operator()(void* dst, std::size_t size) const {
+        std::memcpy(dst, payload + readHead, size);
+        readHead += size;
+    }
+
+    [[nodiscard]] std::size_t readLength() const {
+        if (framing == Framing::COMPACT) {
+            std::uint64_t length;
+            readHead += internal::DecodeVarint(
+              payload + readHead, internal::kMaxVarintSize, length);
+            return static_cast<std::size_t>(length);
+        }
+        std::size_t length;
+        (*this)(&length, sizeof(length));
+        return length;
+    }
+
+    // The descriptor attached with PayloadWriter::attachFileDescriptor(), or
+    // -1 if it was not received. It belongs to the message.
+    [[nodiscard]] int getFileDescriptor(std::size_t index) const {
+        if (fileDescriptors == nullptr || index >= fileDescriptors->size()) {
+            return -1;
+        }
+        return (*fileDescriptors)[index];
+    }
+
+  private:
+    const std::uint8_t* payload;
+    std::size_t& readHead;
+    const std::vector<int>* fileDescriptors;
+    Framing framing;
+};
+
 struct Message {
     static constexpr std::size_t prefixSize = alignof(std::max_align_t);
 
-    template<binary_writer Writer, class... Args>
+    // The payload size in the prefix comes from serialized_size(), so the
+    // arguments are only serialized once (see serialized_size() for the types
+    // that still need a counting pass). Compact lengths vary in size, so with
+    // Framing::COMPACT the arguments always go through a counting pass first.
+    template<Framing framing = Framing::STANDARD,
+             binary_writer Writer,
+             class... Args>
     static void Write(Writer&& writer, const Args&... args) {
-        std::size_t numBytes = 0;
-        write_from(
-          [&numBytes](const void*, std::size_t size) {
-              numBytes += size;
-          },
-          args...);
-        std::uint8_t prefix[prefixSize];
-        std::memset(static_cast<void*>(prefix), 0, prefixSize);
-        copy_data(prefix, &numBytes, sizeof(numBytes));
-
-        writer(static_cast<const void*>(prefix), prefixSize);
+        if constexpr (framing == Framing::COMPACT) {
+            byte_counter counter;
+            write_from(PayloadWriter<byte_counter, framing>(counter), args...);
+            std::uint8_t header[internal::kMaxVarintSize];
+            writer(static_cast<const void*>(header),
+                   internal::EncodeVarint(counter.numBytes, header));
+        } else {
+            std::uint8_t prefix[prefixSize];
+            WritePrefix(prefix, serialized_size(args...));
+            writer(static_cast<const void*>(prefix), prefixSize);
+        }
         write_from(
-          [&writer](const void* data, std::size_t size) {
-              writer(data, size);
-          },
+          PayloadWriter<std::remove_reference_t<Writer>, framing>(writer),
           args...);
     }
 
-    static Message Read(const void* src, std::size_t maxSize) {
-        if (maxSize < prefixSize) {
-            return Message();
-        }
-        auto expectedSize = ExpectedContentSizeFromBuffer(src) + prefixSize;
-        if (maxSize < expectedSize) {
-            return Message();
-        }
-        auto messagePayload = Allocate(expectedSize);
-        copy_data(messagePayload, src, expectedSize);
-        return Message(messagePayload);
-    }
+    static Message Read(const void* src,
+                        std::size_t maxSize,
+                        MessageAllocator* allocator = nullptr,
+                        Framing framing = Framing::STANDARD);
 
     Message() = default;
 
-    Message(const Message& other) {
+    Message(const Message& other)
+            : fileDescriptors(other.fileDescriptors), framing(other.framing) {
         if (!other.isInvalid()) {
             auto size = other.size();
-            payload.reset(Allocate(size));
+            payload = Allocate(size, other.payload.get_deleter().allocator);
             copy_data(payload.get(), other.payload.get(), size);
         }
     }
 
-    Message(Message&& other) noexcept: payload(std::move(other.payload)) {
+    Message(Message&& other) noexcept
+            : payload(std::move(other.payload)),
+              fileDescriptors(std::move(other.fileDescriptors)),
+              framing(other.framing) {
     }
 
     Message& operator=(const Message& other) {
@@ -68,9 +206,11 @@ struct Message {
         }
         readHead = prefixSize;
         payload.reset();
+        fileDescriptors = other.fileDescriptors;
+        framing = other.framing;
         if (!other.isInvalid()) {
             auto size = other.size();
-            payload.reset(Allocate(size));
+            payload = Allocate(size, other.payload.get_deleter().allocator);
             copy_data(payload.get(), other.payload.get(), size);
         }
         return *this;
@@ -82,6 +222,8 @@ struct Message {
         }
         readHead = prefixSize;
         payload = std::move(other.payload);
+        fileDescriptors = std::move(other.fileDescriptors);
+        framing = other.framing;
         return *this;
     }
 
@@ -99,27 +241,30 @@ struct Message {
 
     template<class T>
     Message& operator>>(T& obj) {
-        read_into(
-          [this](void* buf, std::size_t size) {
-              copy_data(buf, at(readHead), size);
-              readHead += size;
-          },
-          obj);
+        read_into(payloadReader(), obj);
         return *this;
     }
 
     template<class T>
     T read() {
         T obj;
-        read_into(
-          [this](void* buf, std::size_t size) {
-              copy_data(buf, at(readHead), size);
-              readHead += size;
-          },
-          obj);
+        read_into(payloadReader(), obj);
         return obj;
     }
 
+    // Descriptors received along with the message (see SharedMemoryBuffer).
+    // They are closed with the last copy of the message.
+    [[nodiscard]] std::size_t getNumFileDescriptors() const {
+        return fileDescriptors == nullptr ? 0 : fileDescriptors->size();
+    }
+
+    [[nodiscard]] int getFileDescriptor(std::size_t index) const {
+        if (index >= getNumFileDescriptors()) {
+            return -1;
+        }
+        return (*fileDescriptors)[index];
+    }
+
     [[nodiscard]] std::string debugPayloadAsInts() const {
         const auto size = this->size();
         std::string hex;
@@ -155,29 +300,184 @@ struct Message {
           static_cast<void*>(out), static_cast<const void*>(in), size);
     }
 
-    explicit Message(uint8_t* payload) noexcept: payload(payload) {
+    struct PayloadDeleter {
+        MessageAllocator* allocator;
+
+        void operator()(std::uint8_t* payload) const {
+            allocator->deallocate(
+              payload, prefixSize + ExpectedContentSizeFromBuffer(payload));
+        }
+    };
+
+    using Payload = std::unique_ptr<std::uint8_t[], PayloadDeleter>;
+
+    Message(Payload payload,
+            FileDescriptors fileDescriptors,
+            Framing framing) noexcept
+            : payload(std::move(payload)),
+              fileDescriptors(std::move(fileDescriptors)), framing(framing) {
     }
 
     std::uint8_t* at(std::size_t pos) const {
         return &payload[pos];
     }
 
+    PayloadReader payloadReader() {
+        return {payload.get(), readHead, fileDescriptors.get(), framing};
+    }
+
     std::size_t readHead = prefixSize;
-    std::unique_ptr<std::uint8_t[]> payload;
+    Payload payload;
+    FileDescriptors fileDescriptors;
+    // Only decides how lengths are read: the prefix is always standard.
+    Framing framing = Framing::STANDARD;
 
     // helper internal classes
+    static void WritePrefix(std::uint8_t* prefix, std::size_t contentSize) {
+        std::memset(static_cast<void*>(prefix), 0, prefixSize);
+        copy_data(prefix, &contentSize, sizeof(contentSize));
+    }
+
     static std::size_t ExpectedContentSizeFromBuffer(const void* buffer) {
         std::size_t size;
         std::memcpy(&size, buffer, sizeof(std::size_t));
         return size;
     }
 
-    static std::uint8_t* Allocate(std::size_t numBytes) {
-        return static_cast<std::uint8_t*>(std::malloc(numBytes));
+    static Payload Allocate(std::size_t numBytes,
+                            MessageAllocator* allocator) {
+        return Payload(allocator->allocate(numBytes),
+                       PayloadDeleter{allocator});
     }
 
+    friend class MessageView;
     friend class PipeReader;
     friend class PipeWriter;
 };
 
+// Non-owning view over a serialized message, e.g. directly inside the receive
+// buffer of a PipeReader. Deserializing from a view does not allocate. The
+// view is only valid as long as the underlying buffer is, so use detach() to
+// get an owning Message when it needs to be kept around.
+class MessageView {
+  public:
+    // Bytes taken by the header and the contents of a message.
+    struct Header {
+        std::size_t headerSize;
+        std::size_t contentSize;
+    };
+
+    // Parses the header of the message at `src`. Returns std::nullopt if the
+    // first `maxSize` bytes don't hold all of it.
+    static std::optional<Header> ReadHeader(const void* src,
+                                            std::size_t maxSize,
+                                            Framing framing) {
+        if (framing == Framing::STANDARD) {
+            if (maxSize < Message::prefixSize) {
+                return std::nullopt;
+            }
+            return Header{Message::prefixSize,
+                          Message::ExpectedContentSizeFromBuffer(src)};
+        }
+        std::uint64_t contentSize;
+        auto headerSize = internal::DecodeVarint(
+          static_cast<const std::uint8_t*>(src), maxSize, contentSize);
+        if (headerSize == 0) {
+            if (maxSize >= internal::kMaxVarintSize) {
+                throw std::system_error(
+                  EBADMSG, std::generic_category(), "MessageView:Read");
+            }
+            return std::nullopt;
+        }
+        return Header{headerSize, static_cast<std::size_t>(contentSize)};
+    }
+
+    static MessageView Read(const void* src,
+                            std::size_t maxSize,
+                            Framing framing = Framing::STANDARD) {
+        auto header = ReadHeader(src, maxSize, framing);
+        if (!header.has_value()
+            || maxSize - header->headerSize < header->contentSize) {
+            return MessageView();
+        }
+        return MessageView(
+          static_cast<const std::uint8_t*>(src), *header, framing);
+    }
+
+    MessageView() = default;
+
+    [[nodiscard]] bool isInvalid() const {
+        return payload == nullptr;
+    }
+
+    // Number of bytes of the serialized message, header included.
+    [[nodiscard]] std::size_t size() const {
+        return header.headerSize + header.contentSize;
+    }
+
+    template<class T>
+    MessageView& operator>>(T& obj) {
+        read_into(
+          PayloadReader(payload, readHead, fileDescriptors.get(), framing),
+          obj);
+        return *this;
+    }
+
+    template<class T>
+    T read() {
+        T obj;
+        *this >> obj;
+        return obj;
+    }
+
+    // Copies the viewed message into an owning Message, allocated from
+    // `allocator` (MessageAllocator::Default() if null). The read position is
+    // not carried over.
+    [[nodiscard]] Message detach(MessageAllocator* allocator = nullptr) const {
+        if (isInvalid()) {
+            return Message();
+        }
+        if (allocator == nullptr) {
+            allocator = MessageAllocator::Default();
+        }
+        auto messagePayload = Message::Allocate(
+          Message::prefixSize + header.contentSize, allocator);
+        Message::WritePrefix(messagePayload.get(), header.contentSize);
+        std::memcpy(messagePayload.get() + Message::prefixSize,
+                    payload + header.headerSize,
+                    header.contentSize);
+        return Message(std::move(messagePayload), fileDescriptors, framing);
+    }
+
+    [[nodiscard]] std::size_t getNumFileDescriptors() const {
+        return fileDescriptors == nullptr ? 0 : fileDescriptors->size();
+    }
+
+    // Called by the readers that received descriptors with the message.
+    void setFileDescriptors(FileDescriptors fileDescriptors) {
+        this->fileDescriptors = std::move(fileDescriptors);
+    }
+
+  private:
+    MessageView(const std::uint8_t* payload,
+                Header header,
+                Framing framing) noexcept
+            : payload(payload), header(header), readHead(header.headerSize),
+              framing(framing) {
+    }
+
+    const std::uint8_t* payload = nullptr;
+    Header header{Message::prefixSize, 0};
+    std::size_t readHead = Message::prefixSize;
+    Framing framing = Framing::STANDARD;
+    FileDescriptors fileDescriptors;
+};
+
+inline Message Message::Read(const void* src,
+                             std::size_t maxSize,
+                             MessageAllocator* allocator,
+                             Framing framing) {
+    return MessageView::Read(src, maxSize, framing).detach(allocator);
+}
+
 }  // namespace mcga::proc
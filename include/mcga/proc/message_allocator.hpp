@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#include <atomic>
+#include <bit>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace mcga::proc {
+
+// Provides the memory backing Message payloads.
+//
+// An allocator must outlive every Message allocated from it. Messages can be
+// destroyed on any thread, so implementations must be thread-safe.
+class MessageAllocator {
+  public:
+    struct Stats {
+        // Calls to allocate() and deallocate().
+        std::size_t allocations = 0;
+        std::size_t deallocations = 0;
+        // Allocations that had to go to the system allocator.
+        std::size_t systemAllocations = 0;
+    };
+
+    // Allocator used by messages that are not given one explicitly.
+    static MessageAllocator* Default();
+
+    // Replaces the default allocator for messages created from now on. Passing
+    // nullptr restores the malloc-based allocator.
+    static void SetDefault(MessageAllocator* allocator);
+
+    virtual ~MessageAllocator() = default;
+
+    virtual std::uint8_t* allocate(std::size_t numBytes) = 0;
+
+    virtual void deallocate(std::uint8_t* payload, std::size_t numBytes) = 0;
+
+    [[nodiscard]] virtual Stats getStats() const = 0;
+};
+
+// Forwards every allocation to malloc / free.
+class MallocMessageAllocator : public MessageAllocator {
+  public:
+    std::uint8_t* allocate(std::size_t numBytes) override {
+        auto payload = static_cast<std::uint8_t*>(std::malloc(numBytes));
+        if (payload == nullptr) {
+            throw std::bad_alloc();
+        }
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return payload;
+    }
+
+    void deallocate(std::uint8_t* payload, std::size_t) override {
+        deallocations.fetch_add(1, std::memory_order_relaxed);
+        std::free(payload);
+    }
+
+    [[nodiscard]] Stats getStats() const override {
+        auto numAllocations = allocations.load(std::memory_order_relaxed);
+        return {
+          .allocations = numAllocations,
+          .deallocations = deallocations.load(std::memory_order_relaxed),
+          .systemAllocations = numAllocations,
+        };
+    }
+
+  private:
+    std::atomic_size_t allocations = 0;
+    std::atomic_size_t deallocations = 0;
+};
+
+// Keeps freed payloads in power-of-two size classes and hands them out again,
+// so a steady stream of similarly sized messages stops reaching malloc.
+// Payloads larger than `maxPooledSize` are not pooled.
+class PooledMessageAllocator : public MessageAllocator {
+    static constexpr std::size_t kMinPooledSize = 64;
+
+  public:
+    explicit PooledMessageAllocator(std::size_t maxPooledSize = 64 * 1024,
+                                    std::size_t maxCachedPerSizeClass = 256)
+            : maxCachedPerSizeClass(maxCachedPerSizeClass) {
+        if (maxPooledSize >= kMinPooledSize) {
+            freeLists.resize(SizeClassOf(std::bit_floor(maxPooledSize)) + 1);
+        }
+    }
+
+    PooledMessageAllocator(const PooledMessageAllocator&) = delete;
+    PooledMessageAllocator& operator=(const PooledMessageAllocator&) = delete;
+
+    ~PooledMessageAllocator() override {
+        for (auto& freeList: freeLists) {
+            for (auto payload: freeList) {
+                std::free(payload);
+            }
+        }
+    }
+
+    std::uint8_t* allocate(std::size_t numBytes) override {
+        auto sizeClass = SizeClassOf(numBytes);
+        {
+            std::lock_guard guard(mutex);
+            stats.allocations += 1;
+            if (sizeClass < freeLists.size() && !freeLists[sizeClass].empty()) {
+                auto payload = freeLists[sizeClass].back();
+                freeLists[sizeClass].pop_back();
+                return payload;
+            }
+            stats.systemAllocations += 1;
+        }
+        auto allocationSize = sizeClass < freeLists.size()
+                                ? kMinPooledSize << sizeClass
+                                : numBytes;
+        auto payload = static_cast<std::uint8_t*>(std::malloc(allocationSize));
+        if (payload == nullptr) {
+            throw std::bad_alloc();
+        }
+        return payload;
+    }
+
+    void deallocate(std::uint8_t* payload, std::size_t numBytes) override {
+        auto sizeClass = SizeClassOf(numBytes);
+        {
+            std::lock_guard guard(mutex);
+            stats.deallocations += 1;
+            if (sizeClass < freeLists.size()
+                && freeLists[sizeClass].size() < maxCachedPerSizeClass) {
+                freeLists[sizeClass].push_back(payload);
+                return;
+            }
+        }
+        std::free(payload);
+    }
+
+    [[nodiscard]] Stats getStats() const override {
+        std::lock_guard guard(mutex);
+        return stats;
+    }
+
+  private:
+    // Payloads of size class i hold kMinPooledSize << i bytes. Classes past
+    // the last free list are not pooled.
+    static std::size_t SizeClassOf(std::size_t numBytes) {
+        if (numBytes <= kMinPooledSize) {
+            return 0;
+        }
+        return std::bit_width(numBytes - 1)
+               - std::bit_width(kMinPooledSize - 1);
+    }
+
+    std::size_t maxCachedPerSizeClass;
+    mutable std::mutex mutex;
+    std::vector<std::vector<std::uint8_t*>> freeLists;
+    Stats stats;
+};
+
+namespace internal {
+
+inline MallocMessageAllocator& MallocAllocatorInstance() {
+    static MallocMessageAllocator allocator;
+    return allocator;
+}
+
+inline std::atomic<MessageAllocator*>& DefaultAllocatorSlot() {
+    static std::atomic<MessageAllocator*> allocator = nullptr;
+    return allocator;
+}
+
+}  // namespace internal
+
+inline MessageAllocator* MessageAllocator::Default() {
+    auto allocator
+      = internal::DefaultAllocatorSlot().load(std::memory_order_acquire);
+    if (allocator == nullptr) {
+        return &internal::MallocAllocatorInstance();
+    }
+    return allocator;
+}
+
+inline void MessageAllocator::SetDefault(MessageAllocator* allocator) {
+    internal::DefaultAllocatorSlot().store(allocator, std::memory_order_release);
+}
+
+}  // namespace mcga::proc
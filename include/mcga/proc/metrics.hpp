@@ -0,0 +1,154 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <mutex>
+#include <type_traits>
+
+// Define MCGA_PROC_METRICS to 1 to have readers, writers and subprocesses
+// count what they do. When it is 0 (the default), nothing is recorded and the
+// getMetrics() snapshots are all zeros.
+#ifndef MCGA_PROC_METRICS
+#define MCGA_PROC_METRICS 0
+#endif
+
+namespace mcga::proc {
+
+inline constexpr bool kMetricsEnabled = MCGA_PROC_METRICS != 0;
+
+// Counts values in power-of-two buckets: bucket 0 holds zeros, and bucket i
+// holds the values in [2^(i-1), 2^i).
+struct Histogram {
+    static constexpr std::size_t kNumBuckets = 65;
+
+    void record(std::uint64_t value) {
+        buckets[std::bit_width(value)] += 1;
+        count += 1;
+        sum += value;
+    }
+
+    std::array<std::uint64_t, kNumBuckets> buckets{};
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+};
+
+struct ReaderMetrics {
+    // System calls (or ring buffer reads) that returned bytes, and the number
+    // of bytes they returned.
+    std::uint64_t numReads = 0;
+    std::uint64_t numBytesRead = 0;
+    Histogram readSizes = {};
+
+    // Reads that found nothing to return (EAGAIN, EINTR), and waits for more.
+    std::uint64_t numEmptyReads = 0;
+    std::uint64_t numWaits = 0;
+
+    std::uint64_t numMessages = 0;
+
+    // Receive buffer reallocations, and the unread bytes they copied.
+    std::uint64_t numBufferGrowths = 0;
+    std::uint64_t numBufferShrinks = 0;
+    std::uint64_t numBytesMoved = 0;
+};
+
+struct WriterMetrics {
+    // Calls to sendBytes() / sendBytesVectored(), and their sizes.
+    std::uint64_t numSends = 0;
+    Histogram sendSizes = {};
+
+    // System calls (or ring buffer writes) that accepted bytes, and the
+    // number of bytes they accepted.
+    std::uint64_t numWrites = 0;
+    std::uint64_t numBytesWritten = 0;
+
+    // Writes that found no room (EAGAIN), and waits for room.
+    std::uint64_t numBlockedWrites = 0;
+    std::uint64_t numWaits = 0;
+
+    // Bytes buffered because the kernel did not take them right away.
+    std::uint64_t numBytesQueued = 0;
+};
+
+// Counted across the whole process, see getProcessMetrics().
+struct ProcessMetrics {
+    std::uint64_t numForks = 0;
+    std::uint64_t numSpawns = 0;
+    // Time the parent spent in fork() or posix_spawn(), in microseconds.
+    Histogram startTimesUs = {};
+
+    std::uint64_t numReaped = 0;
+    // isFinished() calls on a subprocess still running.
+    std::uint64_t numUnfinishedPolls = 0;
+};
+
+namespace internal {
+
+// Holds the metrics of one reader or writer. update() calls are compiled out
+// when metrics are disabled.
+template<class Metrics>
+class MetricsRecorder {
+    struct Disabled {
+        Metrics snapshot() const {
+            return {};
+        }
+    };
+
+    struct Enabled {
+        Metrics snapshot() const {
+            return metrics;
+        }
+
+        Metrics metrics;
+    };
+
+  public:
+    void update(auto&& updater) {
+        if constexpr (kMetricsEnabled) {
+            updater(storage.metrics);
+        }
+    }
+
+    [[nodiscard]] Metrics snapshot() const {
+        return storage.snapshot();
+    }
+
+  private:
+    [[no_unique_address]] std::conditional_t<kMetricsEnabled,
+                                             Enabled,
+                                             Disabled> storage;
+};
+
+// A MetricsRecorder shared between threads.
+template<class Metrics>
+class SharedMetricsRecorder {
+  public:
+    void update(auto&& updater) {
+        if constexpr (kMetricsEnabled) {
+            std::lock_guard guard(mutex);
+            recorder.update(updater);
+        }
+    }
+
+    [[nodiscard]] Metrics snapshot() {
+        std::lock_guard guard(mutex);
+        return recorder.snapshot();
+    }
+
+  private:
+    std::mutex mutex;
+    MetricsRecorder<Metrics> recorder;
+};
+
+inline SharedMetricsRecorder<ProcessMetrics>& ProcessMetricsRecorder() {
+    static SharedMetricsRecorder<ProcessMetrics> recorder;
+    return recorder;
+}
+
+}  // namespace internal
+
+inline ProcessMetrics getProcessMetrics() {
+    return internal::ProcessMetricsRecorder().snapshot();
+}
+
+}  // namespace mcga::proc
@@ -0,0 +1,148 @@
+#pragma once
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mcga::proc {
+
+namespace internal {
+
+// Parses a sysfs CPU list such as "0-3,8,10-11".
+inline std::vector<int> ParseCPUList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        auto dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos
+                         ? first
+                         : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        } catch (const std::logic_error&) {
+            // Blank or malformed entry.
+        }
+    }
+    return cpus;
+}
+
+inline std::vector<int> AllowedCPUs() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t cpuSet;
+    if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpuSet)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+#endif
+    unsigned numCPUs = std::thread::hardware_concurrency();
+    for (unsigned cpu = 0; cpu < (numCPUs == 0 ? 1 : numCPUs); cpu++) {
+        cpus.push_back(static_cast<int>(cpu));
+    }
+    return cpus;
+}
+
+}  // namespace internal
+
+// The CPUs of each NUMA node that the calling process is allowed to run on.
+// Nodes without any such CPU are left out. Where the topology is unknown, all
+// CPUs are reported as a single node.
+inline std::vector<std::vector<int>> getNumaNodeCPUs() {
+    auto allowed = internal::AllowedCPUs();
+    std::vector<bool> isAllowed;
+    for (int cpu: allowed) {
+        if (static_cast<std::size_t>(cpu) >= isAllowed.size()) {
+            isAllowed.resize(cpu + 1);
+        }
+        isAllowed[cpu] = true;
+    }
+    std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string nodeList;
+    std::getline(online, nodeList);
+    for (int node: internal::ParseCPUList(nodeList)) {
+        std::ifstream file("/sys/devices/system/node/node"
+                           + std::to_string(node) + "/cpulist");
+        std::string cpuList;
+        std::getline(file, cpuList);
+        std::vector<int> cpus;
+        for (int cpu: internal::ParseCPUList(cpuList)) {
+            if (static_cast<std::size_t>(cpu) < isAllowed.size()
+                && isAllowed[cpu]) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            nodes.push_back(std::move(cpus));
+        }
+    }
+#endif
+    if (nodes.empty()) {
+        nodes.push_back(std::move(allowed));
+    }
+    return nodes;
+}
+
+enum class WorkerPlacement {
+    // Each worker may run on every CPU of one node, going round-robin over
+    // the nodes. Its memory stays local, while the scheduler still balances
+    // the workers within the node.
+    SPREAD_OVER_NODES,
+
+    // Each worker is pinned to a single CPU, going round-robin over the nodes
+    // first. Workers share CPUs only once there are more workers than CPUs.
+    PIN_TO_CPUS,
+};
+
+// One CPU affinity per worker, to be used as ProcessOptions::cpuAffinity
+// (see also WorkerPoolOptions::workerAffinities).
+inline std::vector<std::vector<int>>
+  planWorkerAffinities(std::size_t numWorkers,
+                       WorkerPlacement placement
+                       = WorkerPlacement::SPREAD_OVER_NODES) {
+    auto nodes = getNumaNodeCPUs();
+    std::vector<std::vector<int>> affinities;
+    if (placement == WorkerPlacement::SPREAD_OVER_NODES) {
+        for (std::size_t i = 0; i < numWorkers; i++) {
+            affinities.push_back(nodes[i % nodes.size()]);
+        }
+        return affinities;
+    }
+    // Interleave the nodes' CPUs: first CPU of every node, then the second...
+    std::size_t maxNodeSize = 0;
+    for (const auto& node: nodes) {
+        maxNodeSize = std::max(maxNodeSize, node.size());
+    }
+    std::vector<int> cpus;
+    for (std::size_t index = 0; index < maxNodeSize; index++) {
+        for (const auto& node: nodes) {
+            if (index < node.size()) {
+                cpus.push_back(node[index]);
+            }
+        }
+    }
+    for (std::size_t i = 0; i < numWorkers; i++) {
+        affinities.push_back({cpus[i % cpus.size()]});
+    }
+    return affinities;
+}
+
+}  // namespace mcga::proc
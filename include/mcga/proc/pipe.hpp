@@ -1,28 +1,141 @@
 #pragma once
 
+#include <cerrno>
+
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <span>
 #include <string>
+#include <system_error>
 #include <vector>
 
 #include "buffered_writer.hpp"
 #include "message.hpp"
+#include "metrics.hpp"
 
 namespace mcga::proc {
 
+struct PipeReaderOptions {
+    // Number of bytes requested from the kernel by the first read. While reads
+    // keep filling the whole request, the size doubles up to `maxReadSize`,
+    // and it decays back when they don't. A partially received message is
+    // always requested in full, regardless of these limits.
+    std::size_t initialReadSize = 4096;
+    std::size_t maxReadSize = 1 << 20;
+
+    // Largest message accepted, header included, so that a peer cannot make
+    // the reader allocate any amount of memory. A larger message makes
+    // reading throw a std::system_error (EMSGSIZE), and the stream cannot be
+    // read any further.
+    std::size_t maxMessageSize = std::size_t{1} << 30;
+
+    // Allocator for the messages returned by getNextMessage(), for example a
+    // PooledMessageAllocator dedicated to this reader. Must outlive them.
+    // Defaults to MessageAllocator::Default().
+    MessageAllocator* allocator = nullptr;
+
+    // Must match the framing of the writing end.
+    Framing framing = Framing::STANDARD;
+};
+
+struct PipeWriterOptions {
+    enum BackPressurePolicy {
+        // Wait (without spinning) until the reader makes room.
+        BLOCK,
+        // Keep what the kernel did not accept in a user-space queue, which is
+        // sent before any new data, on flush() and on destruction. Sending
+        // only blocks when the queue would grow past `maxBufferedBytes`.
+        BUFFER,
+    };
+
+    // What to do when the reader is slower than the writer and the kernel
+    // buffer is full.
+    BackPressurePolicy policy = BLOCK;
+
+    std::size_t maxBufferedBytes = 1 << 20;
+
+    // With the BUFFER policy, `onHighWaterMark` is called with the number of
+    // queued bytes each time the queue grows past `highWaterMark`.
+    std::size_t highWaterMark = 1 << 19;
+    std::function<void(std::size_t)> onHighWaterMark;
+
+    // With the BUFFER policy, the destructor waits for at most this long for
+    // the reader to take the queued bytes, and drops whatever is left.
+    std::chrono::nanoseconds closeTimeout = std::chrono::seconds(10);
+
+    // How sendMessage() lays out messages. The reading end must use the same.
+    Framing framing = Framing::STANDARD;
+};
+
 class PipeReader {
   public:
     virtual ~PipeReader() = default;
 
     // If maxConsecutiveFailedReadAttempts = -1, we block instead.
-    virtual Message getNextMessage(int maxConsecutiveFailedReadAttempts) = 0;
+    //
+    // The returned view points into the reader's receive buffer, and is only
+    // valid until the next call on this reader (see MessageView::detach()).
+    virtual MessageView
+      getNextMessageView(int maxConsecutiveFailedReadAttempts) = 0;
+
+    // Waits (without spinning) for at most `timeout` until a full message is
+    // available. Returns an invalid message if the timeout expires, or if the
+    // writing end was closed and no complete message is left to read.
+    virtual MessageView
+      getNextMessageView(std::chrono::nanoseconds timeout) = 0;
+
+    MessageView getNextMessageView() {
+        return getNextMessageView(-1);
+    }
+
+    Message getNextMessage(int maxConsecutiveFailedReadAttempts) {
+        return getNextMessageView(maxConsecutiveFailedReadAttempts)
+          .detach(getMessageAllocator());
+    }
+
+    Message getNextMessage(std::chrono::nanoseconds timeout) {
+        return getNextMessageView(timeout).detach(getMessageAllocator());
+    }
 
     Message getNextMessage() {
         return getNextMessage(-1);
     }
 
-  protected:
-    static std::size_t GetMessageSize(const Message& message) {
-        return message.size();
+    // Appends to `batch` every complete message already received, waiting
+    // for at most `timeout` if there is none. Only reads from the kernel when
+    // nothing was buffered, so a whole burst of small messages usually takes
+    // a single system call. Returns the number of messages appended.
+    virtual std::size_t getMessages(std::vector<Message>& batch,
+                                    std::chrono::nanoseconds timeout) {
+        std::size_t numMessages = 0;
+        for (auto message = getNextMessage(timeout); !message.isInvalid();
+             message = getNextMessage(0)) {
+            batch.push_back(std::move(message));
+            numMessages += 1;
+        }
+        return numMessages;
+    }
+
+    // Same as above, without waiting.
+    std::size_t getMessages(std::vector<Message>& batch) {
+        return getMessages(batch, std::chrono::nanoseconds::zero());
+    }
+
+    // Descriptor that becomes readable whenever new data arrives or the
+    // writing end is closed, used to wait on many readers at once.
+    [[nodiscard]] virtual int getPollDescriptor() const = 0;
+
+    // Whether the writing end was closed and every full message was read.
+    [[nodiscard]] virtual bool isClosed() const = 0;
+
+    // Allocator of the messages returned by getNextMessage(), or nullptr for
+    // MessageAllocator::Default().
+    [[nodiscard]] virtual MessageAllocator* getMessageAllocator() const = 0;
+
+    // Counters since creation, all zeros unless MCGA_PROC_METRICS is set.
+    [[nodiscard]] virtual ReaderMetrics getMetrics() const {
+        return {};
     }
 };
 
@@ -34,27 +147,127 @@ class PipeWriter {
 
     virtual void sendBytes(const std::uint8_t* bytes, std::size_t numBytes) = 0;
 
-    template<class... Args>
+    // Sends the concatenation of `ranges`, ideally in a single system call.
+    virtual void sendBytesVectored(std::span<const ByteSpan> ranges) {
+        for (auto range: ranges) {
+            sendBytes(range.data(), range.size());
+        }
+    }
+
+    // Number of bytes accepted by this writer, but not yet handed to the
+    // kernel (see PipeWriterOptions::BUFFER).
+    [[nodiscard]] virtual std::size_t getPendingBytes() const {
+        return 0;
+    }
+
+    // Waits for at most `timeout` to send the pending bytes. Returns whether
+    // everything was sent.
+    virtual bool flush(std::chrono::nanoseconds /*timeout*/) {
+        return true;
+    }
+
+    // Blocks until every pending byte is sent.
+    virtual void flush() {
+    }
+
+    // Descriptor that becomes writable when the writer can make progress, or
+    // -1 if there is none.
+    [[nodiscard]] virtual int getPollDescriptor() const {
+        return -1;
+    }
+
+    // Counters since creation, all zeros unless MCGA_PROC_METRICS is set.
+    [[nodiscard]] virtual WriterMetrics getMetrics() const {
+        return {};
+    }
+
+    // How sendMessage() lays out messages, see PipeWriterOptions::framing.
+    [[nodiscard]] virtual Framing getFraming() const {
+        return Framing::STANDARD;
+    }
+
+    // Whether attachFileDescriptor() is supported.
+    [[nodiscard]] virtual bool canAttachFileDescriptors() const {
+        return false;
+    }
+
+    // Sends a copy of `fd` along with the next bytes written, which must be
+    // part of the same message (see SharedMemoryBuffer). Only UNIX-domain
+    // sockets can carry descriptors, other writers throw std::system_error.
+    virtual void attachFileDescriptor(int /*fd*/) {
+        throw std::system_error(
+          ENOTSUP, std::generic_category(), "PipeWriter:attachFileDescriptor");
+    }
+
+    // Small pieces of the message are gathered in a buffer of `BufferSize`
+    // bytes. Larger ones (e.g. the contents of strings and vectors) are sent
+    // straight from the arguments' memory, along with the buffered bytes, in
+    // a single sendBytesVectored() call for the whole message.
+    // Messages with descriptors are refused up front by writers that cannot
+    // carry them, so that the stream is left intact.
+    template<std::size_t BufferSize = 256, class... Args>
     void sendMessage(const Args&... args) {
-        auto rawWriter = [this](const void* data, std::size_t size) {
-            sendBytes(static_cast<const std::uint8_t*>(data), size);
-        };
-        auto bufferedWriter
-          = BufferedWriter<256, decltype(rawWriter)>(std::move(rawWriter));
-        Message::Write(bufferedWriter, args...);
-        bufferedWriter.flush();
+        if constexpr ((attaches_file_descriptors<Args> || ...)) {
+            if (!canAttachFileDescriptors()) {
+                throw std::system_error(ENOTSUP,
+                                        std::generic_category(),
+                                        "PipeWriter:attachFileDescriptor");
+            }
+        }
+        auto gatherWriter
+          = GatherWriter<BufferSize, VectoredSender>(VectoredSender{this});
+        if (getFraming() == Framing::COMPACT) {
+            Message::Write<Framing::COMPACT>(gatherWriter, args...);
+        } else {
+            Message::Write(gatherWriter, args...);
+        }
+        gatherWriter.flush();
     }
+
+  private:
+    struct VectoredSender {
+        PipeWriter* pipeWriter;
+
+        void operator()(std::span<const ByteSpan> ranges) {
+            pipeWriter->sendBytesVectored(ranges);
+        }
+
+        void attachFileDescriptor(int fd) {
+            pipeWriter->attachFileDescriptor(fd);
+        }
+    };
 };
 
 std::pair<std::unique_ptr<PipeReader>, std::unique_ptr<PipeWriter>>
-  createAnonymousPipe();
+  createAnonymousPipe(const PipeReaderOptions& readerOptions = {},
+                      const PipeWriterOptions& writerOptions = {});
 std::unique_ptr<PipeWriter>
-  createLocalClientSocket(const std::string& pathname);
+  createLocalClientSocket(const std::string& pathname,
+                          const PipeWriterOptions& writerOptions = {});
+
+// Connects to a LocalSocketServer listening at `pathname`, and returns both
+// directions of the connection.
+std::pair<std::unique_ptr<PipeReader>, std::unique_ptr<PipeWriter>>
+  createLocalClientConnection(const std::string& pathname,
+                              const PipeReaderOptions& readerOptions = {},
+                              const PipeWriterOptions& writerOptions = {});
+
+// Like createAnonymousPipe(), but messages travel through a ring buffer of
+// `capacity` bytes (rounded up to whole pages), in memory shared with the
+// processes forked afterwards. The kernel is only involved to wake up an end
+// that ran out of work. Message views point straight into the ring, and keep
+// the writer from reusing their bytes until the next read. Messages larger
+// than the ring are copied out of it as they arrive.
+// Both ends use the framing of `readerOptions`.
+std::pair<std::unique_ptr<PipeReader>, std::unique_ptr<PipeWriter>>
+  createSharedMemoryChannel(std::size_t capacity = 1 << 20,
+                            const PipeReaderOptions& readerOptions = {});
 
 }  // namespace mcga::proc
 
 #if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
 #include "pipe_posix.hpp"
+#include "shared_memory_posix.hpp"
 #else
 #error "Non-unix systems are not currently supported by mcga::proc."
 #endif
@@ -1,48 +1,230 @@
 #pragma once
 
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <deque>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
 #include <system_error>
+#include <vector>
+
+#include "anonymous_file_posix.hpp"
+#include "event_poller_posix.hpp"
 
 namespace mcga::proc::internal {
 
-class PosixPipeReader : public PipeReader {
+// Receive buffer whose pages are mapped twice in a row, so the unread bytes
+// are contiguous in memory even where they wrap around the end of the ring.
+// Unread bytes are never moved to make room, and resizing only copies them.
+class MirroredRingBuffer {
+  public:
+    explicit MirroredRingBuffer(std::size_t minCapacity)
+            : ringCapacity(RoundCapacity(minCapacity)) {
+        int fd = CreateAnonymousFile("PipeReader:buffer");
+        if (ftruncate(fd, static_cast<off_t>(ringCapacity)) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(
+              error, std::generic_category(), "PipeReader:buffer");
+        }
+        void* region = mmap(nullptr,
+                            2 * ringCapacity,
+                            PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1,
+                            0);
+        if (region == MAP_FAILED) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(
+              error, std::generic_category(), "PipeReader:buffer");
+        }
+        mapping = static_cast<std::uint8_t*>(region);
+        for (std::size_t copy = 0; copy < 2; copy++) {
+            if (mmap(mapping + copy * ringCapacity,
+                     ringCapacity,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED,
+                     fd,
+                     0)
+                == MAP_FAILED) {
+                int error = errno;
+                munmap(mapping, 2 * ringCapacity);
+                ::close(fd);
+                throw std::system_error(
+                  error, std::generic_category(), "PipeReader:buffer");
+            }
+        }
+        // The mappings keep the pages alive.
+        ::close(fd);
+    }
+
+    MirroredRingBuffer(const MirroredRingBuffer&) = delete;
+    MirroredRingBuffer& operator=(const MirroredRingBuffer&) = delete;
+
+    ~MirroredRingBuffer() {
+        munmap(mapping, 2 * ringCapacity);
+    }
+
+    // The unread bytes.
+    [[nodiscard]] std::uint8_t* data() const {
+        return mapping + readOffset;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return numBytes;
+    }
+
+    // Room for the next bytes, right after the unread ones.
+    [[nodiscard]] std::uint8_t* spare() const {
+        return mapping + (readOffset + numBytes) % ringCapacity;
+    }
+
+    [[nodiscard]] std::size_t spareSize() const {
+        return ringCapacity - numBytes;
+    }
+
+    [[nodiscard]] std::size_t capacity() const {
+        return ringCapacity;
+    }
+
+    void commit(std::size_t count) {
+        numBytes += count;
+    }
+
+    void consume(std::size_t count) {
+        numBytes -= count;
+        // Starting over keeps reusing the same, already mapped, pages.
+        readOffset = numBytes == 0 ? 0 : (readOffset + count) % ringCapacity;
+    }
+
+    // Moves the unread bytes to a new ring of at least `minCapacity` bytes.
+    void reallocate(std::size_t minCapacity) {
+        MirroredRingBuffer other(std::max(minCapacity, numBytes));
+        std::memcpy(other.mapping, data(), numBytes);
+        other.numBytes = numBytes;
+        std::swap(mapping, other.mapping);
+        std::swap(ringCapacity, other.ringCapacity);
+        std::swap(readOffset, other.readOffset);
+        std::swap(numBytes, other.numBytes);
+    }
+
+    // Capacities are powers of two, and multiples of the page size. Twice
+    // the capacity must still fit in a std::size_t, for the mirror.
+    static std::size_t RoundCapacity(std::size_t minCapacity) {
+        static const auto pageSize
+          = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        constexpr auto maxCapacity
+          = std::size_t{1} << (std::numeric_limits<std::size_t>::digits - 2);
+        if (minCapacity > maxCapacity) {
+            throw std::length_error("PipeReader:buffer: capacity of "
+                                    + std::to_string(minCapacity)
+                                    + " bytes is too large");
+        }
+        return std::bit_ceil(std::max(minCapacity, pageSize));
+    }
+
   private:
-    static constexpr std::size_t kBlockReadSize = 128;
+    std::size_t ringCapacity;
+    std::uint8_t* mapping;
+    std::size_t readOffset = 0;
+    std::size_t numBytes = 0;
+};
 
+// How many bytes to request from the kernel, following the read sizes of
+// PipeReaderOptions: the size doubles while reads fill the whole request, and
+// halves when they return less than a quarter of it.
+class AdaptiveReadSize {
   public:
-    explicit PosixPipeReader(const int& inputFD)
-            : inputFD(inputFD),
-              buffer(static_cast<std::uint8_t*>(malloc(kBlockReadSize))),
-              bufferReadHead(0), bufferSize(0), bufferCapacity(kBlockReadSize) {
+    explicit AdaptiveReadSize(const PipeReaderOptions& options)
+            : minSize(std::max(options.initialReadSize, std::size_t{1})),
+              maxSize(std::max(options.maxReadSize, minSize)),
+              size(minSize) {
     }
 
-    ~PosixPipeReader() override {
-        close(inputFD);
-        free(buffer);
+    [[nodiscard]] std::size_t get() const {
+        return size;
     }
 
-    Message getNextMessage(int maxConsecutiveFailedReadAttempts) override {
+    [[nodiscard]] std::size_t getMin() const {
+        return minSize;
+    }
+
+    [[nodiscard]] std::size_t getMax() const {
+        return maxSize;
+    }
+
+    // Adapts the size to a read of `numBytesRead` bytes, out of get().
+    void update(std::size_t numBytesRead) {
+        if (numBytesRead >= size) {
+            size = std::min(2 * size, maxSize);
+        } else if (numBytesRead < size / 4) {
+            size = std::max(size / 2, minSize);
+        }
+    }
+
+  private:
+    std::size_t minSize;
+    std::size_t maxSize;
+    std::size_t size;
+};
+
+// Splits a stream of bytes into messages. Subclasses provide the bytes.
+class BufferedPipeReader : public PipeReader {
+    // A ring this many times larger than needed (and than the largest read)
+    // for this many reads in a row is replaced by a smaller one.
+    static constexpr std::size_t kShrinkFactor = 4;
+    static constexpr int kShrinkAfterReads = 64;
+
+  public:
+    explicit BufferedPipeReader(const PipeReaderOptions& options)
+            : readSize(options),
+              maxRing(MirroredRingBuffer::RoundCapacity(readSize.getMax())),
+              buffer(readSize.getMin()),
+              maxMessageSize(
+                std::max(options.maxMessageSize, Message::prefixSize)),
+              allocator(options.allocator), framing(options.framing) {
+    }
+
+    ~BufferedPipeReader() override {
+        for (auto& received: receivedFileDescriptors) {
+            CloseFileDescriptors(received.fileDescriptors);
+        }
+        CloseFileDescriptors(lastReadFileDescriptors);
+    }
+
+    MessageView
+      getNextMessageView(int maxConsecutiveFailedReadAttempts) override {
         // Try reading a message first, maybe we received multiple at once.
         auto message = readMessageFromBuffer();
         if (!message.isInvalid()) {
             return message;
         }
+        if (maxConsecutiveFailedReadAttempts == -1) {
+            return waitForMessage(std::nullopt);
+        }
 
         int failedAttempts = 0;
-        while (maxConsecutiveFailedReadAttempts == -1
-               || failedAttempts <= maxConsecutiveFailedReadAttempts) {
+        while (failedAttempts <= maxConsecutiveFailedReadAttempts) {
             bool successful = readBytes();
             if (!successful) {
                 failedAttempts += 1;
@@ -54,125 +236,632 @@ class PosixPipeReader : public PipeReader {
                 return message;
             }
         }
-        return Message();
+        return MessageView();
+    }
+
+    MessageView getNextMessageView(std::chrono::nanoseconds timeout) override {
+        auto message = readMessageFromBuffer();
+        if (!message.isInvalid()) {
+            return message;
+        }
+        return waitForMessage(deadlineAfter(timeout));
+    }
+
+    using PipeReader::getMessages;
+
+    std::size_t getMessages(std::vector<Message>& batch,
+                            std::chrono::nanoseconds timeout) override {
+        auto message = getNextMessageView(timeout);
+        std::size_t numMessages = 0;
+        while (!message.isInvalid()) {
+            batch.push_back(message.detach(allocator));
+            numMessages += 1;
+            message = readMessageFromBuffer();
+        }
+        return numMessages;
+    }
+
+    [[nodiscard]] MessageAllocator* getMessageAllocator() const override {
+        return allocator;
+    }
+
+    [[nodiscard]] ReaderMetrics getMetrics() const override {
+        return metrics.snapshot();
+    }
+
+    [[nodiscard]] bool isClosed() const override {
+        if (!endOfStream) {
+            return false;
+        }
+        return MessageView::Read(buffer.data(), buffer.size(), framing)
+          .isInvalid();
+    }
+
+    // Bytes the ring can hold, whether they are unread or not.
+    [[nodiscard]] std::size_t getBufferCapacity() const {
+        return buffer.capacity();
+    }
+
+  protected:
+    // Reads at most `maxBytes` into `dst` without blocking. Returns the number
+    // of bytes read, 0 at the end of the stream, or -1 if no bytes are
+    // available right now.
+    virtual ssize_t readSome(std::uint8_t* dst, std::size_t maxBytes) = 0;
+
+    // Waits for at most `timeoutMs` milliseconds (forever if -1) until
+    // readSome() has something to return.
+    virtual void waitReadable(int timeoutMs) = 0;
+
+    // Called by readSome() with the descriptors that arrived along with the
+    // last byte it returns (see PosixPipeWriter::attachFileDescriptor()).
+    // They go to the message that byte belongs to.
+    void receiveFileDescriptors(std::vector<int> fileDescriptors) {
+        lastReadFileDescriptors = std::move(fileDescriptors);
     }
 
   private:
-    bool readBytes() {
-        char block[kBlockReadSize];
-        ssize_t numBytesRead
-          = read(inputFD, static_cast<char*>(block), kBlockReadSize);
-        if (numBytesRead < 0) {
-            if (errno == EAGAIN) {
-                return false;
+    struct ReceivedFileDescriptors {
+        // Position in the stream of the byte received with them.
+        std::uint64_t offset;
+        std::vector<int> fileDescriptors;
+    };
+
+    static void CloseFileDescriptors(const std::vector<int>& fileDescriptors) {
+        for (int fd: fileDescriptors) {
+            ::close(fd);
+        }
+    }
+
+    MessageView waitForMessage(const Deadline& deadline) {
+        while (true) {
+            if (readBytes()) {
+                auto message = readMessageFromBuffer();
+                if (!message.isInvalid()) {
+                    return message;
+                }
+                continue;
             }
-#if EWOULDBLOCK != EAGAIN
-            if (errno == EWOULDBLOCK) {
-                return false;
+            if (endOfStream || isExpired(deadline)) {
+                return MessageView();
             }
-#endif
-            throw std::system_error(
-              errno, std::generic_category(), "PipeReader:readBytes()");
+            metrics.update([](ReaderMetrics& m) { m.numWaits += 1; });
+            waitReadable(pollTimeoutMs(deadline));
+        }
+    }
+
+    // Reads straight into the spare capacity of the buffer, making room for at
+    // least `nextReadSize()` bytes first.
+    bool readBytes() {
+        resizeBufferToFit(nextReadSize());
+        ssize_t numBytesRead = readSome(buffer.spare(), buffer.spareSize());
+        if (!lastReadFileDescriptors.empty()) {
+            auto lastByte = numConsumedBytes + buffer.size()
+                            + static_cast<std::size_t>(numBytesRead) - 1;
+            receivedFileDescriptors.push_back(
+              {lastByte, std::move(lastReadFileDescriptors)});
+            lastReadFileDescriptors.clear();
+        }
+        if (numBytesRead < 0) {
+            metrics.update([](ReaderMetrics& m) { m.numEmptyReads += 1; });
+            return false;
         }
         if (numBytesRead == 0) {
+            endOfStream = true;
             return false;
         }
-        resizeBufferToFit(static_cast<std::size_t>(numBytesRead));
-        memcpy(buffer + bufferSize,
-               static_cast<char*>(block),
-               static_cast<std::size_t>(numBytesRead));
-        bufferSize += static_cast<std::size_t>(numBytesRead);
+        metrics.update([numBytesRead](ReaderMetrics& m) {
+            m.numReads += 1;
+            m.numBytesRead += numBytesRead;
+            m.readSizes.record(numBytesRead);
+        });
+        readSize.update(static_cast<std::size_t>(numBytesRead));
+        buffer.commit(static_cast<std::size_t>(numBytesRead));
         return true;
     }
 
+    std::size_t nextReadSize() const {
+        auto unreadBytes = buffer.size();
+        auto header
+          = MessageView::ReadHeader(buffer.data(), unreadBytes, framing);
+        if (!header.has_value()) {
+            return readSize.get();
+        }
+        checkMessageSize(*header);
+        auto messageSize = header->headerSize + header->contentSize;
+        if (messageSize <= unreadBytes) {
+            return readSize.get();
+        }
+        return std::max(readSize.get(), messageSize - unreadBytes);
+    }
+
+    // Grows the ring when the unread bytes and the next read don't fit, and
+    // shrinks it once a spike (e.g. one huge message) is over, so that idle
+    // readers don't keep pinning memory. Only happens between messages, while
+    // no returned MessageView can point into the ring anymore.
     void resizeBufferToFit(std::size_t extraBytes) {
-        if (bufferCapacity < bufferSize + extraBytes && bufferReadHead > 0) {
-            std::memmove(
-              buffer, buffer + bufferReadHead, bufferCapacity - bufferReadHead);
-            bufferSize -= bufferReadHead;
-            bufferReadHead = 0;
+        auto needed = MirroredRingBuffer::RoundCapacity(
+          std::max(buffer.size() + extraBytes, readSize.getMin()));
+        bool grow = buffer.capacity() < needed;
+        if (!grow) {
+            auto maxCapacity = kShrinkFactor * std::max(needed, maxRing);
+            if (buffer.capacity() <= maxCapacity) {
+                numOversizedReads = 0;
+                return;
+            }
+            if (++numOversizedReads < kShrinkAfterReads) {
+                return;
+            }
         }
-        while (bufferCapacity < bufferSize + extraBytes) {
-            auto newBuffer
-              = static_cast<std::uint8_t*>(malloc(2 * bufferCapacity));
-            memcpy(newBuffer, buffer, bufferSize);
-            free(buffer);
-            buffer = newBuffer;
-            bufferCapacity *= 2;
+        numOversizedReads = 0;
+        metrics.update([this, grow](ReaderMetrics& m) {
+            (grow ? m.numBufferGrowths : m.numBufferShrinks) += 1;
+            m.numBytesMoved += buffer.size();
+        });
+        buffer.reallocate(grow ? needed : std::max(needed, maxRing));
+    }
+
+    // Before the ring is sized after the header, which the peer controls.
+    void checkMessageSize(const MessageView::Header& header) const {
+        if (header.contentSize > maxMessageSize - header.headerSize) {
+            throw std::system_error(
+              EMSGSIZE, std::generic_category(), "PipeReader:message");
         }
     }
 
-    Message readMessageFromBuffer() {
+    MessageView readMessageFromBuffer() {
         auto message
-          = Message::Read(buffer + bufferReadHead, bufferSize - bufferReadHead);
+          = MessageView::Read(buffer.data(), buffer.size(), framing);
         if (!message.isInvalid()) {
-            bufferReadHead += GetMessageSize(message);
+            if (message.size() > maxMessageSize) {
+                throw std::system_error(
+                  EMSGSIZE, std::generic_category(), "PipeReader:message");
+            }
+            metrics.update([](ReaderMetrics& m) { m.numMessages += 1; });
+            buffer.consume(message.size());
+            numConsumedBytes += message.size();
+            if (!receivedFileDescriptors.empty()) {
+                attachFileDescriptors(message);
+            }
         }
         return message;
     }
 
+    // Hands `message` every descriptor received with one of its bytes.
+    void attachFileDescriptors(MessageView& message) {
+        std::vector<int> fileDescriptors;
+        while (!receivedFileDescriptors.empty()
+               && receivedFileDescriptors.front().offset < numConsumedBytes) {
+            auto& received = receivedFileDescriptors.front().fileDescriptors;
+            fileDescriptors.insert(
+              fileDescriptors.end(), received.begin(), received.end());
+            receivedFileDescriptors.pop_front();
+        }
+        if (fileDescriptors.empty()) {
+            return;
+        }
+        message.setFileDescriptors(FileDescriptors(
+          new std::vector<int>(std::move(fileDescriptors)),
+          [](const std::vector<int>* fileDescriptors) {
+              CloseFileDescriptors(*fileDescriptors);
+              delete fileDescriptors;
+          }));
+    }
+
+    AdaptiveReadSize readSize;
+    // Enough for the largest read, the ring is never shrunk below this.
+    std::size_t maxRing;
+    int numOversizedReads = 0;
+    MirroredRingBuffer buffer;
+    std::size_t maxMessageSize;
+    MessageAllocator* allocator;
+    Framing framing;
+    bool endOfStream = false;
+
+    // Stream positions, only needed to match descriptors with messages.
+    std::uint64_t numConsumedBytes = 0;
+    std::vector<int> lastReadFileDescriptors;
+    std::deque<ReceivedFileDescriptors> receivedFileDescriptors;
+    MetricsRecorder<ReaderMetrics> metrics;
+};
+
+class PosixPipeReader : public BufferedPipeReader {
+    // SCM_MAX_FD on Linux, the most a single message can carry.
+    static constexpr std::size_t kMaxFileDescriptorsPerRead = 253;
+
+  public:
+    explicit PosixPipeReader(const int& inputFD,
+                             const PipeReaderOptions& options = {})
+            : BufferedPipeReader(options), inputFD(inputFD) {
+        struct stat status {};
+        isSocket = fstat(inputFD, &status) == 0 && S_ISSOCK(status.st_mode);
+    }
+
+    ~PosixPipeReader() override {
+        close(inputFD);
+    }
+
+    [[nodiscard]] int getPollDescriptor() const override {
+        return inputFD;
+    }
+
+  protected:
+    ssize_t readSome(std::uint8_t* dst, std::size_t maxBytes) override {
+        ssize_t numBytesRead = isSocket ? receiveSome(dst, maxBytes)
+                                        : read(inputFD, dst, maxBytes);
+        if (numBytesRead < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return -1;
+            }
+#if EWOULDBLOCK != EAGAIN
+            if (errno == EWOULDBLOCK) {
+                return -1;
+            }
+#endif
+            throw std::system_error(
+              errno, std::generic_category(), "PipeReader:readBytes()");
+        }
+        return numBytesRead;
+    }
+
+    void waitReadable(int timeoutMs) override {
+        pollfd pollFD{};
+        pollFD.fd = inputFD;
+        pollFD.events = POLLIN;
+        if (poll(&pollFD, 1, timeoutMs) < 0 && errno != EINTR) {
+            throw std::system_error(
+              errno, std::generic_category(), "PipeReader:poll");
+        }
+    }
+
+  private:
+    // Same as read(), but also picks up the descriptors sent with the bytes.
+    ssize_t receiveSome(std::uint8_t* dst, std::size_t maxBytes) {
+        iovec iov{dst, maxBytes};
+        alignas(cmsghdr) char
+          control[CMSG_SPACE(sizeof(int) * kMaxFileDescriptorsPerRead)];
+        msghdr header{};
+        header.msg_iov = &iov;
+        header.msg_iovlen = 1;
+        header.msg_control = static_cast<void*>(control);
+        header.msg_controllen = sizeof(control);
+#ifdef MSG_CMSG_CLOEXEC
+        ssize_t numBytesRead = recvmsg(inputFD, &header, MSG_CMSG_CLOEXEC);
+#else
+        ssize_t numBytesRead = recvmsg(inputFD, &header, 0);
+#endif
+        if (numBytesRead < 0 || header.msg_controllen == 0) {
+            return numBytesRead;
+        }
+        std::vector<int> fileDescriptors;
+        for (auto cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr;
+             cmsg = CMSG_NXTHDR(&header, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET
+                || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            auto numFDs = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            auto first = fileDescriptors.size();
+            fileDescriptors.resize(first + numFDs);
+            std::memcpy(fileDescriptors.data() + first,
+                        CMSG_DATA(cmsg),
+                        numFDs * sizeof(int));
+        }
+#ifndef MSG_CMSG_CLOEXEC
+        for (int fd: fileDescriptors) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (!fileDescriptors.empty()) {
+            receiveFileDescriptors(std::move(fileDescriptors));
+        }
+        return numBytesRead;
+    }
+
     int inputFD;
-    std::uint8_t* buffer;
-    std::size_t bufferReadHead;
-    std::size_t bufferSize;
-    std::size_t bufferCapacity;
+    bool isSocket;
 };
 
 class PosixPipeWriter : public PipeWriter {
+#ifdef IOV_MAX
+    static constexpr int kMaxRangesPerWrite = IOV_MAX;
+#else
+    static constexpr int kMaxRangesPerWrite = _XOPEN_IOV_MAX;
+#endif
+
   public:
-    explicit PosixPipeWriter(const int& outputFD): outputFD(outputFD) {
+    explicit PosixPipeWriter(const int& outputFD,
+                             PipeWriterOptions options = {})
+            : outputFD(outputFD), options(std::move(options)) {
     }
 
     ~PosixPipeWriter() override {
+        try {
+            flush(options.closeTimeout);
+        } catch (const std::system_error&) {
+            // The reading end is gone, nobody is left to receive the data.
+        }
+        for (int fd: attachedFileDescriptors) {
+            ::close(fd);
+        }
         ::close(outputFD);
     }
 
     void sendBytes(const std::uint8_t* bytes, std::size_t numBytes) override {
-        std::size_t written = 0;
-        while (written < numBytes) {
-            auto target = bytes + written;
-            std::size_t remaining = numBytes - written;
-            ssize_t currentWriteBlockSize = write(outputFD, target, remaining);
+        ByteSpan range(bytes, numBytes);
+        sendBytesVectored(std::span<const ByteSpan>(&range, 1));
+    }
+
+    void sendBytesVectored(std::span<const ByteSpan> ranges) override {
+        RangeCursor cursor{ranges};
+        metrics.update([&cursor](WriterMetrics& m) {
+            m.numSends += 1;
+            m.sendSizes.record(cursor.remainingBytes());
+        });
+        if (getPendingBytes() == 0 || writePendingBytes()) {
+            while (!writeSome(cursor)) {
+                if (options.policy == PipeWriterOptions::BUFFER) {
+                    break;
+                }
+                waitWritable(-1);
+            }
+        }
+        if (cursor.done()) {
+            return;
+        }
+        if (getPendingBytes() + cursor.remainingBytes()
+            > options.maxBufferedBytes) {
+            flush();
+            while (!writeSome(cursor)) {
+                waitWritable(-1);
+            }
+            return;
+        }
+        queue(cursor);
+    }
+
+    [[nodiscard]] std::size_t getPendingBytes() const override {
+        return pendingBytes.size() - pendingBytesOffset;
+    }
+
+    bool flush(std::chrono::nanoseconds timeout) override {
+        auto deadline = deadlineAfter(timeout);
+        while (!writePendingBytes()) {
+            if (isExpired(deadline)) {
+                return false;
+            }
+            waitWritable(pollTimeoutMs(deadline));
+        }
+        return true;
+    }
+
+    void flush() override {
+        while (!writePendingBytes()) {
+            waitWritable(-1);
+        }
+    }
+
+    [[nodiscard]] int getPollDescriptor() const override {
+        return outputFD;
+    }
+
+    [[nodiscard]] WriterMetrics getMetrics() const override {
+        return metrics.snapshot();
+    }
+
+    [[nodiscard]] Framing getFraming() const override {
+        return options.framing;
+    }
+
+    // The copy of `fd` is closed once sent, so `fd` itself may be closed as
+    // soon as this returns. Descriptors travel with a single byte of their
+    // own, since the kernel may deliver them along with any of the bytes the
+    // reader receives in the same call, up to that one.
+    [[nodiscard]] bool canAttachFileDescriptors() const override {
+        return isSocket();
+    }
+
+    void attachFileDescriptor(int fd) override {
+        if (!isSocket()) {
+            throw std::system_error(ENOTSOCK,
+                                    std::generic_category(),
+                                    "PipeWriter:attachFileDescriptor");
+        }
+        // The pending bytes belong to earlier messages.
+        flush();
+        int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (copy < 0) {
+            throw std::system_error(errno,
+                                    std::generic_category(),
+                                    "PipeWriter:attachFileDescriptor");
+        }
+        attachedFileDescriptors.push_back(copy);
+    }
+
+    int outputFD;
+
+  private:
+    struct RangeCursor {
+        std::span<const ByteSpan> ranges;
+        std::size_t rangeIndex = 0;
+        std::size_t rangeOffset = 0;
+
+        void skipEmptyRanges() {
+            while (rangeIndex < ranges.size()
+                   && rangeOffset == ranges[rangeIndex].size()) {
+                rangeIndex += 1;
+                rangeOffset = 0;
+            }
+        }
+
+        [[nodiscard]] bool done() {
+            skipEmptyRanges();
+            return rangeIndex == ranges.size();
+        }
+
+        void advance(std::size_t numBytes) {
+            while (numBytes > 0) {
+                auto remaining = ranges[rangeIndex].size() - rangeOffset;
+                if (numBytes < remaining) {
+                    rangeOffset += numBytes;
+                    return;
+                }
+                numBytes -= remaining;
+                rangeIndex += 1;
+                rangeOffset = 0;
+            }
+        }
+
+        [[nodiscard]] std::size_t remainingBytes() const {
+            std::size_t numBytes = 0;
+            for (auto i = rangeIndex; i < ranges.size(); i++) {
+                numBytes += ranges[i].size();
+            }
+            return numBytes - rangeOffset;
+        }
+    };
+
+    // Writes as much as the kernel accepts without blocking. Returns whether
+    // everything was written.
+    bool writeSome(RangeCursor& cursor) {
+        while (!cursor.done()) {
+            iovec iov[kMaxRangesPerWrite];
+            int numRanges = 0;
+            for (auto i = cursor.rangeIndex;
+                 i < cursor.ranges.size() && numRanges < kMaxRangesPerWrite;
+                 i++) {
+                auto offset = i == cursor.rangeIndex ? cursor.rangeOffset : 0;
+                iov[numRanges].iov_base = const_cast<std::uint8_t*>(
+                  cursor.ranges[i].data() + offset);
+                iov[numRanges].iov_len = cursor.ranges[i].size() - offset;
+                numRanges += 1;
+            }
+            ssize_t currentWriteBlockSize;
+            if (attachedFileDescriptors.empty()) {
+                currentWriteBlockSize
+                  = writev(outputFD, static_cast<iovec*>(iov), numRanges);
+            } else {
+                iov[0].iov_len = 1;
+                currentWriteBlockSize = sendWithFileDescriptors(iov[0]);
+            }
             if (currentWriteBlockSize < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    metrics.update(
+                      [](WriterMetrics& m) { m.numBlockedWrites += 1; });
+                    return false;
+                }
                 throw std::system_error(
                   errno, std::generic_category(), "PipeWriter:sendBytes");
             }
-            written += static_cast<std::size_t>(currentWriteBlockSize);
+            metrics.update([currentWriteBlockSize](WriterMetrics& m) {
+                m.numWrites += 1;
+                m.numBytesWritten += currentWriteBlockSize;
+            });
+            cursor.advance(static_cast<std::size_t>(currentWriteBlockSize));
         }
+        return true;
     }
 
-    int outputFD;
-};
-
-}  // namespace mcga::proc::internal
+    bool writePendingBytes() {
+        if (getPendingBytes() == 0) {
+            return true;
+        }
+        ByteSpan range(pendingBytes.data() + pendingBytesOffset,
+                       getPendingBytes());
+        RangeCursor cursor{std::span<const ByteSpan>(&range, 1)};
+        bool done = writeSome(cursor);
+        pendingBytesOffset += cursor.rangeOffset;
+        if (done) {
+            pendingBytes.clear();
+            pendingBytesOffset = 0;
+        } else if (pendingBytesOffset > pendingBytes.size() / 2) {
+            pendingBytes.erase(pendingBytes.begin(),
+                               pendingBytes.begin() + pendingBytesOffset);
+            pendingBytesOffset = 0;
+        }
+        if (getPendingBytes() < options.highWaterMark) {
+            aboveHighWaterMark = false;
+        }
+        return done;
+    }
 
-namespace mcga::proc {
+    // Sends `iov` along with the attached descriptors.
+    ssize_t sendWithFileDescriptors(iovec& iov) {
+        auto numBytes = sizeof(int) * attachedFileDescriptors.size();
+        std::vector<cmsghdr> control(
+          (CMSG_SPACE(numBytes) + sizeof(cmsghdr) - 1) / sizeof(cmsghdr));
+        msghdr header{};
+        header.msg_iov = &iov;
+        header.msg_iovlen = 1;
+        header.msg_control = static_cast<void*>(control.data());
+        header.msg_controllen = CMSG_SPACE(numBytes);
+        auto cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(numBytes);
+        std::memcpy(CMSG_DATA(cmsg), attachedFileDescriptors.data(), numBytes);
+        ssize_t numBytesSent = sendmsg(outputFD, &header, 0);
+        if (numBytesSent >= 0) {
+            for (int fd: attachedFileDescriptors) {
+                ::close(fd);
+            }
+            attachedFileDescriptors.clear();
+        }
+        return numBytesSent;
+    }
 
-inline std::pair<std::unique_ptr<PipeReader>, std::unique_ptr<PipeWriter>>
-  createAnonymousPipe() {
-    int fd[2];
-    if (pipe(fd) < 0) {
-        throw std::system_error(
-          errno, std::generic_category(), "createAnonymousPipe:pipe");
+    bool isSocket() const {
+        if (!outputIsSocket.has_value()) {
+            struct stat status {};
+            outputIsSocket = fstat(outputFD, &status) == 0
+                             && S_ISSOCK(status.st_mode);
+        }
+        return *outputIsSocket;
     }
-    if (fcntl(fd[0], F_SETFL, O_NONBLOCK) < 0) {
-        throw std::system_error(
-          errno,
-          std::generic_category(),
-          "createAnonymousPipe:fcntl (set read non-blocking)");
+
+    void queue(RangeCursor& cursor) {
+        metrics.update([&cursor](WriterMetrics& m) {
+            m.numBytesQueued += cursor.remainingBytes();
+        });
+        while (!cursor.done()) {
+            auto range = cursor.ranges[cursor.rangeIndex].subspan(
+              cursor.rangeOffset);
+            pendingBytes.insert(pendingBytes.end(), range.begin(), range.end());
+            cursor.advance(range.size());
+        }
+        if (!aboveHighWaterMark && getPendingBytes() >= options.highWaterMark) {
+            aboveHighWaterMark = true;
+            if (options.onHighWaterMark) {
+                options.onHighWaterMark(getPendingBytes());
+            }
+        }
     }
-    if (fcntl(fd[1], F_SETFL, O_NONBLOCK) < 0) {
-        throw std::system_error(
-          errno,
-          std::generic_category(),
-          "createAnonymousPipe:fcntl (set write non-blocking)");
+
+    void waitWritable(int timeoutMs) {
+        metrics.update([](WriterMetrics& m) { m.numWaits += 1; });
+        pollfd pollFD{};
+        pollFD.fd = outputFD;
+        pollFD.events = POLLOUT;
+        if (poll(&pollFD, 1, timeoutMs) < 0 && errno != EINTR) {
+            throw std::system_error(
+              errno, std::generic_category(), "PipeWriter:poll");
+        }
     }
-    return {std::make_unique<internal::PosixPipeReader>(fd[0]),
-            std::make_unique<internal::PosixPipeWriter>(fd[1])};
-}
 
-inline std::unique_ptr<PipeWriter>
-  createLocalClientSocket(const std::string& pathname) {
+    PipeWriterOptions options;
+    std::vector<std::uint8_t> pendingBytes;
+    std::size_t pendingBytesOffset = 0;
+    bool aboveHighWaterMark = false;
+    std::vector<int> attachedFileDescriptors;
+    mutable std::optional<bool> outputIsSocket;
+    MetricsRecorder<WriterMetrics> metrics;
+};
+
+// Returns a non-blocking socket connected to the UNIX-domain socket bound at
+// `pathname`.
+inline int ConnectLocalSocket(const std::string& pathname) {
     sockaddr_un server{};
     server.sun_family = AF_UNIX;
     if (sizeof(server.sun_path) < pathname.length() + 1) {
@@ -186,8 +875,10 @@ inline std::unique_ptr<PipeWriter>
           errno, std::generic_category(), "createLocalClientSocket:socket");
     }
     if (fcntl(socketFd, F_SETFL, O_NONBLOCK) < 0) {
+        int error = errno;
+        ::close(socketFd);
         throw std::system_error(
-          errno,
+          error,
           std::generic_category(),
           "createLocalClientSocket:fcntl (set non-blocking)");
     }
@@ -197,11 +888,65 @@ inline std::unique_ptr<PipeWriter>
     if (::connect(
           socketFd, reinterpret_cast<sockaddr*>(&server), sizeof(sockaddr_un))
         != 0) {
+        int error = errno;
+        ::close(socketFd);
+        throw std::system_error(
+          error, std::generic_category(), "createLocalClientSocket:connect");
+    }
+    return socketFd;
+}
+
+}  // namespace mcga::proc::internal
+
+namespace mcga::proc {
+
+inline std::pair<std::unique_ptr<PipeReader>, std::unique_ptr<PipeWriter>>
+  createAnonymousPipe(const PipeReaderOptions& readerOptions,
+                      const PipeWriterOptions& writerOptions) {
+    int fd[2];
+    if (pipe(fd) < 0) {
+        throw std::system_error(
+          errno, std::generic_category(), "createAnonymousPipe:pipe");
+    }
+    if (fcntl(fd[0], F_SETFL, O_NONBLOCK) < 0) {
+        throw std::system_error(
+          errno,
+          std::generic_category(),
+          "createAnonymousPipe:fcntl (set read non-blocking)");
+    }
+    if (fcntl(fd[1], F_SETFL, O_NONBLOCK) < 0) {
+        throw std::system_error(
+          errno,
+          std::generic_category(),
+          "createAnonymousPipe:fcntl (set write non-blocking)");
+    }
+    return {std::make_unique<internal::PosixPipeReader>(fd[0], readerOptions),
+            std::make_unique<internal::PosixPipeWriter>(fd[1], writerOptions)};
+}
+
+inline std::unique_ptr<PipeWriter>
+  createLocalClientSocket(const std::string& pathname,
+                          const PipeWriterOptions& writerOptions) {
+    return std::make_unique<internal::PosixPipeWriter>(
+      internal::ConnectLocalSocket(pathname), writerOptions);
+}
+
+inline std::pair<std::unique_ptr<PipeReader>, std::unique_ptr<PipeWriter>>
+  createLocalClientConnection(const std::string& pathname,
+                              const PipeReaderOptions& readerOptions,
+                              const PipeWriterOptions& writerOptions) {
+    auto socketFd = internal::ConnectLocalSocket(pathname);
+    // The reader and the writer each close their own descriptor.
+    int writerFd = fcntl(socketFd, F_DUPFD_CLOEXEC, 0);
+    if (writerFd < 0) {
+        int error = errno;
         ::close(socketFd);
         throw std::system_error(
-          errno, std::generic_category(), "createLocalClientSocket:connect");
+          error, std::generic_category(), "createLocalClientConnection:dup");
     }
-    return std::make_unique<internal::PosixPipeWriter>(socketFd);
+    return {
+      std::make_unique<internal::PosixPipeReader>(socketFd, readerOptions),
+      std::make_unique<internal::PosixPipeWriter>(writerFd, writerOptions)};
 }
 
 inline std::unique_ptr<PipeWriter>
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "pipe.hpp"
+#include "subprocess.hpp"
+
+namespace mcga::proc {
+
+// Waits on many PipeReaders at once, returning messages as they arrive.
+// Subprocesses can be added as well, to also wake up as soon as one finishes,
+// and so can other descriptors (e.g. a listening socket).
+//
+// The set does not own the readers and subprocesses: they must be removed from
+// the set before they are destroyed. Readers whose writing end is closed are
+// removed automatically, and reported once as a (reader, invalid message)
+// pair. So are readers that cannot be read anymore (e.g. they received a
+// message above PipeReaderOptions::maxMessageSize), whose error wait() also
+// reports. Finished subprocesses are reaped, removed and reported once by
+// wait().
+class PipeReaderSet {
+    // Upper bound on the messages taken from one reader per wait, so a single
+    // chatty writer cannot starve the others.
+    static constexpr std::size_t kMaxMessagesPerReader = 64;
+
+  public:
+    using Entry = std::pair<PipeReader*, Message>;
+
+    struct Events {
+        std::vector<Entry> messages;
+        std::vector<Subprocess*> finishedSubprocesses;
+        // Descriptors added with add(int) that are readable.
+        std::vector<int> readyDescriptors;
+        // Readers removed because reading them failed. They are also in
+        // `messages`, as closed readers.
+        std::vector<std::pair<PipeReader*, std::error_code>> failedReaders;
+    };
+
+    PipeReaderSet() = default;
+
+    PipeReaderSet(const PipeReaderSet&) = delete;
+    PipeReaderSet& operator=(const PipeReaderSet&) = delete;
+
+    void add(PipeReader* reader) {
+        if (readers.contains(reader)) {
+            return;
+        }
+        poller.add(reader->getPollDescriptor(), ToToken(reader));
+        readers.insert(reader);
+        // The reader might already hold complete messages in its buffer,
+        // which would never make its descriptor readable again.
+        pendingReaders.insert(reader);
+    }
+
+    void remove(PipeReader* reader) {
+        if (readers.erase(reader) == 0) {
+            return;
+        }
+        poller.remove(reader->getPollDescriptor());
+        pendingReaders.erase(reader);
+    }
+
+    [[nodiscard]] bool contains(PipeReader* reader) const {
+        return readers.contains(reader);
+    }
+
+    // Throws std::invalid_argument if the subprocess has no exit descriptor.
+    void add(Subprocess* subprocess) {
+        if (subprocesses.contains(subprocess)) {
+            return;
+        }
+        int exitFD = subprocess->getExitDescriptor();
+        if (exitFD < 0) {
+            throw std::invalid_argument(
+              "Cannot wait for a subprocess without an exit descriptor");
+        }
+        poller.add(exitFD, ToToken(subprocess));
+        subprocesses.insert(subprocess);
+    }
+
+    void remove(Subprocess* subprocess) {
+        if (subprocesses.erase(subprocess) == 0) {
+            return;
+        }
+        poller.remove(subprocess->getExitDescriptor());
+    }
+
+    [[nodiscard]] bool contains(Subprocess* subprocess) const {
+        return subprocesses.contains(subprocess);
+    }
+
+    // Only wait() reports when `fd` is readable. It is reported again by
+    // every wait() for as long as it stays readable.
+    void add(int fd) {
+        if (descriptors.contains(fd)) {
+            return;
+        }
+        poller.add(fd, ToToken(fd));
+        descriptors.insert(fd);
+    }
+
+    void remove(int fd) {
+        if (descriptors.erase(fd) == 0) {
+            return;
+        }
+        poller.remove(fd);
+        std::erase(readyDescriptors, fd);
+    }
+
+    [[nodiscard]] bool contains(int fd) const {
+        return descriptors.contains(fd);
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return readers.size();
+    }
+
+    [[nodiscard]] bool empty() const {
+        return readers.empty();
+    }
+
+    // Blocks until at least one message is available (or a reader is closed),
+    // then returns everything that is available. Returns an empty vector
+    // immediately if the set has no readers. Subprocesses that finish in the
+    // meantime are kept for the next call to wait().
+    std::vector<Entry> getNextMessages() {
+        return waitForEvents(std::nullopt, true).messages;
+    }
+
+    // Same as getNextMessages(), but waits for at most `timeout`. Returns an
+    // empty vector if the timeout expires.
+    std::vector<Entry> getNextMessages(std::chrono::nanoseconds timeout) {
+        return waitForEvents(internal::deadlineAfter(timeout), true).messages;
+    }
+
+    // Blocks until a message is available, a reader is closed, a subprocess
+    // finished or a descriptor is readable, then returns all of them. Returns
+    // immediately if the set is empty.
+    Events wait() {
+        return waitForEvents(std::nullopt, false);
+    }
+
+    // Same as wait(), but waits for at most `timeout`.
+    Events wait(std::chrono::nanoseconds timeout) {
+        return waitForEvents(internal::deadlineAfter(timeout), false);
+    }
+
+  private:
+    Events waitForEvents(const internal::Deadline& deadline,
+                         bool messagesOnly) {
+        Events events;
+        while (!readers.empty()
+               || (!messagesOnly
+                   && (!subprocesses.empty() || !descriptors.empty()))) {
+            bool hasPendingEvents = !pendingReaders.empty()
+                                    || (!messagesOnly && hasOtherEvents());
+            int timeoutMs
+              = hasPendingEvents ? 0 : internal::pollTimeoutMs(deadline);
+            poller.wait(timeoutMs, readyTokens);
+            for (auto token: readyTokens) {
+                if (IsSubprocessToken(token)) {
+                    checkSubprocess(SubprocessFromToken(token));
+                    continue;
+                }
+                if (IsDescriptorToken(token)) {
+                    markReady(DescriptorFromToken(token));
+                    continue;
+                }
+                auto reader = ReaderFromToken(token);
+                pendingReaders.erase(reader);
+                takeMessages(reader, events.messages);
+            }
+            if (!pendingReaders.empty()) {
+                std::vector<PipeReader*> pending(pendingReaders.begin(),
+                                                 pendingReaders.end());
+                pendingReaders.clear();
+                for (auto reader: pending) {
+                    takeMessages(reader, events.messages);
+                }
+            }
+            if (!events.messages.empty()
+                || (!messagesOnly && hasOtherEvents())
+                || internal::isExpired(deadline)) {
+                break;
+            }
+        }
+        if (!messagesOnly) {
+            events.finishedSubprocesses = std::move(finishedSubprocesses);
+            finishedSubprocesses.clear();
+            // Watched again, now that they are handed over.
+            for (int fd: readyDescriptors) {
+                poller.add(fd, ToToken(fd));
+            }
+            events.readyDescriptors = std::move(readyDescriptors);
+            readyDescriptors.clear();
+            events.failedReaders = std::move(failedReaders);
+            failedReaders.clear();
+        }
+        return events;
+    }
+
+    [[nodiscard]] bool hasOtherEvents() const {
+        return !finishedSubprocesses.empty() || !readyDescriptors.empty()
+               || !failedReaders.empty();
+    }
+
+    // The descriptor is not watched until wait() reports it, so that
+    // getNextMessages() does not spin while it stays readable.
+    void markReady(int fd) {
+        if (descriptors.contains(fd)) {
+            poller.remove(fd);
+            readyDescriptors.push_back(fd);
+        }
+    }
+
+    // The exit descriptor can be readable without the subprocess being
+    // finished (see Subprocess::getExitDescriptor()).
+    void checkSubprocess(Subprocess* subprocess) {
+        if (subprocesses.contains(subprocess) && subprocess->isFinished()) {
+            remove(subprocess);
+            finishedSubprocesses.push_back(subprocess);
+        }
+    }
+
+    void takeMessages(PipeReader* reader, std::vector<Entry>& messages) {
+        if (!readers.contains(reader)) {
+            return;
+        }
+        for (std::size_t i = 0; i < kMaxMessagesPerReader; i++) {
+            Message message;
+            std::error_code error;
+            try {
+                message = reader->getNextMessage(0);
+            } catch (const std::system_error& exception) {
+                error = exception.code();
+            } catch (const std::length_error&) {
+                error = std::make_error_code(std::errc::message_size);
+            }
+            if (error) {
+                // The stream cannot be read any further, the others still
+                // can.
+                remove(reader);
+                messages.emplace_back(reader, Message());
+                failedReaders.emplace_back(reader, error);
+                return;
+            }
+            if (message.isInvalid()) {
+                if (reader->isClosed()) {
+                    remove(reader);
+                    messages.emplace_back(reader, Message());
+                }
+                return;
+            }
+            messages.emplace_back(reader, std::move(message));
+        }
+        pendingReaders.insert(reader);
+    }
+
+    // Tokens are the objects' addresses, with the lowest two bits (always
+    // zero in an address of either type) set to 1 for subprocesses. Other
+    // descriptors are shifted into place instead, and tagged with 2.
+    static constexpr std::uint64_t kTagMask = 3;
+    static constexpr std::uint64_t kSubprocessTag = 1;
+    static constexpr std::uint64_t kDescriptorTag = 2;
+
+    static std::uint64_t ToToken(PipeReader* reader) {
+        return reinterpret_cast<std::uintptr_t>(reader);
+    }
+
+    static std::uint64_t ToToken(Subprocess* subprocess) {
+        return reinterpret_cast<std::uintptr_t>(subprocess) | kSubprocessTag;
+    }
+
+    static std::uint64_t ToToken(int fd) {
+        return (static_cast<std::uint64_t>(fd) << 2) | kDescriptorTag;
+    }
+
+    static bool IsSubprocessToken(std::uint64_t token) {
+        return (token & kTagMask) == kSubprocessTag;
+    }
+
+    static bool IsDescriptorToken(std::uint64_t token) {
+        return (token & kTagMask) == kDescriptorTag;
+    }
+
+    static int DescriptorFromToken(std::uint64_t token) {
+        return static_cast<int>(token >> 2);
+    }
+
+    static PipeReader* ReaderFromToken(std::uint64_t token) {
+        return reinterpret_cast<PipeReader*>(
+          static_cast<std::uintptr_t>(token));
+    }
+
+    static Subprocess* SubprocessFromToken(std::uint64_t token) {
+        return reinterpret_cast<Subprocess*>(
+          static_cast<std::uintptr_t>(token & ~kTagMask));
+    }
+
+    internal::EventPoller poller;
+    std::unordered_set<PipeReader*> readers;
+    std::unordered_set<PipeReader*> pendingReaders;
+    std::unordered_set<Subprocess*> subprocesses;
+    std::vector<Subprocess*> finishedSubprocesses;
+    std::unordered_set<int> descriptors;
+    std::vector<int> readyDescriptors;
+    std::vector<std::pair<PipeReader*, std::error_code>> failedReaders;
+    std::vector<std::uint64_t> readyTokens;
+};
+
+}  // namespace mcga::proc
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <concepts>
 #include <cstdint>
 #include <cstring>
+#include <iterator>
+#include <type_traits>
 
 namespace mcga::proc {
 
@@ -10,12 +13,17 @@ concept binary_reader = requires(T& t, void* dst, std::size_t size) {
     {t(dst, size)};
 };
 
+template<class T>
+void read_range(binary_reader auto& reader, T* data, std::size_t count);
+
 template<class T>
 void read_into(binary_reader auto&& reader, T& obj) {
     if constexpr (requires { {obj.read_custom(reader)}; }) {
         obj.read_custom(reader);
     } else if constexpr (requires { {read_custom(reader, obj)}; }) {
         read_custom(reader, obj);
+    } else if constexpr (std::is_array_v<T>) {
+        read_range(reader, std::data(obj), std::extent_v<T>);
     } else {
         static_assert(
           std::is_trivially_copyable_v<T>,
@@ -25,10 +33,9 @@ void read_into(binary_reader auto&& reader, T& obj) {
         static_assert(
           !std::is_pointer_v<T>,
           "Unable to automatically deserialize raw pointer, seems like a bug.");
-        obj.~T();
+        // Copying the bytes of a trivially copyable object into an existing
+        // one of the same type is well defined, no need to end its lifetime.
         reader(&obj, sizeof(T));
-        // TODO: This doesn't feel right (we don't start object lifetime for
-        //  obj after memcpy). Use something like std::bless?
     }
 }
 
@@ -50,12 +57,19 @@ concept binary_writer = requires(T& t, const void* source, std::size_t size) {
     {t(source, size)};
 };
 
+template<class T>
+void write_range(binary_writer auto& writer,
+                 const T* data,
+                 std::size_t count);
+
 template<class T>
 void write_from(binary_writer auto&& writer, const T& obj) {
     if constexpr (requires { {obj.write_custom(writer)}; }) {
         obj.write_custom(writer);
     } else if constexpr (requires { {write_custom(writer, obj)}; }) {
         write_custom(writer, obj);
+    } else if constexpr (std::is_array_v<T>) {
+        write_range(writer, std::data(obj), std::extent_v<T>);
     } else {
         static_assert(
           std::is_trivially_copyable_v<T>,
@@ -65,10 +79,7 @@ void write_from(binary_writer auto&& writer, const T& obj) {
         static_assert(
           !std::is_pointer_v<T>,
           "Unsafe to automatically serialize raw pointer, seems like a bug.");
-        obj.~T();
         writer(&obj, sizeof(T));
-        // TODO: This doesn't feel right, we don't start object lifetime for obj
-        //  after memcpy. Use something like std::launder?
     }
 }
 
@@ -80,4 +91,142 @@ void write_from(binary_writer auto&& writer,
     (write_from(writer, args), ...);
 }
 
+// Lengths of strings and containers. Writers and readers providing
+// `writeLength(std::size_t)` / `readLength()` can encode them in fewer bytes
+// than a std::size_t (see Framing::COMPACT).
+void write_length(binary_writer auto& writer, std::size_t length) {
+    if constexpr (requires { writer.writeLength(length); }) {
+        writer.writeLength(length);
+    } else {
+        write_from(writer, length);
+    }
+}
+
+std::size_t read_length(binary_reader auto& reader) {
+    if constexpr (requires { reader.readLength(); }) {
+        return reader.readLength();
+    } else {
+        return read_as<std::size_t>(reader);
+    }
+}
+
+// Binary writer that only counts the bytes it is given.
+struct byte_counter {
+    std::size_t numBytes = 0;
+
+    constexpr void operator()(const void*, std::size_t size) {
+        numBytes += size;
+    }
+};
+
+// Tag for free size_custom(size_tag, const T& obj) overloads, so they are
+// found through argument-dependent lookup just like read_custom and
+// write_custom.
+struct size_tag {};
+
+// Whether serializing a T may attach descriptors to the message (see
+// SharedMemoryBuffer), so that writers unable to carry them can refuse it
+// before sending any of it. Containers forward it from their elements.
+template<class T>
+inline constexpr bool attaches_file_descriptors = false;
+
+template<class T, std::size_t N>
+inline constexpr bool attaches_file_descriptors<T[N]>
+  = attaches_file_descriptors<T>;
+
+template<class T>
+concept custom_serializable = requires(const T& obj, byte_counter& counter) {
+    {obj.write_custom(counter)};
+} || requires(const T& obj, byte_counter& counter) {
+    {write_custom(counter, obj)};
+};
+
+// Types serialized as their raw bytes.
+template<class T>
+concept bitwise_serializable = std::is_trivially_copyable_v<T>
+                               && !std::is_pointer_v<T>
+                               && !custom_serializable<T>;
+
+// Deserializes `count` contiguous objects. Raw types are read in a single
+// reader call.
+template<class T>
+void read_range(binary_reader auto& reader, T* data, std::size_t count) {
+    if constexpr (bitwise_serializable<T>) {
+        if (count > 0) {
+            reader(data, count * sizeof(T));
+        }
+    } else {
+        for (std::size_t i = 0; i < count; i++) {
+            read_into(reader, data[i]);
+        }
+    }
+}
+
+// Serializes `count` contiguous objects. Raw types are written in a single
+// writer call.
+template<class T>
+void write_range(binary_writer auto& writer,
+                 const T* data,
+                 std::size_t count) {
+    if constexpr (bitwise_serializable<T>) {
+        if (count > 0) {
+            writer(data, count * sizeof(T));
+        }
+    } else {
+        for (std::size_t i = 0; i < count; i++) {
+            write_from(writer, data[i]);
+        }
+    }
+}
+
+template<class T>
+constexpr std::size_t serialized_size(const T& obj);
+
+template<class T>
+constexpr std::size_t serialized_range_size(const T* data, std::size_t count) {
+    if constexpr (bitwise_serializable<T>) {
+        return count * sizeof(T);
+    } else {
+        std::size_t size = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            size += serialized_size(data[i]);
+        }
+        return size;
+    }
+}
+
+// Number of bytes write_from(writer, obj) produces, without serializing obj
+// whenever possible: raw types have a constant size, and custom types can
+// provide a `std::size_t size_custom() const` method or a
+// `std::size_t size_custom(size_tag, const T& obj)` overload. Only custom
+// types without one are serialized (into a byte_counter) to find out.
+// Lengths count as a std::size_t, as written without writeLength().
+template<class T>
+constexpr std::size_t serialized_size(const T& obj) {
+    if constexpr (requires {
+                      { obj.size_custom() } -> std::convertible_to<std::size_t>;
+                  }) {
+        return obj.size_custom();
+    } else if constexpr (requires {
+                             {
+                                 size_custom(size_tag{}, obj)
+                                 } -> std::convertible_to<std::size_t>;
+                         }) {
+        return size_custom(size_tag{}, obj);
+    } else if constexpr (std::is_array_v<T>) {
+        return serialized_range_size(std::data(obj), std::extent_v<T>);
+    } else if constexpr (custom_serializable<T>) {
+        byte_counter counter;
+        write_from(counter, obj);
+        return counter.numBytes;
+    } else {
+        return sizeof(T);
+    }
+}
+
+template<class... Args>
+constexpr std::size_t serialized_size(const Args&... args) {
+    return (serialized_size(args) + ... + std::size_t{0});
+}
+
 }  // namespace mcga::proc
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <array>
 #include <memory>
 #include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
 #include <type_traits>
 #include <vector>
@@ -10,6 +13,22 @@
 
 namespace mcga::proc {
 
+template<class T>
+inline constexpr bool attaches_file_descriptors<std::optional<T>>
+  = attaches_file_descriptors<T>;
+
+template<class T>
+inline constexpr bool attaches_file_descriptors<std::vector<T>>
+  = attaches_file_descriptors<T>;
+
+template<class T, std::size_t N>
+inline constexpr bool attaches_file_descriptors<std::array<T, N>>
+  = attaches_file_descriptors<T>;
+
+template<class T, std::size_t Extent>
+inline constexpr bool attaches_file_descriptors<std::span<T, Extent>>
+  = attaches_file_descriptors<std::remove_const_t<T>>;
+
 template<class T>
 void read_custom(binary_reader auto& reader, std::optional<T>& obj) {
     bool hasValue;
@@ -31,34 +50,110 @@ void write_custom(binary_writer auto& writer, const std::optional<T>& obj) {
     }
 }
 
+template<class T>
+std::size_t size_custom(size_tag, const std::optional<T>& obj) {
+    return serialized_size(obj.has_value())
+           + (obj.has_value() ? serialized_size(obj.value()) : 0);
+}
+
 template<class T>
 void read_custom(binary_reader auto& reader, std::vector<T>& obj) {
-    typename std::vector<T>::size_type size;
-    read_into(reader, size);
+    auto size = read_length(reader);
     obj.resize(size);
-    for (auto& entry: obj) {
-        read_into(reader, entry);
-    }
+    read_range(reader, obj.data(), size);
 }
 
 template<class T>
 void write_custom(binary_writer auto& writer, const std::vector<T>& obj) {
-    write_from(writer, obj.size());
-    for (const auto& entry: obj) {
+    write_length(writer, obj.size());
+    write_range(writer, obj.data(), obj.size());
+}
+
+template<class T>
+std::size_t size_custom(size_tag, const std::vector<T>& obj) {
+    return serialized_size(obj.size())
+           + serialized_range_size(obj.data(), obj.size());
+}
+
+// std::vector<bool> is not contiguous, so it is sent one byte per element.
+void read_custom(binary_reader auto& reader, std::vector<bool>& obj) {
+    auto size = read_length(reader);
+    obj.resize(size);
+    for (std::size_t i = 0; i < size; i++) {
+        obj[i] = read_as<bool>(reader);
+    }
+}
+
+void write_custom(binary_writer auto& writer, const std::vector<bool>& obj) {
+    write_length(writer, obj.size());
+    for (bool entry: obj) {
         write_from(writer, entry);
     }
 }
 
+inline std::size_t size_custom(size_tag, const std::vector<bool>& obj) {
+    return serialized_size(obj.size()) + obj.size() * sizeof(bool);
+}
+
+// Arrays of raw types are raw types themselves, so these only kick in for
+// elements that need custom serialization.
+template<class T, std::size_t N>
+requires(!bitwise_serializable<T>) void read_custom(binary_reader auto& reader,
+                                                    std::array<T, N>& obj) {
+    read_range(reader, obj.data(), N);
+}
+
+template<class T, std::size_t N>
+requires(!bitwise_serializable<T>) void write_custom(
+  binary_writer auto& writer, const std::array<T, N>& obj) {
+    write_range(writer, obj.data(), N);
+}
+
+template<class T, std::size_t N>
+requires(!bitwise_serializable<T>) std::size_t
+  size_custom(size_tag, const std::array<T, N>& obj) {
+    return serialized_range_size(obj.data(), N);
+}
+
+// Spans are serialized like vectors, so they can be read back as one. Reading
+// into a span requires it to already have the serialized size.
+template<class T, std::size_t Extent>
+void read_custom(binary_reader auto& reader, std::span<T, Extent>& obj) {
+    static_assert(!std::is_const_v<T>, "Cannot deserialize into a const span.");
+    auto size = read_length(reader);
+    if (size != obj.size()) {
+        throw std::length_error("Cannot deserialize " + std::to_string(size)
+                                + " elements into a span of size "
+                                + std::to_string(obj.size()));
+    }
+    read_range(reader, obj.data(), size);
+}
+
+template<class T, std::size_t Extent>
+void write_custom(binary_writer auto& writer, const std::span<T, Extent>& obj) {
+    write_length(writer, obj.size());
+    write_range(writer, obj.data(), obj.size());
+}
+
+template<class T, std::size_t Extent>
+std::size_t size_custom(size_tag, const std::span<T, Extent>& obj) {
+    return serialized_size(obj.size())
+           + serialized_range_size(obj.data(), obj.size());
+}
+
 void read_custom(binary_reader auto& reader, std::string& obj) {
-    typename std::string::size_type size;
-    read_into(reader, size);
+    auto size = read_length(reader);
     obj.resize(size);
     reader(obj.data(), obj.size());
 }
 
 void write_custom(binary_writer auto& writer, const std::string& obj) {
-    write_from(writer, obj.size());
+    write_length(writer, obj.size());
     writer(obj.c_str(), obj.size());
 }
 
+inline std::size_t size_custom(size_tag, const std::string& obj) {
+    return serialized_size(obj.size()) + obj.size();
+}
+
 }  // namespace mcga::proc
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <type_traits>
+
+#include "serialization.hpp"
+
+namespace mcga::proc {
+
+// A block of memory that can be sent in a message without copying its bytes:
+// only its descriptor and size are serialized, and the receiving end maps the
+// same pages, read-only. Sending it requires a PipeWriter that can attach
+// descriptors, i.e. one end of a UNIX-domain socket (see LocalSocketServer and
+// createLocalClientConnection()).
+//
+// The pages are shared, not copied, so sending the buffer makes it read-only:
+// data() returns null from then on. On Linux the pages are also sealed, so
+// that no process can change or resize them anymore. Elsewhere, the sender
+// should not write to them through another mapping.
+class SharedMemoryBuffer {
+  public:
+    // Allocates `size` zero-filled, writable bytes.
+    static SharedMemoryBuffer Create(std::size_t size);
+
+    SharedMemoryBuffer() = default;
+
+    SharedMemoryBuffer(const SharedMemoryBuffer&) = delete;
+    SharedMemoryBuffer& operator=(const SharedMemoryBuffer&) = delete;
+
+    SharedMemoryBuffer(SharedMemoryBuffer&& other) noexcept;
+    SharedMemoryBuffer& operator=(SharedMemoryBuffer&& other) noexcept;
+
+    ~SharedMemoryBuffer();
+
+    // Null for a received buffer, which is read-only.
+    [[nodiscard]] std::uint8_t* data() {
+        return writable ? mapping : nullptr;
+    }
+
+    [[nodiscard]] const std::uint8_t* data() const {
+        return mapping;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return mappingSize;
+    }
+
+    [[nodiscard]] std::size_t size_custom() const {
+        return sizeof(std::uint64_t) * 2;
+    }
+
+    template<binary_writer Writer>
+    void write_custom(Writer& writer) const {
+        std::uint64_t index = 0;
+        if constexpr (!std::is_same_v<Writer, byte_counter>) {
+            static_assert(
+              requires { writer.attachFileDescriptor(fd); },
+              "SharedMemoryBuffer can only be sent with a PipeWriter.");
+            seal();
+            index = writer.attachFileDescriptor(fd);
+        }
+        std::uint64_t size = mappingSize;
+        writer(&index, sizeof(index));
+        writer(&size, sizeof(size));
+    }
+
+    template<binary_reader Reader>
+    void read_custom(Reader& reader) {
+        std::uint64_t index;
+        std::uint64_t size;
+        reader(&index, sizeof(index));
+        reader(&size, sizeof(size));
+        *this = Map(reader.getFileDescriptor(index), size);
+    }
+
+  private:
+    // Maps `size` bytes of the descriptor received with a message, which the
+    // message keeps owning.
+    static SharedMemoryBuffer Map(int fd, std::size_t size);
+
+    // Makes the pages read-only before they are sent.
+    void seal() const;
+
+    void reset();
+
+    int fd = -1;
+    std::uint8_t* mapping = nullptr;
+    std::size_t mappingSize = 0;
+    // Cleared by seal(), when the buffer is sent.
+    mutable bool writable = false;
+};
+
+template<>
+inline constexpr bool attaches_file_descriptors<SharedMemoryBuffer> = true;
+
+}  // namespace mcga::proc
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#include "shared_memory_buffer_posix.hpp"
+#else
+#error "Non-unix systems are not currently supported by mcga::proc."
+#endif
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+
+#include <system_error>
+#include <utility>
+
+#include "anonymous_file_posix.hpp"
+
+namespace mcga::proc {
+
+inline SharedMemoryBuffer SharedMemoryBuffer::Create(std::size_t size) {
+    SharedMemoryBuffer buffer;
+    buffer.fd
+      = internal::CreateAnonymousFile("SharedMemoryBuffer:create", true);
+    buffer.writable = true;
+    if (ftruncate(buffer.fd, static_cast<off_t>(size)) != 0) {
+        throw std::system_error(
+          errno, std::generic_category(), "SharedMemoryBuffer:ftruncate");
+    }
+#ifdef __linux__
+    // Receivers can then map the whole size without risking SIGBUS.
+    if (fcntl(buffer.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+        throw std::system_error(
+          errno, std::generic_category(), "SharedMemoryBuffer:seal");
+    }
+#endif
+    if (size == 0) {
+        return buffer;
+    }
+    void* mapping
+      = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer.fd, 0);
+    if (mapping == MAP_FAILED) {
+        throw std::system_error(
+          errno, std::generic_category(), "SharedMemoryBuffer:mmap");
+    }
+    buffer.mapping = static_cast<std::uint8_t*>(mapping);
+    buffer.mappingSize = size;
+#ifdef __linux__
+    // A forked child inheriting the writable mapping would keep seal() from
+    // working.
+    madvise(mapping, size, MADV_DONTFORK);
+#endif
+    return buffer;
+}
+
+inline SharedMemoryBuffer SharedMemoryBuffer::Map(int fd, std::size_t size) {
+    if (fd < 0) {
+        throw std::system_error(
+          EBADF, std::generic_category(), "SharedMemoryBuffer:read");
+    }
+    SharedMemoryBuffer buffer;
+    if (size == 0) {
+        return buffer;
+    }
+    // Pages past the end of the file would raise SIGBUS when read.
+    struct stat status {};
+    if (fstat(fd, &status) != 0) {
+        throw std::system_error(
+          errno, std::generic_category(), "SharedMemoryBuffer:fstat");
+    }
+    if (status.st_size < 0
+        || size > static_cast<std::uint64_t>(status.st_size)) {
+        throw std::system_error(
+          EINVAL, std::generic_category(), "SharedMemoryBuffer:read");
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        throw std::system_error(
+          errno, std::generic_category(), "SharedMemoryBuffer:mmap");
+    }
+    buffer.mapping = static_cast<std::uint8_t*>(mapping);
+    buffer.mappingSize = size;
+    return buffer;
+}
+
+inline void SharedMemoryBuffer::seal() const {
+    if (!writable) {
+        return;
+    }
+    if (mapping != nullptr) {
+        // Replaces the writable mapping in place, as pages cannot be sealed
+        // against writes while a shared one exists. A private read-only
+        // mapping still shows the same pages.
+        void* readOnly = mmap(mapping,
+                              mappingSize,
+                              PROT_READ,
+                              MAP_PRIVATE | MAP_FIXED,
+                              fd,
+                              0);
+        if (readOnly == MAP_FAILED) {
+            throw std::system_error(
+              errno, std::generic_category(), "SharedMemoryBuffer:mmap");
+        }
+    }
+    writable = false;
+#ifdef __linux__
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE) != 0) {
+        throw std::system_error(
+          errno, std::generic_category(), "SharedMemoryBuffer:seal");
+    }
+#endif
+}
+
+inline SharedMemoryBuffer::SharedMemoryBuffer(
+  SharedMemoryBuffer&& other) noexcept
+        : fd(std::exchange(other.fd, -1)),
+          mapping(std::exchange(other.mapping, nullptr)),
+          mappingSize(std::exchange(other.mappingSize, 0)),
+          writable(std::exchange(other.writable, false)) {
+}
+
+inline SharedMemoryBuffer&
+  SharedMemoryBuffer::operator=(SharedMemoryBuffer&& other) noexcept {
+    if (this != &other) {
+        reset();
+        fd = std::exchange(other.fd, -1);
+        mapping = std::exchange(other.mapping, nullptr);
+        mappingSize = std::exchange(other.mappingSize, 0);
+        writable = std::exchange(other.writable, false);
+    }
+    return *this;
+}
+
+inline SharedMemoryBuffer::~SharedMemoryBuffer() {
+    reset();
+}
+
+inline void SharedMemoryBuffer::reset() {
+    if (mapping != nullptr) {
+        munmap(mapping, mappingSize);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    fd = -1;
+    mapping = nullptr;
+    mappingSize = 0;
+    writable = false;
+}
+
+}  // namespace mcga::proc
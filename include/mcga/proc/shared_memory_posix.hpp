@@ -0,0 +1,528 @@
+#pragma once
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <system_error>
+
+#include "anonymous_file_posix.hpp"
+
+namespace mcga::proc::internal {
+
+// Start of the mapping shared by both ends of a shared memory channel, right
+// before the bytes of the ring buffer.
+struct SharedRingHeader {
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+    static_assert(std::atomic_bool::is_always_lock_free);
+
+    // Total number of bytes ever written to / read from the ring. Only the
+    // writer moves the head, and only the reader moves the tail.
+    alignas(64) std::atomic<std::uint64_t> head = 0;
+    alignas(64) std::atomic<std::uint64_t> tail = 0;
+
+    // Set by each end right before it goes to sleep, so the other end only
+    // makes a system call to wake it up when it actually sleeps.
+    alignas(64) std::atomic_bool readerWaiting = false;
+    std::atomic_bool writerWaiting = false;
+
+    // The tail the writer waits for. The reader frees the bytes of one message
+    // at a time, so waking the writer for each of them would ping-pong.
+    std::atomic<std::uint64_t> writerWakeUpTail = 0;
+};
+
+// Shared mapping of an anonymous file, inherited by processes forked after it
+// is created. Both ends of the channel share it until the last one is gone.
+// The header takes the first page, and the ring's pages are mapped twice in a
+// row after it, so that any `capacity` bytes of the ring are contiguous.
+class SharedRingMapping {
+  public:
+    explicit SharedRingMapping(std::size_t minCapacity)
+            : capacity(RoundToPages(minCapacity)),
+              mappingSize(PageSize() + 2 * capacity) {
+        int fd = CreateAnonymousFile("createSharedMemoryChannel:create");
+        if (ftruncate(fd, static_cast<off_t>(PageSize() + capacity)) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(
+              error, std::generic_category(), "createSharedMemoryChannel:mmap");
+        }
+        mapping = mmap(nullptr,
+                       mappingSize,
+                       PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+        if (mapping == MAP_FAILED
+            || mmap(mapping,
+                    PageSize() + capacity,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED,
+                    fd,
+                    0)
+                 == MAP_FAILED
+            || mmap(data() + capacity,
+                    capacity,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED,
+                    fd,
+                    static_cast<off_t>(PageSize()))
+                 == MAP_FAILED) {
+            int error = errno;
+            if (mapping != MAP_FAILED) {
+                munmap(mapping, mappingSize);
+            }
+            ::close(fd);
+            throw std::system_error(
+              error, std::generic_category(), "createSharedMemoryChannel:mmap");
+        }
+        // The mappings keep the pages alive.
+        ::close(fd);
+        new (mapping) SharedRingHeader();
+    }
+
+    SharedRingMapping(const SharedRingMapping&) = delete;
+    SharedRingMapping& operator=(const SharedRingMapping&) = delete;
+
+    ~SharedRingMapping() {
+        munmap(mapping, mappingSize);
+    }
+
+    [[nodiscard]] SharedRingHeader& header() const {
+        return *static_cast<SharedRingHeader*>(mapping);
+    }
+
+    // The byte at position `position` of the stream, followed by the next
+    // `capacity` - 1 ones.
+    [[nodiscard]] std::uint8_t* at(std::uint64_t position) const {
+        return data() + position % capacity;
+    }
+
+    const std::size_t capacity;
+
+  private:
+    static std::size_t PageSize() {
+        static const auto pageSize
+          = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        return pageSize;
+    }
+
+    static std::size_t RoundToPages(std::size_t size) {
+        return (std::max(size, std::size_t{1}) + PageSize() - 1) / PageSize()
+               * PageSize();
+    }
+
+    [[nodiscard]] std::uint8_t* data() const {
+        return static_cast<std::uint8_t*>(mapping) + PageSize();
+    }
+
+    std::size_t mappingSize;
+    void* mapping = MAP_FAILED;
+};
+
+// Wake-ups travel through socket pairs rather than pipes, so that waking up an
+// end that is already gone does not raise SIGPIPE.
+inline void WakeUp(int fd) {
+#ifdef MSG_NOSIGNAL
+    constexpr int flags = MSG_NOSIGNAL;
+#else
+    constexpr int flags = 0;
+#endif
+    char byte = 0;
+    // If the socket is full, a wake-up is already pending anyway.
+    [[maybe_unused]] auto ret = ::send(fd, &byte, 1, flags);
+}
+
+// Returns false if the other end closed its side of the wake-up socket.
+inline bool DrainWakeUps(int fd) {
+    char bytes[64];
+    while (true) {
+        auto numBytesRead
+          = ::read(fd, static_cast<char*>(bytes), sizeof(bytes));
+        if (numBytesRead == 0) {
+            return false;
+        }
+        if (numBytesRead < 0) {
+            return true;
+        }
+    }
+}
+
+inline void WaitForWakeUp(int fd, int timeoutMs) {
+    pollfd pollFD{};
+    pollFD.fd = fd;
+    pollFD.events = POLLIN;
+    if (poll(&pollFD, 1, timeoutMs) < 0 && errno != EINTR) {
+        throw std::system_error(
+          errno, std::generic_category(), "SharedMemoryChannel:poll");
+    }
+}
+
+// Returns views of the messages right where they are in the shared ring, and
+// only frees their bytes for the writer on the next call. Messages larger than
+// the ring never are there whole, so they are copied out as they arrive.
+class SharedMemoryPipeReader : public PipeReader {
+  public:
+    SharedMemoryPipeReader(std::shared_ptr<SharedRingMapping> ring,
+                           int wakeUpFD,
+                           int wakeUpWriterFD,
+                           const PipeReaderOptions& options)
+            : ring(std::move(ring)), wakeUpFD(wakeUpFD),
+              wakeUpWriterFD(wakeUpWriterFD),
+              maxMessageSize(
+                std::max(options.maxMessageSize, Message::prefixSize)),
+              allocator(options.allocator), framing(options.framing) {
+    }
+
+    SharedMemoryPipeReader(const SharedMemoryPipeReader&) = delete;
+    SharedMemoryPipeReader& operator=(const SharedMemoryPipeReader&) = delete;
+
+    ~SharedMemoryPipeReader() override {
+        ::close(wakeUpFD);
+        ::close(wakeUpWriterFD);
+    }
+
+    MessageView
+      getNextMessageView(int maxConsecutiveFailedReadAttempts) override {
+        releaseViewedMessage();
+        if (maxConsecutiveFailedReadAttempts == -1) {
+            return waitForMessage(std::nullopt);
+        }
+        for (int i = 0; i <= maxConsecutiveFailedReadAttempts; i++) {
+            auto message = tryTakeMessage();
+            if (!message.isInvalid()) {
+                return message;
+            }
+        }
+        return MessageView();
+    }
+
+    MessageView getNextMessageView(std::chrono::nanoseconds timeout) override {
+        releaseViewedMessage();
+        return waitForMessage(deadlineAfter(timeout));
+    }
+
+    [[nodiscard]] int getPollDescriptor() const override {
+        return wakeUpFD;
+    }
+
+    [[nodiscard]] bool isClosed() const override {
+        auto& header = ring->header();
+        return writerGone
+               && header.head.load() - header.tail.load() == numViewedBytes;
+    }
+
+    [[nodiscard]] MessageAllocator* getMessageAllocator() const override {
+        return allocator;
+    }
+
+    [[nodiscard]] ReaderMetrics getMetrics() const override {
+        return metrics.snapshot();
+    }
+
+  private:
+    MessageView waitForMessage(const Deadline& deadline) {
+        while (true) {
+            auto message = tryTakeMessage();
+            if (!message.isInvalid() || writerGone || isExpired(deadline)) {
+                return message;
+            }
+            metrics.update([](ReaderMetrics& m) { m.numWaits += 1; });
+            WaitForWakeUp(wakeUpFD, pollTimeoutMs(deadline));
+        }
+    }
+
+    MessageView tryTakeMessage() {
+        auto message = takeMessage();
+        if (!message.isInvalid()) {
+            return message;
+        }
+        metrics.update([](ReaderMetrics& m) { m.numEmptyReads += 1; });
+        // Announce that we are about to sleep before checking one last time,
+        // so a concurrent write either shows up here or wakes us up. The
+        // writer is only gone once every process holding it closed it (a
+        // flag in the mapping would be set by copies left behind by fork()).
+        writerGone = !DrainWakeUps(wakeUpFD) || writerGone;
+        ring->header().readerWaiting.store(true);
+        // takeMessage() only loads the head with acquire ordering, which
+        // could otherwise be reordered before the store above.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return takeMessage();
+    }
+
+    // Returns the next message if it is complete, without waiting.
+    MessageView takeMessage() {
+        if (largeMessageSize > 0) {
+            return copyLargeMessage();
+        }
+        auto& header = ring->header();
+        auto tail = header.tail.load(std::memory_order_relaxed);
+        auto numBytes = static_cast<std::size_t>(
+          header.head.load(std::memory_order_acquire) - tail);
+        auto messageHeader
+          = MessageView::ReadHeader(ring->at(tail), numBytes, framing);
+        if (!messageHeader.has_value()) {
+            return MessageView();
+        }
+        if (messageHeader->contentSize
+            > maxMessageSize - messageHeader->headerSize) {
+            throw std::system_error(
+              EMSGSIZE, std::generic_category(), "PipeReader:message");
+        }
+        auto messageSize = messageHeader->headerSize
+                           + messageHeader->contentSize;
+        if (messageSize > ring->capacity) {
+            if (largeMessageCapacity < messageSize) {
+                largeMessage
+                  = std::make_unique_for_overwrite<std::uint8_t[]>(
+                    messageSize);
+                largeMessageCapacity = messageSize;
+            }
+            largeMessageSize = messageSize;
+            return copyLargeMessage();
+        }
+        if (messageSize > numBytes) {
+            return MessageView();
+        }
+        if (largeMessageCapacity > 0) {
+            largeMessage.reset();
+            largeMessageCapacity = 0;
+        }
+        numViewedBytes = messageSize;
+        metrics.update([messageSize](ReaderMetrics& m) {
+            m.numReads += 1;
+            m.numBytesRead += messageSize;
+            m.readSizes.record(messageSize);
+            m.numMessages += 1;
+        });
+        return MessageView::Read(ring->at(tail), messageSize, framing);
+    }
+
+    // Copies what arrived of a message larger than the ring, making room for
+    // the rest right away.
+    MessageView copyLargeMessage() {
+        auto& header = ring->header();
+        auto tail = header.tail.load(std::memory_order_relaxed);
+        auto numBytes = std::min(
+          static_cast<std::size_t>(
+            header.head.load(std::memory_order_acquire) - tail),
+          largeMessageSize - numLargeMessageBytes);
+        if (numBytes == 0) {
+            return MessageView();
+        }
+        std::memcpy(largeMessage.get() + numLargeMessageBytes,
+                    ring->at(tail),
+                    numBytes);
+        numLargeMessageBytes += numBytes;
+        metrics.update([numBytes](ReaderMetrics& m) {
+            m.numReads += 1;
+            m.numBytesRead += numBytes;
+            m.readSizes.record(numBytes);
+        });
+        releaseBytes(numBytes);
+        if (numLargeMessageBytes < largeMessageSize) {
+            return MessageView();
+        }
+        metrics.update([](ReaderMetrics& m) { m.numMessages += 1; });
+        return MessageView::Read(
+          largeMessage.get(), largeMessageSize, framing);
+    }
+
+    // The view returned last is no longer used, its bytes can be overwritten.
+    void releaseViewedMessage() {
+        if (numViewedBytes > 0) {
+            releaseBytes(numViewedBytes);
+            numViewedBytes = 0;
+        }
+        if (largeMessageSize > 0 && numLargeMessageBytes == largeMessageSize) {
+            largeMessageSize = 0;
+            numLargeMessageBytes = 0;
+        }
+    }
+
+    void releaseBytes(std::size_t numBytes) {
+        auto& header = ring->header();
+        auto tail = header.tail.load(std::memory_order_relaxed) + numBytes;
+        header.tail.store(tail);
+        if (header.writerWaiting.load()
+            && tail >= header.writerWakeUpTail.load()
+            && header.writerWaiting.exchange(false)) {
+            WakeUp(wakeUpWriterFD);
+        }
+    }
+
+    std::shared_ptr<SharedRingMapping> ring;
+    int wakeUpFD;
+    int wakeUpWriterFD;
+    std::size_t maxMessageSize;
+    MessageAllocator* allocator;
+    Framing framing;
+    bool writerGone = false;
+    // Bytes of the last returned view, still in the ring.
+    std::size_t numViewedBytes = 0;
+    // A message larger than the ring, and how much of it was copied so far.
+    // The buffer is kept for as long as large messages keep coming.
+    std::unique_ptr<std::uint8_t[]> largeMessage;
+    std::size_t largeMessageCapacity = 0;
+    std::size_t largeMessageSize = 0;
+    std::size_t numLargeMessageBytes = 0;
+    MetricsRecorder<ReaderMetrics> metrics;
+};
+
+class SharedMemoryPipeWriter : public PipeWriter {
+  public:
+    SharedMemoryPipeWriter(std::shared_ptr<SharedRingMapping> ring,
+                           int wakeUpFD,
+                           int wakeUpReaderFD,
+                           Framing framing)
+            : ring(std::move(ring)), wakeUpFD(wakeUpFD),
+              wakeUpReaderFD(wakeUpReaderFD), framing(framing) {
+    }
+
+    ~SharedMemoryPipeWriter() override {
+        ::close(wakeUpFD);
+        ::close(wakeUpReaderFD);
+    }
+
+    void sendBytes(const std::uint8_t* bytes, std::size_t numBytes) override {
+        ByteSpan range(bytes, numBytes);
+        sendBytesVectored(std::span<const ByteSpan>(&range, 1));
+    }
+
+    // Everything is published at once, so the reader sees whole messages
+    // unless they don't fit in the ring.
+    void sendBytesVectored(std::span<const ByteSpan> ranges) override {
+        auto& header = ring->header();
+        auto head = header.head.load(std::memory_order_relaxed);
+        metrics.update([ranges](WriterMetrics& m) {
+            std::size_t numBytes = 0;
+            for (auto range: ranges) {
+                numBytes += range.size();
+            }
+            m.numSends += 1;
+            m.sendSizes.record(numBytes);
+        });
+        for (auto range: ranges) {
+            while (!range.empty()) {
+                auto tail = header.tail.load(std::memory_order_acquire);
+                auto freeBytes = ring->capacity - (head - tail);
+                // Only resume once a good part of the ring is free. This
+                // never exceeds what the reader can free without more bytes.
+                auto minFreeBytes = std::min(range.size(), ring->capacity / 2);
+                if (freeBytes < minFreeBytes) {
+                    metrics.update(
+                      [](WriterMetrics& m) { m.numBlockedWrites += 1; });
+                    publish(head);
+                    waitForTail(head + minFreeBytes - ring->capacity);
+                    continue;
+                }
+                auto numBytes = static_cast<std::size_t>(
+                  std::min<std::uint64_t>(freeBytes, range.size()));
+                std::memcpy(ring->at(head), range.data(), numBytes);
+                head += numBytes;
+                range = range.subspan(numBytes);
+                metrics.update([numBytes](WriterMetrics& m) {
+                    m.numWrites += 1;
+                    m.numBytesWritten += numBytes;
+                });
+            }
+        }
+        publish(head);
+    }
+
+    [[nodiscard]] WriterMetrics getMetrics() const override {
+        return metrics.snapshot();
+    }
+
+    [[nodiscard]] Framing getFraming() const override {
+        return framing;
+    }
+
+  private:
+    void publish(std::uint64_t head) {
+        auto& header = ring->header();
+        header.head.store(head);
+        if (header.readerWaiting.load()
+            && header.readerWaiting.exchange(false)) {
+            WakeUp(wakeUpReaderFD);
+        }
+    }
+
+    void waitForTail(std::uint64_t tail) {
+        auto& header = ring->header();
+        if (!DrainWakeUps(wakeUpFD)) {
+            throw std::system_error(
+              EPIPE, std::generic_category(), "PipeWriter:sendBytes");
+        }
+        header.writerWakeUpTail.store(tail);
+        header.writerWaiting.store(true);
+        if (header.tail.load() >= tail) {
+            return;
+        }
+        metrics.update([](WriterMetrics& m) { m.numWaits += 1; });
+        WaitForWakeUp(wakeUpFD, -1);
+    }
+
+    std::shared_ptr<SharedRingMapping> ring;
+    int wakeUpFD;
+    int wakeUpReaderFD;
+    Framing framing;
+    MetricsRecorder<WriterMetrics> metrics;
+};
+
+}  // namespace mcga::proc::internal
+
+namespace mcga::proc {
+
+inline std::pair<std::unique_ptr<PipeReader>, std::unique_ptr<PipeWriter>>
+  createSharedMemoryChannel(std::size_t capacity,
+                            const PipeReaderOptions& readerOptions) {
+    auto ring = std::make_shared<internal::SharedRingMapping>(capacity);
+    int dataFD[2];
+    int freeBytesFD[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, dataFD) < 0) {
+        throw std::system_error(
+          errno,
+          std::generic_category(),
+          "createSharedMemoryChannel:socketpair");
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, freeBytesFD) < 0) {
+        int error = errno;
+        ::close(dataFD[0]);
+        ::close(dataFD[1]);
+        throw std::system_error(
+          error,
+          std::generic_category(),
+          "createSharedMemoryChannel:socketpair");
+    }
+    int fds[] = {dataFD[0], dataFD[1], freeBytesFD[0], freeBytesFD[1]};
+    for (int fd: fds) {
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+            int error = errno;
+            for (int openFD: fds) {
+                ::close(openFD);
+            }
+            throw std::system_error(
+              error,
+              std::generic_category(),
+              "createSharedMemoryChannel:fcntl (set non-blocking)");
+        }
+    }
+    return {std::make_unique<internal::SharedMemoryPipeReader>(
+              ring, dataFD[0], freeBytesFD[1], readerOptions),
+            std::make_unique<internal::SharedMemoryPipeWriter>(
+              ring, freeBytesFD[0], dataFD[1], readerOptions.framing)};
+}
+
+}  // namespace mcga::proc
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+
+#include "pipe.hpp"
+
+namespace mcga::proc {
+
+// Reads a plain stream of bytes, such as a subprocess's standard output.
+// Unlike a PipeReader, it knows nothing about messages: it hands out lines,
+// or whatever bytes arrived so far.
+class StreamReader {
+  public:
+    virtual ~StreamReader() = default;
+
+    // Waits for at most `timeout` until a full line is available, and returns
+    // it without its '\n'. At the end of the stream, a last line that is not
+    // terminated by a '\n' is returned as well. Returns std::nullopt if the
+    // timeout expires, or if the stream is closed.
+    virtual std::optional<std::string>
+      readLine(std::chrono::nanoseconds timeout) = 0;
+
+    std::optional<std::string> readLine() {
+        return readLine(std::chrono::nanoseconds::max());
+    }
+
+    // Returns the bytes available right now, without blocking, up to
+    // `maxBytes`. The rest is left for the next call, so that a writer faster
+    // than the caller cannot keep it reading forever.
+    virtual std::string readAvailable(std::size_t maxBytes) = 0;
+
+    std::string readAvailable() {
+        return readAvailable(kMaxAvailableBytes);
+    }
+
+    static constexpr std::size_t kMaxAvailableBytes = 1 << 20;
+
+    // Blocks until the writing end is closed, and returns everything that was
+    // not read yet.
+    virtual std::string readAll() = 0;
+
+    // Descriptor that becomes readable whenever new data arrives or the
+    // writing end is closed.
+    [[nodiscard]] virtual int getPollDescriptor() const = 0;
+
+    // Whether the writing end was closed and every byte was read.
+    [[nodiscard]] virtual bool isClosed() const = 0;
+};
+
+// Waits for at most `timeout` until any of `readers` has a full line, and
+// returns it along with its reader. All the readers are drained meanwhile, so
+// a writer never blocks on a stream nobody is waiting on (e.g. a subprocess
+// filling its standard error while the caller waits for standard output).
+// Returns std::nullopt if the timeout expires, or once every reader is closed.
+std::optional<std::pair<StreamReader*, std::string>>
+  readLineFromAny(std::span<StreamReader* const> readers,
+                  std::chrono::nanoseconds timeout
+                  = std::chrono::nanoseconds::max());
+
+}  // namespace mcga::proc
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#include "stream_reader_posix.hpp"
+#else
+#error "Non-unix systems are not currently supported by mcga::proc."
+#endif
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include <algorithm>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+#include "event_poller_posix.hpp"
+
+namespace mcga::proc::internal {
+
+class PosixStreamReader : public StreamReader {
+  public:
+    // Only the read sizes of `options` apply, there are no messages to
+    // allocate.
+    explicit PosixStreamReader(int inputFD,
+                               const PipeReaderOptions& options = {})
+            : inputFD(inputFD), readSize(options) {
+    }
+
+    PosixStreamReader(const PosixStreamReader&) = delete;
+    PosixStreamReader& operator=(const PosixStreamReader&) = delete;
+
+    ~PosixStreamReader() override {
+        ::close(inputFD);
+    }
+
+    std::optional<std::string>
+      readLine(std::chrono::nanoseconds timeout) override {
+        auto deadline = deadlineAfter(timeout);
+        std::size_t searchFrom = bufferReadHead;
+        while (true) {
+            auto newline = buffer.find('\n', searchFrom);
+            if (newline != std::string::npos) {
+                std::string line(
+                  buffer, bufferReadHead, newline - bufferReadHead);
+                consume(newline + 1 - bufferReadHead);
+                return line;
+            }
+            searchFrom = buffer.size();
+            if (readBytes()) {
+                continue;
+            }
+            if (endOfStream) {
+                if (bufferReadHead == buffer.size()) {
+                    return std::nullopt;
+                }
+                std::string line(buffer, bufferReadHead);
+                consume(line.size());
+                return line;
+            }
+            if (isExpired(deadline)) {
+                return std::nullopt;
+            }
+            waitReadable(pollTimeoutMs(deadline));
+        }
+    }
+
+    using StreamReader::readAvailable;
+
+    std::string readAvailable(std::size_t maxBytes) override {
+        while (buffer.size() - bufferReadHead < maxBytes
+               && readBytes(maxBytes - (buffer.size() - bufferReadHead))) {
+        }
+        std::string bytes(buffer,
+                          bufferReadHead,
+                          std::min(maxBytes, buffer.size() - bufferReadHead));
+        consume(bytes.size());
+        return bytes;
+    }
+
+    std::string readAll() override {
+        std::string bytes;
+        while (true) {
+            bytes += readAvailable(std::string::npos);
+            if (endOfStream) {
+                return bytes;
+            }
+            waitReadable(-1);
+        }
+    }
+
+    [[nodiscard]] int getPollDescriptor() const override {
+        return inputFD;
+    }
+
+    [[nodiscard]] bool isClosed() const override {
+        return endOfStream && bufferReadHead == buffer.size();
+    }
+
+  private:
+    // Appends what the kernel has to the buffer, at most `maxBytes`. Returns
+    // false if nothing was read, either because nothing is available or at
+    // the end of the stream.
+    bool readBytes(std::size_t maxBytes = std::string::npos) {
+        if (endOfStream) {
+            return false;
+        }
+        auto numBytesRequested = std::min(readSize.get(), maxBytes);
+        // Growing `buffer` before the read would zero-fill the whole request,
+        // even when nothing comes. Only the bytes read are appended.
+        if (scratchSize < numBytesRequested) {
+            scratch = std::make_unique_for_overwrite<char[]>(readSize.get());
+            scratchSize = readSize.get();
+        }
+        ssize_t numBytesRead;
+        do {
+            numBytesRead = ::read(inputFD, scratch.get(), numBytesRequested);
+        } while (numBytesRead < 0 && errno == EINTR);
+        if (numBytesRead < 0) {
+            int error = errno;
+            if (error == EAGAIN || error == EWOULDBLOCK) {
+                return false;
+            }
+            throw std::system_error(
+              error, std::generic_category(), "StreamReader:read");
+        }
+        if (numBytesRead == 0) {
+            endOfStream = true;
+            return false;
+        }
+        buffer.append(scratch.get(), static_cast<std::size_t>(numBytesRead));
+        // A read cut short by `maxBytes` says nothing about the stream.
+        if (numBytesRequested == readSize.get()) {
+            readSize.update(static_cast<std::size_t>(numBytesRead));
+        }
+        return true;
+    }
+
+    void consume(std::size_t numBytes) {
+        bufferReadHead += numBytes;
+        if (bufferReadHead == buffer.size()) {
+            buffer.clear();
+            bufferReadHead = 0;
+        } else if (bufferReadHead > buffer.size() / 2) {
+            buffer.erase(0, bufferReadHead);
+            bufferReadHead = 0;
+        }
+    }
+
+    void waitReadable(int timeoutMs) const {
+        pollfd pollFD{inputFD, POLLIN, 0};
+        if (poll(&pollFD, 1, timeoutMs) < 0 && errno != EINTR) {
+            throw std::system_error(
+              errno, std::generic_category(), "StreamReader:poll");
+        }
+    }
+
+    int inputFD;
+    AdaptiveReadSize readSize;
+    std::unique_ptr<char[]> scratch;
+    std::size_t scratchSize = 0;
+    std::string buffer;
+    std::size_t bufferReadHead = 0;
+    bool endOfStream = false;
+};
+
+}  // namespace mcga::proc::internal
+
+namespace mcga::proc {
+
+inline std::optional<std::pair<StreamReader*, std::string>>
+  readLineFromAny(std::span<StreamReader* const> readers,
+                  std::chrono::nanoseconds timeout) {
+    auto deadline = internal::deadlineAfter(timeout);
+    std::vector<pollfd> pollFDs;
+    while (true) {
+        pollFDs.clear();
+        for (auto reader: readers) {
+            // Drains the reader even if it has no full line yet.
+            auto line = reader->readLine(std::chrono::nanoseconds::zero());
+            if (line.has_value()) {
+                return std::make_pair(reader, std::move(*line));
+            }
+            if (!reader->isClosed()) {
+                pollFDs.push_back({reader->getPollDescriptor(), POLLIN, 0});
+            }
+        }
+        if (pollFDs.empty() || internal::isExpired(deadline)) {
+            return std::nullopt;
+        }
+        int timeoutMs = internal::pollTimeoutMs(deadline);
+        if (poll(pollFDs.data(), pollFDs.size(), timeoutMs) < 0
+            && errno != EINTR) {
+            throw std::system_error(
+              errno, std::generic_category(), "readLineFromAny:poll");
+        }
+    }
+}
+
+}  // namespace mcga::proc
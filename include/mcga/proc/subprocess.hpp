@@ -1,9 +1,117 @@
 #pragma once
 
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "pipe.hpp"
+#include "stream_reader.hpp"
 
 namespace mcga::proc {
 
+// Where the standard streams of a started executable are connected.
+struct StandardStreamOptions {
+    enum Mode {
+        // Shared with the parent.
+        INHERIT,
+        // Connected to a pipe, see Subprocess::getStandardInput(),
+        // getStandardOutput() and getStandardError().
+        CAPTURE,
+        // Connected to /dev/null.
+        DISCARD,
+        // Only for the standard error: sent wherever the standard output
+        // goes.
+        MERGE_WITH_OUTPUT,
+    };
+
+    Mode input = INHERIT;
+    Mode output = INHERIT;
+    Mode error = INHERIT;
+};
+
+// Settings applied in the child before it starts running, e.g. to keep
+// workers from interfering with each other on a shared host. Failing to apply
+// any of them throws a std::system_error in the parent.
+struct ProcessOptions {
+    struct ResourceLimit {
+        // One of the RLIMIT_* constants of <sys/resource.h>.
+        int resource;
+        std::uint64_t softLimit;
+        std::uint64_t hardLimit;
+    };
+
+    // CPUs the child may run on. Defaults to the parent's affinity. Only
+    // supported on Linux.
+    std::vector<int> cpuAffinity = {};
+
+    std::vector<ResourceLimit> resourceLimits = {};
+
+    // The child's nice value (not an increment over the parent's).
+    std::optional<int> niceness = std::nullopt;
+
+    // One of the SCHED_* policies of <sched.h>, with its static priority.
+    // Only supported on Linux.
+    std::optional<int> schedulingPolicy = std::nullopt;
+    int schedulingPriority = 0;
+
+    // Directory of a cgroup v2 to move the child into. The caller needs
+    // write access to its `cgroup.procs` file.
+    std::string cgroupPath = {};
+};
+
+struct SpawnOptions {
+    struct FileDescriptorMapping {
+        // Descriptor of the parent, made available as `childFD` in the child.
+        // Mappings are applied in order.
+        int parentFD;
+        int childFD;
+    };
+
+    std::string executable = {};
+
+    // Look `executable` up in the PATH if it contains no slash.
+    bool searchPath = false;
+
+    // The child's argv. Defaults to just `executable`.
+    std::vector<std::string> arguments = {};
+
+    // Whether the child starts from the parent's environment, or from an
+    // empty one. `environmentOverrides` are applied on top in either case.
+    bool inheritEnvironment = true;
+    std::map<std::string, std::string> environmentOverrides = {};
+
+    // The child's working directory. Defaults to the parent's.
+    std::string workingDirectory = {};
+
+    // Applied after the standard streams are connected.
+    std::vector<FileDescriptorMapping> fileDescriptorMappings = {};
+
+    StandardStreamOptions standardStreams = {};
+
+    // Applying any of these falls back to fork() + exec().
+    ProcessOptions process = {};
+};
+
+// What a finished subprocess consumed, as reported by the kernel.
+struct ResourceUsage {
+    std::chrono::microseconds userTime{0};
+    std::chrono::microseconds systemTime{0};
+    // Peak resident set size, in bytes.
+    std::size_t maxResidentSetSize = 0;
+    std::size_t majorPageFaults = 0;
+    std::size_t minorPageFaults = 0;
+    std::size_t voluntaryContextSwitches = 0;
+    std::size_t involuntaryContextSwitches = 0;
+};
+
 class Subprocess {
   public:
     enum FinishStatus {
@@ -16,10 +124,22 @@ class Subprocess {
 
     enum KillResult { KILLED, ALREADY_DEAD };
 
-    static std::unique_ptr<Subprocess> Fork(auto&& callable);
+    static std::unique_ptr<Subprocess>
+      Fork(auto&& callable, const ProcessOptions& options = {});
 
+    // Starts `exe` without copying the parent's address space first (see
+    // Spawn()). Throws if the executable cannot be started.
     static std::unique_ptr<Subprocess>
-      Invoke(char* exe, char* const* argv, char* const* envp = nullptr);
+      Invoke(char* exe,
+             char* const* argv,
+             char* const* envp = nullptr,
+             const StandardStreamOptions& standardStreams = {});
+
+    // Starts an executable through posix_spawn(), which does not duplicate the
+    // parent's page tables, so it stays cheap for parents with a large memory
+    // footprint. Unlike with Fork(), failing to execute the program (e.g. a
+    // missing executable) throws a std::system_error in the parent.
+    static std::unique_ptr<Subprocess> Spawn(const SpawnOptions& options);
 
     virtual ~Subprocess() = default;
 
@@ -35,11 +155,68 @@ class Subprocess {
 
     virtual KillResult kill() = 0;
 
+    // Asks the subprocess to exit (with SIGTERM), giving it a chance to clean
+    // up, unlike kill(). Throws std::system_error (ENOTSUP) for subprocesses
+    // that cannot be asked.
+    virtual KillResult terminate() {
+        throw std::system_error(
+          ENOTSUP, std::generic_category(), "Subprocess:terminate");
+    }
+
     virtual FinishStatus getFinishStatus() = 0;
 
     virtual void waitBlocking() = 0;
+
+    // Descriptor that becomes readable once the subprocess finished, e.g. to
+    // wait for it in a PipeReaderSet. Where pidfds are not available, it also
+    // becomes readable when other children finish, so check isFinished().
+    // -1 for subprocesses that cannot provide one.
+    virtual int getExitDescriptor() {
+        return -1;
+    }
+
+    // Collected when the subprocess is reaped, so std::nullopt until
+    // isFinished() returns true, and for subprocesses that do not collect it.
+    // Does not include the subprocess's own children that it did not wait
+    // for.
+    virtual std::optional<ResourceUsage> getResourceUsage() {
+        return std::nullopt;
+    }
+
+    // The parent's ends of the standard streams that were captured (see
+    // StandardStreamOptions), nullptr for the others. They are non-blocking
+    // pipes, so a subprocess writing to both standard output and standard
+    // error must have both drained, e.g. with readLineFromAny() or
+    // communicate(). Writing to the standard input after the subprocess
+    // closed it raises SIGPIPE, unless communicate() does it.
+    virtual PipeWriter* getStandardInput() {
+        return nullptr;
+    }
+
+    virtual StreamReader* getStandardOutput() {
+        return nullptr;
+    }
+
+    virtual StreamReader* getStandardError() {
+        return nullptr;
+    }
+
+    // Sends the end of stream to the subprocess's standard input.
+    virtual void closeStandardInput() {
+    }
+};
+
+struct CapturedOutput {
+    std::string output;
+    std::string error;
 };
 
+// Writes `input` to the captured standard input of `subprocess` and closes it,
+// while reading its captured standard output and error until they are closed.
+// Everything happens at once, so the subprocess never blocks on a full pipe.
+// If the subprocess stops reading its input early, the rest is dropped.
+CapturedOutput communicate(Subprocess& subprocess, std::string_view input = {});
+
 }  // namespace mcga::proc
 
 #if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
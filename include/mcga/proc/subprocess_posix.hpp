@@ -1,57 +1,245 @@
 #pragma once
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include <cerrno>
+#include <climits>
 #include <csignal>
 #include <cstdlib>
 #include <cstring>
 
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
 #include <system_error>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 extern char **environ;
 
 namespace mcga::proc::internal {
 
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__)         \
+  || defined(__OpenBSD__) || defined(__DragonFly__)
+#define MCGA_PROC_HAS_PIPE2
+#endif
+
+// A pipe whose ends are close-on-exec from the start, so that a thread
+// spawning a process concurrently cannot leak them. `flags` may add
+// O_NONBLOCK. Errors are reported as "<where>:pipe" / "<where>:fcntl".
+inline void CreateCloexecPipe(int fds[2], int flags, const char* where) {
+#ifdef MCGA_PROC_HAS_PIPE2
+    if (pipe2(fds, O_CLOEXEC | flags) < 0) {
+        throw std::system_error(
+          errno, std::generic_category(), std::string(where) + ":pipe");
+    }
+#else
+    if (pipe(fds) < 0) {
+        throw std::system_error(
+          errno, std::generic_category(), std::string(where) + ":pipe");
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(fds[i], F_SETFD, FD_CLOEXEC) < 0
+            || ((flags & O_NONBLOCK) != 0
+                && fcntl(fds[i], F_SETFL, O_NONBLOCK) < 0)) {
+            int error = errno;
+            ::close(fds[0]);
+            ::close(fds[1]);
+            throw std::system_error(
+              error, std::generic_category(), std::string(where) + ":fcntl");
+        }
+    }
+#endif
+}
+
+// Fallback for systems without pidfds: a SIGCHLD handler writes a byte to the
+// pipe of every subscriber, each of which then checks whether its own child is
+// the one that exited.
+//
+// The handler is installed process-wide (with SA_RESTART | SA_NOCLDSTOP) the
+// first time a subprocess subscribes, and stays installed. It calls the
+// handler that was installed before it, unless that one takes SA_SIGINFO.
+class ChildExitNotifier {
+    static constexpr std::size_t kMaxSubscribers = 4096;
+
+  public:
+    // Returns both ends of a pipe that becomes readable whenever a child might
+    // have exited. It starts out readable, in case the child exited before
+    // subscribing.
+    static std::pair<int, int> Subscribe() {
+        static std::once_flag installHandlerOnce;
+        std::call_once(installHandlerOnce, InstallHandler);
+        int fds[2];
+        CreateCloexecPipe(fds, O_NONBLOCK, "ChildExitNotifier");
+        std::lock_guard guard(SubscribersMutex());
+        for (auto& subscriber: subscribers) {
+            if (subscriber.load() == 0) {
+                subscriber.store(fds[1] + 1);
+                Notify(fds[1]);
+                return {fds[0], fds[1]};
+            }
+        }
+        ::close(fds[0]);
+        ::close(fds[1]);
+        throw std::system_error(
+          EMFILE, std::generic_category(), "ChildExitNotifier:subscribe");
+    }
+
+    static void Unsubscribe(int readFD, int writeFD) {
+        {
+            std::lock_guard guard(SubscribersMutex());
+            for (auto& subscriber: subscribers) {
+                if (subscriber.load() == writeFD + 1) {
+                    subscriber.store(0);
+                }
+            }
+        }
+        // A handler that already read the descriptor might still write to it.
+        // Handlers only write a byte per subscriber, so this wait is short.
+        while (activeHandlers.load() > 0) {
+            std::this_thread::yield();
+        }
+        ::close(readFD);
+        ::close(writeFD);
+    }
+
+    static void Drain(int readFD) {
+        char bytes[64];
+        while (::read(readFD, static_cast<char*>(bytes), sizeof(bytes)) > 0) {
+        }
+    }
+
+  private:
+    static void InstallHandler() {
+        struct sigaction action {};
+        action.sa_handler = OnChildExit;
+        action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGCHLD, &action, &previousAction) < 0) {
+            throw std::system_error(
+              errno, std::generic_category(), "ChildExitNotifier:sigaction");
+        }
+    }
+
+    static void OnChildExit(int signal) {
+        int savedErrno = errno;
+        activeHandlers.fetch_add(1);
+        for (auto& subscriber: subscribers) {
+            int fd = subscriber.load() - 1;
+            if (fd >= 0) {
+                Notify(fd);
+            }
+        }
+        activeHandlers.fetch_sub(1);
+        if ((previousAction.sa_flags & SA_SIGINFO) == 0
+            && previousAction.sa_handler != SIG_DFL
+            && previousAction.sa_handler != SIG_IGN) {
+            previousAction.sa_handler(signal);
+        }
+        errno = savedErrno;
+    }
+
+    static void Notify(int fd) {
+        char byte = 0;
+        // If the pipe is full, a notification is already pending anyway.
+        [[maybe_unused]] auto ret = ::write(fd, &byte, 1);
+    }
+
+    static std::mutex& SubscribersMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    // Writing ends of the subscribers' pipes, plus one (0 is a free slot).
+    static inline std::atomic_int subscribers[kMaxSubscribers];
+    static inline std::atomic_int activeHandlers = 0;
+    static inline struct sigaction previousAction {};
+};
+
+// Returns -1 if pidfds are not supported by the system.
+inline int OpenPidFD(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    return -1;
+#endif
+}
+
 class PosixSubprocessHandler : public Subprocess {
   public:
     explicit PosixSubprocessHandler(pid_t pid): pid(pid) {
+        exitFD = OpenPidFD(pid);
+        if (exitFD < 0) {
+            std::tie(exitFD, notifierWriteFD) = ChildExitNotifier::Subscribe();
+        }
+    }
+
+    PosixSubprocessHandler(const PosixSubprocessHandler&) = delete;
+    PosixSubprocessHandler& operator=(const PosixSubprocessHandler&) = delete;
+
+    ~PosixSubprocessHandler() override {
+        if (notifierWriteFD >= 0) {
+            ChildExitNotifier::Unsubscribe(exitFD, notifierWriteFD);
+        } else {
+            ::close(exitFD);
+        }
+    }
+
+    int getExitDescriptor() override {
+        return exitFD;
     }
 
     bool isFinished() override {
         if (killed || finished) {
             return true;
         }
+        if (notifierWriteFD >= 0) {
+            ChildExitNotifier::Drain(exitFD);
+        }
         int wStatus;
-        int ret = waitpid(pid, &wStatus, WNOHANG);
+        rusage usage{};
+        int ret = wait4(pid, &wStatus, WNOHANG, &usage);
         if (ret < 0) {
             throw std::system_error(
-              errno, std::generic_category(), "PosixSubprocessHandler:waitpid");
+              errno, std::generic_category(), "PosixSubprocessHandler:wait4");
         }
         if (ret == 0) {
+            ProcessMetricsRecorder().update(
+              [](ProcessMetrics& m) { m.numUnfinishedPolls += 1; });
             return false;
         }
+        ProcessMetricsRecorder().update(
+          [](ProcessMetrics& m) { m.numReaped += 1; });
         finished = true;
         lastWaitStatus = wStatus;
+        resourceUsage = ToResourceUsage(usage);
         return true;
     }
 
     KillResult kill() override {
-        if (isFinished()) {
-            return ALREADY_DEAD;
-        }
-        int killStatus = ::kill(pid, SIGKILL);
-        if (killStatus < 0) {
-            if (errno == ESRCH) {
-                return ALREADY_DEAD;
-            }
-            throw std::system_error(
-              errno, std::generic_category(), "PosixSubprocessHandler:kill");
-        }
-        return KILLED;
+        return sendSignal(SIGKILL);
+    }
+
+    KillResult terminate() override {
+        return sendSignal(SIGTERM);
     }
 
     bool isExited() override {
@@ -94,49 +282,684 @@ class PosixSubprocessHandler : public Subprocess {
             return;
         }
         int wStatus;
-        int ret = waitpid(pid, &wStatus, 0);
+        rusage usage{};
+        int ret;
+        do {
+            ret = wait4(pid, &wStatus, 0, &usage);
+        } while (ret < 0 && errno == EINTR);
         if (ret < 0) {
             throw std::system_error(
-              errno, std::generic_category(), "PosixSubprocessHandler:waitpid");
+              errno, std::generic_category(), "PosixSubprocessHandler:wait4");
         }
+        ProcessMetricsRecorder().update(
+          [](ProcessMetrics& m) { m.numReaped += 1; });
         finished = true;
         lastWaitStatus = wStatus;
+        resourceUsage = ToResourceUsage(usage);
+    }
+
+    std::optional<ResourceUsage> getResourceUsage() override {
+        return resourceUsage;
+    }
+
+    PipeWriter* getStandardInput() override {
+        return standardInput.get();
+    }
+
+    StreamReader* getStandardOutput() override {
+        return standardOutput.get();
+    }
+
+    StreamReader* getStandardError() override {
+        return standardError.get();
+    }
+
+    void closeStandardInput() override {
+        standardInput.reset();
+    }
+
+    void setStandardStreams(std::unique_ptr<PipeWriter> input,
+                            std::unique_ptr<StreamReader> output,
+                            std::unique_ptr<StreamReader> error) {
+        standardInput = std::move(input);
+        standardOutput = std::move(output);
+        standardError = std::move(error);
     }
 
   private:
+    static ResourceUsage ToResourceUsage(const rusage& usage) {
+        auto toMicroseconds = [](const timeval& time) {
+            return std::chrono::seconds(time.tv_sec)
+                   + std::chrono::microseconds(time.tv_usec);
+        };
+#ifdef __APPLE__
+        std::size_t maxRSSUnit = 1;
+#else
+        std::size_t maxRSSUnit = 1024;
+#endif
+        return {
+          .userTime = toMicroseconds(usage.ru_utime),
+          .systemTime = toMicroseconds(usage.ru_stime),
+          .maxResidentSetSize
+          = static_cast<std::size_t>(usage.ru_maxrss) * maxRSSUnit,
+          .majorPageFaults = static_cast<std::size_t>(usage.ru_majflt),
+          .minorPageFaults = static_cast<std::size_t>(usage.ru_minflt),
+          .voluntaryContextSwitches = static_cast<std::size_t>(usage.ru_nvcsw),
+          .involuntaryContextSwitches
+          = static_cast<std::size_t>(usage.ru_nivcsw),
+        };
+    }
+
+    KillResult sendSignal(int signal) {
+        if (isFinished()) {
+            return ALREADY_DEAD;
+        }
+        int killStatus = ::kill(pid, signal);
+        if (killStatus < 0) {
+            if (errno == ESRCH) {
+                return ALREADY_DEAD;
+            }
+            throw std::system_error(
+              errno, std::generic_category(), "PosixSubprocessHandler:kill");
+        }
+        return KILLED;
+    }
+
     pid_t pid;
+    // A pidfd, or the reading end of a ChildExitNotifier pipe (in which case
+    // `notifierWriteFD` is its writing end).
+    int exitFD;
+    int notifierWriteFD = -1;
     bool killed = false;
     bool finished = false;
     int lastWaitStatus = 0;
+    std::optional<ResourceUsage> resourceUsage;
+    std::unique_ptr<PipeWriter> standardInput;
+    std::unique_ptr<StreamReader> standardOutput;
+    std::unique_ptr<StreamReader> standardError;
 };
 
-}  // namespace mcga::proc::internal
 
-namespace mcga::proc {
+// posix_spawn_file_actions_addchdir_np() is not available everywhere. Without
+// it, a working directory falls back to fork() + exec().
+#if (defined(__GLIBC__)                                                        \
+     && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29)))         \
+  || defined(__APPLE__)
+#define MCGA_PROC_SPAWN_HAS_CHDIR
+#endif
+
+inline const ProcessOptions kNoProcessOptions;
+
+struct SpawnRequest {
+    const char* exe;
+    char* const* argv;
+    char* const* envp;
+    bool searchPath = false;
+    std::string workingDirectory = {};
+    std::vector<SpawnOptions::FileDescriptorMapping> fileDescriptorMappings
+      = {};
+    const ProcessOptions* process = &kNoProcessOptions;
+    StandardStreamOptions standardStreams = {};
+};
+
+inline std::vector<std::string> SpawnEnvironment(const SpawnOptions& options) {
+    std::vector<std::string> environment;
+    if (options.inheritEnvironment) {
+        for (char** variable = environ; *variable != nullptr; variable++) {
+            std::string entry = *variable;
+            auto name = entry.substr(0, entry.find('='));
+            if (!options.environmentOverrides.contains(name)) {
+                environment.push_back(std::move(entry));
+            }
+        }
+    }
+    for (const auto& [name, value]: options.environmentOverrides) {
+        environment.push_back(name + "=" + value);
+    }
+    return environment;
+}
+
+// The step of starting a child that failed, reported to the parent.
+enum class SetupStep : int {
+    CGROUP,
+    SETRLIMIT,
+    SCHED_SETSCHEDULER,
+    SETPRIORITY,
+    SCHED_SETAFFINITY,
+    DUP2,
+    CHDIR,
+    EXEC,
+};
+
+inline const char* SetupStepName(SetupStep step) {
+    static constexpr const char* names[] = {
+      "Subprocess:cgroup",
+      "Subprocess:setrlimit",
+      "Subprocess:sched_setscheduler",
+      "Subprocess:setpriority",
+      "Subprocess:sched_setaffinity",
+      "Subprocess:dup2",
+      "Subprocess:chdir",
+      "Subprocess:exec",
+    };
+    return names[static_cast<int>(step)];
+}
+
+// Applies ProcessOptions in a freshly forked child, which reports the first
+// failure to the parent through a pipe. The pipe is closed once the child is
+// ready (or by a successful exec), so the parent blocks until then.
+//
+// Everything that allocates is prepared in the parent.
+class ProcessSetup {
+  public:
+    static bool IsNeeded(const ProcessOptions& options) {
+        return !options.cpuAffinity.empty() || !options.resourceLimits.empty()
+               || options.niceness.has_value()
+               || options.schedulingPolicy.has_value()
+               || !options.cgroupPath.empty();
+    }
+
+    explicit ProcessSetup(const ProcessOptions& options): options(options) {
+        if (!options.cgroupPath.empty()) {
+            cgroupProcsPath = options.cgroupPath + "/cgroup.procs";
+        }
+#ifdef __linux__
+        CPU_ZERO(&cpuSet);
+        for (int cpu: options.cpuAffinity) {
+            if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                throw std::system_error(EINVAL,
+                                        std::generic_category(),
+                                        "Subprocess:sched_setaffinity");
+            }
+            CPU_SET(cpu, &cpuSet);
+        }
+#endif
+        CreateCloexecPipe(reportPipe, 0, "Subprocess");
+    }
+
+    ProcessSetup(const ProcessSetup&) = delete;
+    ProcessSetup& operator=(const ProcessSetup&) = delete;
+
+    ~ProcessSetup() {
+        for (int fd: reportPipe) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    // In the child. Exits if any of the options cannot be applied.
+    void apply() {
+        ::close(reportPipe[0]);
+        reportPipe[0] = -1;
+        if (!cgroupProcsPath.empty()) {
+            int fd = ::open(cgroupProcsPath.c_str(), O_WRONLY | O_CLOEXEC);
+            // Writing 0 moves the writing process.
+            if (fd < 0 || ::write(fd, "0", 1) != 1) {
+                fail(SetupStep::CGROUP);
+            }
+            ::close(fd);
+        }
+        for (const auto& limit: options.resourceLimits) {
+            rlimit value{static_cast<rlim_t>(limit.softLimit),
+                         static_cast<rlim_t>(limit.hardLimit)};
+            if (setrlimit(limit.resource, &value) < 0) {
+                fail(SetupStep::SETRLIMIT);
+            }
+        }
+        if (options.schedulingPolicy.has_value()) {
+#ifdef __linux__
+            sched_param param{};
+            param.sched_priority = options.schedulingPriority;
+            if (sched_setscheduler(0, *options.schedulingPolicy, &param) < 0) {
+                fail(SetupStep::SCHED_SETSCHEDULER);
+            }
+#else
+            fail(SetupStep::SCHED_SETSCHEDULER, ENOTSUP);
+#endif
+        }
+        if (options.niceness.has_value()
+            && setpriority(PRIO_PROCESS, 0, *options.niceness) < 0) {
+            fail(SetupStep::SETPRIORITY);
+        }
+        if (!options.cpuAffinity.empty()) {
+#ifdef __linux__
+            if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) < 0) {
+                fail(SetupStep::SCHED_SETAFFINITY);
+            }
+#else
+            fail(SetupStep::SCHED_SETAFFINITY, ENOTSUP);
+#endif
+        }
+    }
+
+    // In the child, once it is set up and not about to exec.
+    void finish() {
+        ::close(reportPipe[1]);
+        reportPipe[1] = -1;
+    }
+
+    // In the child.
+    [[noreturn]] void fail(SetupStep step, int error = errno) {
+        int report[2] = {static_cast<int>(step), error};
+        [[maybe_unused]] auto ret
+          = ::write(reportPipe[1], report, sizeof(report));
+        _exit(EXIT_FAILURE);
+    }
+
+    // In the parent. Throws (after reaping the child) if the child failed.
+    void wait(pid_t pid) {
+        ::close(reportPipe[1]);
+        reportPipe[1] = -1;
+        int report[2];
+        ssize_t numBytesRead;
+        do {
+            numBytesRead = ::read(reportPipe[0], report, sizeof(report));
+        } while (numBytesRead < 0 && errno == EINTR);
+        if (numBytesRead == sizeof(report)) {
+            waitpid(pid, nullptr, 0);
+            throw std::system_error(
+              report[1],
+              std::generic_category(),
+              SetupStepName(static_cast<SetupStep>(report[0])));
+        }
+    }
+
+  private:
+    const ProcessOptions& options;
+    std::string cgroupProcsPath;
+#ifdef __linux__
+    cpu_set_t cpuSet;
+#endif
+    int reportPipe[2] = {-1, -1};
+};
 
-inline std::unique_ptr<Subprocess> Subprocess::Fork(auto&& callable) {
+// Records the start of a subprocess, from the parent.
+inline void RecordStart(std::chrono::steady_clock::time_point startTime,
+                        bool spawned) {
+    ProcessMetricsRecorder().update([&](ProcessMetrics& m) {
+        auto elapsed = std::chrono::steady_clock::now() - startTime;
+        (spawned ? m.numSpawns : m.numForks) += 1;
+        m.startTimesUs.record(
+          std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+            .count());
+    });
+}
+
+inline pid_t ForkOrThrow() {
+    auto startTime = kMetricsEnabled ? std::chrono::steady_clock::now()
+                                     : std::chrono::steady_clock::time_point();
     pid_t forkPid = fork();
     if (forkPid < 0) {
         throw std::system_error(
           errno, std::generic_category(), "PosixSubprocessHandler:fork");
     }
+    if (forkPid != 0) {
+        RecordStart(startTime, false);
+    }
+    return forkPid;
+}
+
+inline std::unique_ptr<PosixSubprocessHandler>
+  ForkExec(const SpawnRequest& request) {
+    ProcessSetup setup(*request.process);
+    pid_t forkPid = ForkOrThrow();
+    if (forkPid == 0) {  // child process
+        setup.apply();
+        for (const auto& mapping: request.fileDescriptorMappings) {
+            if (dup2(mapping.parentFD, mapping.childFD) < 0) {
+                setup.fail(SetupStep::DUP2);
+            }
+        }
+        if (!request.workingDirectory.empty()
+            && chdir(request.workingDirectory.c_str()) < 0) {
+            setup.fail(SetupStep::CHDIR);
+        }
+        if (request.searchPath) {
+            environ = const_cast<char**>(request.envp);
+            execvp(request.exe, request.argv);
+        } else {
+            execve(request.exe, request.argv, request.envp);
+        }
+        setup.fail(SetupStep::EXEC);
+    }
+    setup.wait(forkPid);
+    return std::make_unique<PosixSubprocessHandler>(forkPid);
+}
+
+// Connects the standard streams of a child about to be started. The child's
+// ends are closed when this goes out of scope, while the parent's ends are
+// handed to the subprocess.
+class StandardStreamPipes {
+  public:
+    explicit StandardStreamPipes(const StandardStreamOptions& options) {
+        connect(STDIN_FILENO, options.input, inputFD);
+        connect(STDOUT_FILENO, options.output, outputFD);
+        if (options.error == StandardStreamOptions::MERGE_WITH_OUTPUT) {
+            mappings.push_back({STDOUT_FILENO, STDERR_FILENO});
+        } else {
+            connect(STDERR_FILENO, options.error, errorFD);
+        }
+    }
+
+    StandardStreamPipes(const StandardStreamPipes&) = delete;
+    StandardStreamPipes& operator=(const StandardStreamPipes&) = delete;
+
+    ~StandardStreamPipes() {
+        for (int fd: {inputFD, outputFD, errorFD}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        for (const auto& mapping: mappings) {
+            if (mapping.parentFD > STDERR_FILENO) {
+                ::close(mapping.parentFD);
+            }
+        }
+    }
+
+    // To apply in the child, before any other mapping.
+    std::vector<SpawnOptions::FileDescriptorMapping> mappings;
+
+    void attachTo(PosixSubprocessHandler& subprocess) {
+        auto reader = [](int& fd) -> std::unique_ptr<StreamReader> {
+            if (fd < 0) {
+                return nullptr;
+            }
+            return std::make_unique<PosixStreamReader>(std::exchange(fd, -1));
+        };
+        std::unique_ptr<PipeWriter> writer;
+        if (inputFD >= 0) {
+            writer = std::make_unique<PosixPipeWriter>(
+              std::exchange(inputFD, -1));
+        }
+        subprocess.setStandardStreams(
+          std::move(writer), reader(outputFD), reader(errorFD));
+    }
+
+  private:
+    void connect(int childFD, StandardStreamOptions::Mode mode, int& parentFD) {
+        if (mode == StandardStreamOptions::INHERIT) {
+            return;
+        }
+        if (mode == StandardStreamOptions::MERGE_WITH_OUTPUT) {
+            throw std::invalid_argument(
+              "Only the standard error can be merged with the output");
+        }
+        if (mode == StandardStreamOptions::DISCARD) {
+            int fd = ::open("/dev/null", O_RDWR | O_CLOEXEC);
+            if (fd < 0) {
+                throw std::system_error(
+                  errno, std::generic_category(), "Subprocess:open");
+            }
+            mappings.push_back({fd, childFD});
+            return;
+        }
+        int fds[2];
+        CreateCloexecPipe(fds, 0, "Subprocess");
+        bool childReads = childFD == STDIN_FILENO;
+        if (fcntl(fds[childReads ? 1 : 0], F_SETFL, O_NONBLOCK) < 0) {
+            int error = errno;
+            ::close(fds[0]);
+            ::close(fds[1]);
+            throw std::system_error(error,
+                                    std::generic_category(),
+                                    "Subprocess:fcntl (set non-blocking)");
+        }
+        parentFD = childReads ? fds[1] : fds[0];
+        mappings.push_back({childReads ? fds[0] : fds[1], childFD});
+    }
+
+    int inputFD = -1;
+    int outputFD = -1;
+    int errorFD = -1;
+};
+
+inline std::unique_ptr<PosixSubprocessHandler>
+  SpawnProcess(const SpawnRequest& request) {
+    if (ProcessSetup::IsNeeded(*request.process)) {
+        return ForkExec(request);
+    }
+#ifndef MCGA_PROC_SPAWN_HAS_CHDIR
+    if (!request.workingDirectory.empty()) {
+        return ForkExec(request);
+    }
+#endif
+    posix_spawn_file_actions_t fileActions;
+    int error = posix_spawn_file_actions_init(&fileActions);
+    if (error != 0) {
+        throw std::system_error(
+          error, std::generic_category(), "Subprocess:posix_spawn");
+    }
+    for (const auto& mapping: request.fileDescriptorMappings) {
+        if (error == 0) {
+            error = posix_spawn_file_actions_adddup2(
+              &fileActions, mapping.parentFD, mapping.childFD);
+        }
+    }
+#ifdef MCGA_PROC_SPAWN_HAS_CHDIR
+    if (error == 0 && !request.workingDirectory.empty()) {
+        error = posix_spawn_file_actions_addchdir_np(
+          &fileActions, request.workingDirectory.c_str());
+    }
+#endif
+    pid_t pid = -1;
+    auto startTime = kMetricsEnabled ? std::chrono::steady_clock::now()
+                                     : std::chrono::steady_clock::time_point();
+    if (error == 0) {
+        // Exec failures in the child are returned as posix_spawn()'s error.
+        error = request.searchPath ? posix_spawnp(&pid,
+                                                  request.exe,
+                                                  &fileActions,
+                                                  nullptr,
+                                                  request.argv,
+                                                  request.envp)
+                                   : posix_spawn(&pid,
+                                                 request.exe,
+                                                 &fileActions,
+                                                 nullptr,
+                                                 request.argv,
+                                                 request.envp);
+    }
+    posix_spawn_file_actions_destroy(&fileActions);
+    if (error != 0) {
+        throw std::system_error(
+          error, std::generic_category(), "Subprocess:posix_spawn");
+    }
+    RecordStart(startTime, true);
+    return std::make_unique<PosixSubprocessHandler>(pid);
+}
+
+inline std::unique_ptr<Subprocess> Spawn(SpawnRequest request) {
+    StandardStreamPipes pipes(request.standardStreams);
+    auto& mappings = request.fileDescriptorMappings;
+    mappings.insert(
+      mappings.begin(), pipes.mappings.begin(), pipes.mappings.end());
+    auto subprocess = SpawnProcess(request);
+    pipes.attachTo(*subprocess);
+    return subprocess;
+}
+
+// Blocks SIGPIPE for the calling thread while it lives, so that writing to a
+// pipe whose reader is gone only fails with EPIPE. A SIGPIPE raised meanwhile
+// is discarded, unless one was already pending.
+class ScopedSIGPIPEBlock {
+  public:
+    ScopedSIGPIPEBlock() {
+        sigemptyset(&sigpipe);
+        sigaddset(&sigpipe, SIGPIPE);
+        sigset_t pending;
+        sigpending(&pending);
+        wasPending = sigismember(&pending, SIGPIPE) == 1;
+        pthread_sigmask(SIG_BLOCK, &sigpipe, &previousMask);
+    }
+
+    ScopedSIGPIPEBlock(const ScopedSIGPIPEBlock&) = delete;
+    ScopedSIGPIPEBlock& operator=(const ScopedSIGPIPEBlock&) = delete;
+
+    ~ScopedSIGPIPEBlock() {
+        int error = errno;
+        if (!wasPending) {
+            // Only waits if the signal is pending, so it returns right away.
+            sigset_t pending;
+            sigpending(&pending);
+            int signal = 0;
+            if (sigismember(&pending, SIGPIPE) == 1) {
+                sigwait(&sigpipe, &signal);
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+        errno = error;
+    }
+
+  private:
+    sigset_t sigpipe{};
+    sigset_t previousMask{};
+    bool wasPending = false;
+};
+
+// Writes to a pipe whose reader might be gone, failing with EPIPE without
+// raising SIGPIPE.
+inline ssize_t WriteWithoutSIGPIPE(int fd, const void* data, std::size_t size) {
+#ifdef F_SETNOSIGPIPE
+    if (fcntl(fd, F_SETNOSIGPIPE, 1) == 0) {
+        return ::write(fd, data, size);
+    }
+#endif
+    ScopedSIGPIPEBlock block;
+    return ::write(fd, data, size);
+}
+
+}  // namespace mcga::proc::internal
+
+namespace mcga::proc {
+
+inline std::unique_ptr<Subprocess>
+  Subprocess::Fork(auto&& callable, const ProcessOptions& options) {
+    // Without options there is nothing to wait for, so the child can start
+    // running without a round trip to the parent.
+    if (!internal::ProcessSetup::IsNeeded(options)) {
+        pid_t forkPid = internal::ForkOrThrow();
+        if (forkPid == 0) {  // child process
+            std::forward<decltype(callable)>(callable)();
+            exit(EXIT_SUCCESS);
+        }
+        return std::make_unique<internal::PosixSubprocessHandler>(forkPid);
+    }
+    internal::ProcessSetup setup(options);
+    pid_t forkPid = internal::ForkOrThrow();
     if (forkPid == 0) {  // child process
+        setup.apply();
+        setup.finish();
         std::forward<decltype(callable)>(callable)();
         exit(EXIT_SUCCESS);
     }
+    setup.wait(forkPid);
     return std::make_unique<internal::PosixSubprocessHandler>(forkPid);
 }
 
 inline std::unique_ptr<Subprocess>
-  Subprocess::Invoke(char* exe, char* const* argv, char* const* envp) {
+  Subprocess::Invoke(char* exe,
+                     char* const* argv,
+                     char* const* envp,
+                     const StandardStreamOptions& standardStreams) {
     if (envp == nullptr) {
         envp = environ;
     }
-    // TODO: Pipe stdout/stderr?
-    return Fork([exe, argv, envp]() {
-        execve(exe, argv, envp);
-        exit(EXIT_FAILURE);
+    return internal::Spawn({
+      .exe = exe,
+      .argv = argv,
+      .envp = envp,
+      .standardStreams = standardStreams,
+    });
+}
+
+inline std::unique_ptr<Subprocess>
+  Subprocess::Spawn(const SpawnOptions& options) {
+    std::vector<std::string> arguments = options.arguments;
+    if (arguments.empty()) {
+        arguments.push_back(options.executable);
+    }
+    auto environment = internal::SpawnEnvironment(options);
+    std::vector<char*> argv;
+    for (auto& argument: arguments) {
+        argv.push_back(argument.data());
+    }
+    argv.push_back(nullptr);
+    std::vector<char*> envp;
+    for (auto& variable: environment) {
+        envp.push_back(variable.data());
+    }
+    envp.push_back(nullptr);
+    return internal::Spawn({
+      .exe = options.executable.c_str(),
+      .argv = argv.data(),
+      .envp = envp.data(),
+      .searchPath = options.searchPath,
+      .workingDirectory = options.workingDirectory,
+      .fileDescriptorMappings = options.fileDescriptorMappings,
+      .process = &options.process,
+      .standardStreams = options.standardStreams,
     });
 }
 
+inline CapturedOutput communicate(Subprocess& subprocess,
+                                  std::string_view input) {
+    CapturedOutput captured;
+    auto inputWriter = subprocess.getStandardInput();
+    if (inputWriter != nullptr) {
+        // Whatever was queued through the writer goes first.
+        inputWriter->flush();
+    }
+    std::pair<StreamReader*, std::string*> outputs[] = {
+      {subprocess.getStandardOutput(), &captured.output},
+      {subprocess.getStandardError(), &captured.error},
+    };
+    std::vector<pollfd> pollFDs;
+    while (true) {
+        if (inputWriter != nullptr && input.empty()) {
+            subprocess.closeStandardInput();
+            inputWriter = nullptr;
+        }
+        pollFDs.clear();
+        if (inputWriter != nullptr) {
+            pollFDs.push_back({inputWriter->getPollDescriptor(), POLLOUT, 0});
+        }
+        for (auto [reader, bytes]: outputs) {
+            if (reader != nullptr && !reader->isClosed()) {
+                pollFDs.push_back({reader->getPollDescriptor(), POLLIN, 0});
+            }
+        }
+        if (pollFDs.empty()) {
+            return captured;
+        }
+        if (poll(pollFDs.data(), pollFDs.size(), -1) < 0 && errno != EINTR) {
+            throw std::system_error(
+              errno, std::generic_category(), "communicate:poll");
+        }
+        if (inputWriter != nullptr) {
+            // Straight to the descriptor rather than through inputWriter,
+            // which raises SIGPIPE and blocks while the pipe is full (the
+            // output would then stop being drained). The rest of `input`
+            // waits here for the next POLLOUT instead.
+            auto numBytesWritten = internal::WriteWithoutSIGPIPE(
+              inputWriter->getPollDescriptor(), input.data(), input.size());
+            if (numBytesWritten >= 0) {
+                input.remove_prefix(static_cast<std::size_t>(numBytesWritten));
+            } else if (errno == EPIPE) {
+                input = {};
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK
+                       && errno != EINTR) {
+                throw std::system_error(
+                  errno, std::generic_category(), "communicate:write");
+            }
+        }
+        for (auto [reader, bytes]: outputs) {
+            if (reader != nullptr) {
+                *bytes += reader->readAvailable();
+            }
+        }
+    }
+}
+
 }  // namespace mcga::proc
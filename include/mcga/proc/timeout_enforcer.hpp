@@ -0,0 +1,141 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "subprocess.hpp"
+
+namespace mcga::proc::internal {
+
+// A subprocess shared between its owner and the TimeoutEnforcer. Both hold
+// `mutex` while calling into the subprocess, so that it is never signalled
+// after its owner reaped it (at which point its pid could be reused).
+struct GuardedSubprocess {
+    std::mutex mutex;
+    // Reset by the owner before it destroys the subprocess.
+    Subprocess* subprocess = nullptr;
+    // Set once the enforcer started killing the subprocess.
+    bool timedOut = false;
+};
+
+// Kills subprocesses as soon as their deadline expires, from a single
+// background thread shared by all of them: first with SIGTERM, then with
+// SIGKILL once the grace period is over as well.
+class TimeoutEnforcer {
+  public:
+    static TimeoutEnforcer& Instance() {
+        // Never destroyed: the thread might still be waiting at exit, and
+        // forked children calling exit() have no thread to join.
+        static auto instance = new TimeoutEnforcer();
+        return *instance;
+    }
+
+    TimeoutEnforcer(const TimeoutEnforcer&) = delete;
+    TimeoutEnforcer& operator=(const TimeoutEnforcer&) = delete;
+
+    void enforce(std::shared_ptr<GuardedSubprocess> subprocess,
+                 std::chrono::steady_clock::time_point deadline,
+                 std::chrono::nanoseconds gracePeriod) {
+        std::lock_guard guard(state->mutex);
+        if (!state->running) {
+            std::thread(Run, state).detach();
+            state->running = true;
+        }
+        state->deadlines.push(
+          {deadline, gracePeriod, std::move(subprocess), false});
+        state->wakeUp.notify_one();
+    }
+
+  private:
+    struct Deadline {
+        std::chrono::steady_clock::time_point time;
+        std::chrono::nanoseconds gracePeriod;
+        std::shared_ptr<GuardedSubprocess> subprocess;
+        bool terminated;
+
+        bool operator>(const Deadline& other) const {
+            return time > other.time;
+        }
+    };
+
+    struct State {
+        std::mutex mutex;
+        std::condition_variable wakeUp;
+        std::priority_queue<Deadline, std::vector<Deadline>, std::greater<>>
+          deadlines;
+        bool running = false;
+    };
+
+    TimeoutEnforcer(): state(new State()) {
+        // The thread does not survive fork(), so a forked child starts over
+        // with a fresh state, leaking the one it inherited (whose mutex and
+        // condition variable might be in use by the parent's thread).
+        pthread_atfork(
+          [] {
+              Instance().state->mutex.lock();
+          },
+          [] {
+              Instance().state->mutex.unlock();
+          },
+          [] {
+              Instance().state = new State();
+          });
+    }
+
+    static void Run(State* state) {
+        std::unique_lock lock(state->mutex);
+        auto& deadlines = state->deadlines;
+        while (true) {
+            if (deadlines.empty()) {
+                state->wakeUp.wait(lock);
+                continue;
+            }
+            if (std::chrono::steady_clock::now() < deadlines.top().time) {
+                // Copied, since the top might change while waiting.
+                auto time = deadlines.top().time;
+                state->wakeUp.wait_until(lock, time);
+                continue;
+            }
+            auto deadline = deadlines.top();
+            deadlines.pop();
+            lock.unlock();
+            auto nextDeadline = Expire(std::move(deadline));
+            lock.lock();
+            if (nextDeadline.has_value()) {
+                deadlines.push(std::move(*nextDeadline));
+            }
+        }
+    }
+
+    // Returns the deadline for SIGKILL after sending SIGTERM, if any.
+    static std::optional<Deadline> Expire(Deadline deadline) {
+        auto& guarded = *deadline.subprocess;
+        std::lock_guard guard(guarded.mutex);
+        if (guarded.subprocess == nullptr || guarded.subprocess->isFinished()) {
+            return std::nullopt;
+        }
+        guarded.timedOut = true;
+        if (!deadline.terminated
+            && deadline.gracePeriod > std::chrono::nanoseconds::zero()) {
+            guarded.subprocess->terminate();
+            deadline.terminated = true;
+            deadline.time += deadline.gracePeriod;
+            return deadline;
+        }
+        guarded.subprocess->kill();
+        return std::nullopt;
+    }
+
+    State* state;
+};
+
+}  // namespace mcga::proc::internal
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pipe.hpp"
+#include "pipe_reader_set.hpp"
+#include "subprocess.hpp"
+#include "worker_subprocess.hpp"
+
+namespace mcga::proc {
+
+struct WorkerPoolOptions {
+    std::size_t numWorkers = 4;
+
+    // Time a worker is given to answer a task before it is killed and
+    // replaced. Can be overridden per task, see submitWithTimeout().
+    std::chrono::nanoseconds taskTimeout = std::chrono::nanoseconds::max();
+
+    // Applied in every worker, including the ones replacing dead workers.
+    ProcessOptions process = {};
+
+    // Worker i runs on the CPUs in `workerAffinities[i % size]`, overriding
+    // `process.cpuAffinity`. See planWorkerAffinities().
+    std::vector<std::vector<int>> workerAffinities = {};
+};
+
+// Pre-forks long-lived duplex WorkerSubprocesses and hands them tasks one at a
+// time, so running a task costs a round trip through their two channels
+// instead of a fork().
+//
+// The handler runs in the workers. It receives each task as a Message and must
+// answer it by sending exactly one message through the given writer. Workers
+// that crash or time out are replaced, and their task is reported as failed.
+class WorkerPool {
+  public:
+    using Handler = std::function<void(Message& task, PipeWriter& results)>;
+
+    struct Result {
+        enum Status {
+            OK,
+            // The worker did not answer within the task's timeout.
+            TIMEOUT,
+            // The worker exited or crashed while running the task.
+            WORKER_DIED,
+        };
+
+        std::uint64_t taskId;
+        Status status;
+        // The worker's answer, invalid unless `status` is OK.
+        Message message;
+    };
+
+    explicit WorkerPool(Handler handler, const WorkerPoolOptions& options = {})
+            : handler(std::move(handler)), options(options) {
+        workers.resize(options.numWorkers);
+        for (std::size_t i = 0; i < workers.size(); i++) {
+            spawnWorker(i);
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Idle workers exit once their task pipe is closed. Workers that are still
+    // running a task are killed.
+    ~WorkerPool() {
+        for (auto& worker: workers) {
+            readerSet.remove(worker.process->getPipeReader());
+            worker.process->closeInput();
+        }
+        for (auto& worker: workers) {
+            if (worker.task.has_value()) {
+                worker.process->kill();
+            }
+            worker.process->waitBlocking();
+        }
+    }
+
+    // Queues a task made of the serialized `args`, and returns its id.
+    template<class... Args>
+    std::uint64_t submit(const Args&... args) {
+        return submitWithTimeout(options.taskTimeout, args...);
+    }
+
+    template<class... Args>
+    std::uint64_t submitWithTimeout(std::chrono::nanoseconds timeout,
+                                    const Args&... args) {
+        auto taskId = nextTaskId++;
+        QueuedTask task{.id = taskId, .timeout = timeout, .bytes = {}};
+        Message::Write(
+          [&task](const void* data, std::size_t size) {
+              auto bytes = static_cast<const std::uint8_t*>(data);
+              task.bytes.insert(task.bytes.end(), bytes, bytes + size);
+          },
+          args...);
+        queuedTasks.push_back(std::move(task));
+        dispatchQueuedTasks();
+        return taskId;
+    }
+
+    // Blocks until at least one task is finished, then returns the results
+    // of every finished task. Returns an empty vector immediately if no task
+    // is pending.
+    std::vector<Result> getResults() {
+        return waitForResults(std::nullopt);
+    }
+
+    // Same as getResults(), but waits for at most `timeout`. Returns an empty
+    // vector if the timeout expires.
+    std::vector<Result> getResults(std::chrono::nanoseconds timeout) {
+        return waitForResults(internal::deadlineAfter(timeout));
+    }
+
+    // Tasks that were submitted but whose result was not returned yet.
+    [[nodiscard]] std::size_t getNumPendingTasks() const {
+        return queuedTasks.size() + numRunningTasks;
+    }
+
+    [[nodiscard]] std::size_t getNumWorkers() const {
+        return workers.size();
+    }
+
+  private:
+    struct QueuedTask {
+        std::uint64_t id;
+        std::chrono::nanoseconds timeout;
+        std::vector<std::uint8_t> bytes;
+    };
+
+    struct RunningTask {
+        std::uint64_t id;
+        internal::Deadline deadline;
+    };
+
+    struct Worker {
+        std::unique_ptr<WorkerSubprocess> process;
+        std::optional<RunningTask> task;
+    };
+
+    void spawnWorker(std::size_t index) {
+        WorkerOptions workerOptions{.process = options.process};
+        if (!options.workerAffinities.empty()) {
+            workerOptions.process.cpuAffinity
+              = options.workerAffinities[index
+                                         % options.workerAffinities.size()];
+        }
+        auto process = std::make_unique<WorkerSubprocess>(
+          std::chrono::nanoseconds::max(),
+          [this](std::unique_ptr<PipeWriter> resultWriter,
+                 std::unique_ptr<PipeReader> taskReader) {
+              // Drop every descriptor meant for the parent, otherwise the
+              // other workers would never see their pipes closed.
+              workers.clear();
+              while (true) {
+                  auto task = taskReader->getNextMessage();
+                  if (task.isInvalid()) {
+                      break;
+                  }
+                  handler(task, *resultWriter);
+              }
+          },
+          workerOptions);
+        auto& worker = workers[index];
+        worker.process = std::move(process);
+        worker.task.reset();
+        readerSet.add(worker.process->getPipeReader());
+        workerIndices[worker.process->getPipeReader()] = index;
+    }
+
+    void replaceWorker(std::size_t index) {
+        auto& worker = workers[index];
+        worker.process->kill();
+        worker.process->waitBlocking();
+        if (worker.task.has_value()) {
+            numRunningTasks -= 1;
+        }
+        readerSet.remove(worker.process->getPipeReader());
+        workerIndices.erase(worker.process->getPipeReader());
+        spawnWorker(index);
+    }
+
+    void dispatchQueuedTasks() {
+        std::size_t i = 0;
+        while (i < workers.size() && !queuedTasks.empty()) {
+            auto& worker = workers[i];
+            if (worker.task.has_value()) {
+                i++;
+                continue;
+            }
+            // A worker that died while idle has no task to report.
+            if (worker.process->isFinished()
+                || worker.process->getPipeReader()->isClosed()) {
+                replaceWorker(i);
+            }
+            auto task = std::move(queuedTasks.front());
+            queuedTasks.pop_front();
+            worker.task
+              = RunningTask{task.id, internal::deadlineAfter(task.timeout)};
+            numRunningTasks += 1;
+            if (!sendTask(*worker.process, task)) {
+                // Died since: the task goes to its replacement instead.
+                queuedTasks.push_front(std::move(task));
+                replaceWorker(i);
+                continue;
+            }
+            i++;
+        }
+    }
+
+    // Returns false if the worker is gone, without raising SIGPIPE.
+    static bool sendTask(WorkerSubprocess& process, const QueuedTask& task) {
+        internal::ScopedSIGPIPEBlock block;
+        try {
+            process.getPipeWriter()->sendBytes(task.bytes.data(),
+                                               task.bytes.size());
+        } catch (const std::system_error& error) {
+            if (error.code() != std::errc::broken_pipe) {
+                throw;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<Result> waitForResults(const internal::Deadline& deadline) {
+        std::vector<Result> results;
+        while (getNumPendingTasks() > 0) {
+            auto waitDeadline = deadline;
+            for (auto& worker: workers) {
+                if (worker.task.has_value() && worker.task->deadline.has_value()
+                    && (!waitDeadline.has_value()
+                        || *worker.task->deadline < *waitDeadline)) {
+                    waitDeadline = worker.task->deadline;
+                }
+            }
+            auto entries = waitDeadline.has_value()
+                             ? readerSet.getNextMessages(
+                               *waitDeadline - std::chrono::steady_clock::now())
+                             : readerSet.getNextMessages();
+            for (auto& [reader, message]: entries) {
+                collectResult(workerIndices.at(reader), message, results);
+            }
+            for (std::size_t i = 0; i < workers.size(); i++) {
+                auto& task = workers[i].task;
+                if (task.has_value() && internal::isExpired(task->deadline)) {
+                    results.push_back({task->id, Result::TIMEOUT, Message()});
+                    replaceWorker(i);
+                }
+            }
+            dispatchQueuedTasks();
+            if (!results.empty() || internal::isExpired(deadline)) {
+                break;
+            }
+        }
+        return results;
+    }
+
+    void collectResult(std::size_t index,
+                       Message& message,
+                       std::vector<Result>& results) {
+        auto& worker = workers[index];
+        if (message.isInvalid()) {
+            if (worker.task.has_value()) {
+                results.push_back(
+                  {worker.task->id, Result::WORKER_DIED, Message()});
+            }
+            replaceWorker(index);
+            return;
+        }
+        // Messages beyond the one answer to a task are dropped.
+        if (!worker.task.has_value()) {
+            return;
+        }
+        results.push_back({worker.task->id, Result::OK, std::move(message)});
+        worker.task.reset();
+        numRunningTasks -= 1;
+    }
+
+    Handler handler;
+    WorkerPoolOptions options;
+    std::vector<Worker> workers;
+    std::unordered_map<PipeReader*, std::size_t> workerIndices;
+    PipeReaderSet readerSet;
+    std::deque<QueuedTask> queuedTasks;
+    std::size_t numRunningTasks = 0;
+    std::uint64_t nextTaskId = 0;
+};
+
+}  // namespace mcga::proc
@@ -1,95 +1,256 @@
 #pragma once
 
+#include <poll.h>
+
+#include <cerrno>
+
 #include <chrono>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 
 #include "pipe.hpp"
 #include "subprocess.hpp"
+#include "timeout_enforcer.hpp"
 
 namespace mcga::proc {
 
+struct WorkerOptions {
+    enum Transport {
+        PIPE,
+        // See createSharedMemoryChannel().
+        SHARED_MEMORY,
+    };
+
+    // How messages travel between the worker and the parent.
+    Transport transport = PIPE;
+
+    // Size of the ring buffer of the SHARED_MEMORY transport.
+    std::size_t sharedMemoryCapacity = 1 << 20;
+
+    // Kill the worker from a background thread as soon as its time limit
+    // expires, rather than the next time getFinishStatus() is called. The
+    // worker is sent SIGTERM first, and SIGKILL if it is still alive after
+    // `gracePeriod` (right away if it is zero).
+    bool enforceTimeLimit = false;
+    std::chrono::nanoseconds gracePeriod = std::chrono::nanoseconds::zero();
+
+    // Applied in the worker before `work` starts, see Subprocess::Fork().
+    ProcessOptions process = {};
+};
+
+// A forked child running `work`, which receives the writing end of a channel
+// to the parent. If `work` also accepts a PipeReader, it receives the reading
+// end of a second channel, from the parent (see getPipeWriter()), so one
+// long-lived worker can serve a stream of requests.
 class WorkerSubprocess : public Subprocess {
   public:
     template<class Work>
-    WorkerSubprocess(const std::chrono::nanoseconds& timeLimit, Work&& work)
+    WorkerSubprocess(const std::chrono::nanoseconds& timeLimit,
+                     Work&& work,
+                     const WorkerOptions& options = {})
             : startTime(std::chrono::high_resolution_clock::now()),
               timeLimit(timeLimit) {
-        auto [reader, writer] = createAnonymousPipe();
+        constexpr bool isDuplex
+          = std::is_invocable_v<Work,
+                                std::unique_ptr<PipeWriter>,
+                                std::unique_ptr<PipeReader>>;
+        auto [reader, writer] = createChannel(options);
         pipeReader = std::move(reader);
-        subprocess
-          = Subprocess::Fork([writer = std::move(writer),
-                              work = std::forward<Work>(work)]() mutable {
-                std::forward<Work>(work)(std::move(writer));
-            });
+        std::unique_ptr<PipeReader> inputReader;
+        if constexpr (isDuplex) {
+            std::tie(inputReader, pipeWriter) = createChannel(options);
+        }
+        subprocess = Subprocess::Fork(
+          [this,
+           writer = std::move(writer),
+           inputReader = std::move(inputReader),
+           work = std::forward<Work>(work)]() mutable {
+              // The child must not keep the parent's ends open, otherwise it
+              // would never notice the parent going away.
+              pipeReader.reset();
+              pipeWriter.reset();
+              if constexpr (isDuplex) {
+                  std::forward<Work>(work)(std::move(writer),
+                                           std::move(inputReader));
+              } else {
+                  std::forward<Work>(work)(std::move(writer));
+              }
+          },
+          options.process);
         writer.reset();
+        inputReader.reset();
+        guarded->subprocess = subprocess.get();
+        if (options.enforceTimeLimit) {
+            internal::TimeoutEnforcer::Instance().enforce(
+              guarded,
+              std::chrono::steady_clock::now() + timeLimit,
+              options.gracePeriod);
+        }
     }
 
     WorkerSubprocess(WorkerSubprocess&& other) noexcept
             : subprocess(std::move(other.subprocess)),
               pipeReader(std::move(other.pipeReader)),
-              startTime(other.startTime), timeLimit(other.timeLimit) {
+              pipeWriter(std::move(other.pipeWriter)),
+              guarded(std::move(other.guarded)), startTime(other.startTime),
+              timeLimit(other.timeLimit) {
     }
 
     WorkerSubprocess(const WorkerSubprocess& other) = delete;
 
-    ~WorkerSubprocess() override = default;
+    ~WorkerSubprocess() override {
+        if (guarded != nullptr) {
+            std::lock_guard guard(guarded->mutex);
+            guarded->subprocess = nullptr;
+        }
+    }
 
     std::chrono::nanoseconds elapsedTime() const {
         return std::chrono::high_resolution_clock::now() - startTime;
     }
 
+    // Every call into the subprocess holds the guard's lock, since the
+    // TimeoutEnforcer might be killing it from another thread.
+
     bool isFinished() override {
+        std::lock_guard guard(guarded->mutex);
         return subprocess->isFinished();
     }
 
     Subprocess::KillResult kill() override {
+        std::lock_guard guard(guarded->mutex);
         return subprocess->kill();
     }
 
+    Subprocess::KillResult terminate() override {
+        std::lock_guard guard(guarded->mutex);
+        return subprocess->terminate();
+    }
+
     bool isExited() override {
+        std::lock_guard guard(guarded->mutex);
         return subprocess->isExited();
     }
 
     int getReturnCode() override {
+        std::lock_guard guard(guarded->mutex);
         return subprocess->getReturnCode();
     }
 
     bool isSignaled() override {
+        std::lock_guard guard(guarded->mutex);
         return subprocess->isSignaled();
     }
 
     int getSignal() override {
+        std::lock_guard guard(guarded->mutex);
         return subprocess->getSignal();
     }
 
     Subprocess::FinishStatus getFinishStatus() override {
-        if (!isFinished()) {
+        std::lock_guard guard(guarded->mutex);
+        if (!subprocess->isFinished()) {
             if (elapsedTime() < timeLimit) {
                 return NO_EXIT;
             }
-            auto killStatus = kill();
+            auto killStatus = subprocess->kill();
             if (killStatus == Subprocess::ALREADY_DEAD) {
                 // The child might have finished during a context switch.
                 // In this case, return false so we can retry waiting it later.
                 return NO_EXIT;
             }
+            guarded->timedOut = true;
+            return TIMEOUT;
+        }
+        if (guarded->timedOut) {
             return TIMEOUT;
         }
         return subprocess->getFinishStatus();
     }
 
+    // Waits on the exit descriptor rather than in waitpid(), so that the lock
+    // is not held (and the TimeoutEnforcer not blocked) meanwhile.
     void waitBlocking() override {
-        subprocess->waitBlocking();
+        pollfd pollFD{getExitDescriptor(), POLLIN, 0};
+        while (!isFinished()) {
+            if (poll(&pollFD, 1, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(
+                  errno, std::generic_category(), "WorkerSubprocess:poll");
+            }
+            if ((pollFD.revents & POLLNVAL) != 0) {
+                throw std::system_error(
+                  EBADF, std::generic_category(), "WorkerSubprocess:poll");
+            }
+        }
+    }
+
+    int getExitDescriptor() override {
+        return subprocess->getExitDescriptor();
+    }
+
+    std::optional<ResourceUsage> getResourceUsage() override {
+        std::lock_guard guard(guarded->mutex);
+        return subprocess->getResourceUsage();
     }
 
     Message getNextMessage(int maxConsecutiveFailedReadAttempts = -1) {
         return pipeReader->getNextMessage(maxConsecutiveFailedReadAttempts);
     }
 
+    Message getNextMessage(std::chrono::nanoseconds timeout) {
+        return pipeReader->getNextMessage(timeout);
+    }
+
+    // The reading end of the pipe the worker sends messages through, e.g. to
+    // register it in a PipeReaderSet.
+    PipeReader* getPipeReader() {
+        return pipeReader.get();
+    }
+
+    // The writing end of the channel to the worker, or nullptr if `work` does
+    // not take a PipeReader. Null after closeInput() too.
+    PipeWriter* getPipeWriter() {
+        return pipeWriter.get();
+    }
+
+    template<class... Args>
+    void sendMessage(const Args&... args) {
+        if (pipeWriter == nullptr) {
+            throw std::logic_error(
+              "WorkerSubprocess:sendMessage: the worker takes no input");
+        }
+        pipeWriter->sendMessage(args...);
+    }
+
+    // Closes the channel to the worker, which then reads an invalid message
+    // once it received everything sent before.
+    void closeInput() {
+        pipeWriter.reset();
+    }
+
   private:
+    static std::pair<std::unique_ptr<PipeReader>, std::unique_ptr<PipeWriter>>
+      createChannel(const WorkerOptions& options) {
+        if (options.transport == WorkerOptions::SHARED_MEMORY) {
+            return createSharedMemoryChannel(options.sharedMemoryCapacity);
+        }
+        return createAnonymousPipe();
+    }
+
     std::unique_ptr<Subprocess> subprocess;
     std::unique_ptr<PipeReader> pipeReader;
+    std::unique_ptr<PipeWriter> pipeWriter;
+    std::shared_ptr<internal::GuardedSubprocess> guarded
+      = std::make_shared<internal::GuardedSubprocess>();
     std::chrono::high_resolution_clock::time_point startTime;
     std::chrono::high_resolution_clock::duration timeLimit;
 };
@@ -0,0 +1,143 @@
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mcga/test.hpp>
+#include <mcga/test_ext/matchers.hpp>
+
+#include "mcga/proc/batch_pipe_writer.hpp"
+#include "mcga/proc/serialization_std.hpp"
+#include "mcga/proc/shared_memory_buffer.hpp"
+
+#include "recording_pipe_writer.hpp"
+
+using namespace mcga::matchers;
+using namespace mcga::proc;
+
+namespace {
+
+// Size of a message holding a single int.
+constexpr std::size_t kIntMessageSize = Message::prefixSize + sizeof(int);
+
+std::vector<int> readInts(const std::vector<std::uint8_t>& bytes) {
+    std::vector<int> values;
+    std::size_t offset = 0;
+    while (offset < bytes.size()) {
+        auto view
+          = MessageView::Read(bytes.data() + offset, bytes.size() - offset);
+        values.push_back(view.read<int>());
+        offset += view.size();
+    }
+    return values;
+}
+
+}  // namespace
+
+TEST_CASE("BatchPipeWriter") {
+    RecordingPipeWriter* recorder = nullptr;
+    std::unique_ptr<BatchPipeWriter> writer;
+
+    auto createWriter = [&](const BatchPipeWriterOptions& options) {
+        auto recording = std::make_unique<RecordingPipeWriter>();
+        recorder = recording.get();
+        writer = std::make_unique<BatchPipeWriter>(std::move(recording),
+                                                   options);
+    };
+
+    tearDown([&] {
+        writer.reset();
+        recorder = nullptr;
+    });
+
+    test("Messages are sent together once the batch is full", [&] {
+        createWriter({.maxBatchBytes = 10 * kIntMessageSize,
+                      .maxDelay = std::chrono::hours(1)});
+        for (int i = 0; i < 9; i++) {
+            writer->sendMessage(i);
+        }
+        expect(recorder->numCalls, isEqualTo(0));
+        expect(writer->getPendingBytes(), isEqualTo(9 * kIntMessageSize));
+        writer->sendMessage(9);
+        expect(recorder->numCalls, isEqualTo(1));
+        expect(writer->getPendingBytes(), isEqualTo(0u));
+        expect(readInts(recorder->bytes)
+               == std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9});
+    });
+
+    test("flush() sends the batch", [&] {
+        createWriter({.maxDelay = std::chrono::hours(1)});
+        writer->sendMessage(1);
+        writer->sendMessage(2);
+        writer->flush();
+        expect(recorder->numCalls, isEqualTo(1));
+        expect(readInts(recorder->bytes) == std::vector<int>{1, 2});
+        writer->flush();
+        expect(recorder->numCalls, isEqualTo(1));
+    });
+
+    test("An old batch is sent along with the next message", [&] {
+        createWriter({.maxDelay = std::chrono::milliseconds(1)});
+        writer->sendMessage(1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        expect(recorder->numCalls, isEqualTo(0));
+        writer->sendMessage(2);
+        expect(recorder->numCalls, isEqualTo(1));
+        expect(readInts(recorder->bytes) == std::vector<int>{1, 2});
+    });
+
+    test("Large messages are sent right away, after the batch", [&] {
+        createWriter({.maxBatchBytes = 100, .maxDelay = std::chrono::hours(1)});
+        std::string payload(1000, 'b');
+        writer->sendMessage(1);
+        writer->sendMessage(payload);
+        expect(recorder->numCalls, isEqualTo(1));
+        auto first = MessageView::Read(recorder->bytes.data(),
+                                       recorder->bytes.size());
+        expect(first.read<int>(), isEqualTo(1));
+        auto second = MessageView::Read(recorder->bytes.data() + first.size(),
+                                        recorder->bytes.size() - first.size());
+        expect(second.read<std::string>() == payload);
+    });
+
+    test("Destroying the writer sends the batch", [] {
+        auto [reader, pipeWriter] = createAnonymousPipe();
+        auto batchWriter = std::make_unique<BatchPipeWriter>(
+          std::move(pipeWriter),
+          BatchPipeWriterOptions{.maxDelay = std::chrono::hours(1)});
+        batchWriter->sendMessage(3);
+        expect(reader->getNextMessage(0).isInvalid(), isTrue);
+        batchWriter.reset();
+        expect(reader->getNextMessage(std::chrono::seconds(5)).read<int>(),
+               isEqualTo(3));
+    });
+
+    test("Descriptors arrive with their own message", [] {
+        int fd[2];
+        expect(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), isEqualTo(0));
+        for (int end: fd) {
+            fcntl(end, F_SETFL, O_NONBLOCK);
+        }
+        auto reader = std::make_unique<internal::PosixPipeReader>(fd[0]);
+        BatchPipeWriter batchWriter(
+          std::make_unique<internal::PosixPipeWriter>(fd[1]),
+          {.maxDelay = std::chrono::hours(1)});
+        batchWriter.sendMessage(1);
+        batchWriter.sendMessage(SharedMemoryBuffer::Create(16));
+        batchWriter.sendMessage(2);
+        batchWriter.flush();
+        std::vector<Message> batch;
+        while (batch.size() < 3
+               && reader->getMessages(batch, std::chrono::seconds(5)) > 0) {
+        }
+        expect(batch.size(), isEqualTo(3u));
+        expect(batch[0].getNumFileDescriptors(), isEqualTo(0u));
+        expect(batch[1].getNumFileDescriptors(), isEqualTo(1u));
+        expect(batch[2].getNumFileDescriptors(), isEqualTo(0u));
+        expect(batch[1].read<SharedMemoryBuffer>().size(), isEqualTo(16u));
+    });
+}
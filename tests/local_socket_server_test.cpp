@@ -0,0 +1,188 @@
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <set>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <mcga/test.hpp>
+#include <mcga/test_ext/matchers.hpp>
+
+#include "mcga/proc/local_socket_server.hpp"
+#include "mcga/proc/serialization_std.hpp"
+#include "mcga/proc/subprocess.hpp"
+
+using namespace mcga::matchers;
+using namespace mcga::proc;
+
+TEST_CASE("Local socket server") {
+    std::string pathname;
+    LocalSocketServer* server = nullptr;
+
+    setUp([&] {
+        pathname = "/tmp/mcga_proc_test_" + std::to_string(getpid()) + ".sock";
+        server = new LocalSocketServer(pathname);
+    });
+
+    tearDown([&] {
+        delete server;
+        server = nullptr;
+    });
+
+    test("Waiting without clients times out", [&] {
+        auto timeout = std::chrono::milliseconds(20);
+        auto start = std::chrono::steady_clock::now();
+        expect(server->getNextMessages(timeout).empty());
+        expect(std::chrono::steady_clock::now() - start >= timeout);
+        expect(server->getNumConnections(), isEqualTo(std::size_t(0)));
+    });
+
+    test("Receiving messages from many clients", [&] {
+        std::vector<std::unique_ptr<PipeWriter>> clients;
+        for (int i = 0; i < 10; i++) {
+            clients.push_back(createLocalClientSocket(pathname));
+            clients.back()->sendMessage(i);
+        }
+        std::set<int> received;
+        std::set<LocalSocketServer::ConnectionId> connections;
+        while (received.size() < 10) {
+            auto entries = server->getNextMessages(std::chrono::seconds(5));
+            expect(!entries.empty());
+            if (entries.empty()) {
+                break;
+            }
+            for (auto& entry: entries) {
+                received.insert(entry.message.read<int>());
+                connections.insert(entry.connection);
+            }
+        }
+        expect(connections.size(), isEqualTo(std::size_t(10)));
+        expect(server->getNumConnections(), isEqualTo(std::size_t(10)));
+    });
+
+    test("A client announcing a huge message is disconnected", [&] {
+        std::size_t hugeSizes[] = {~std::size_t{0} - 15, std::size_t{1} << 46};
+        for (auto size: hugeSizes) {
+            auto rogue = createLocalClientSocket(pathname);
+            auto client = createLocalClientSocket(pathname);
+            std::uint8_t prefix[Message::prefixSize] = {};
+            std::memcpy(prefix, &size, sizeof(size));
+            rogue->sendBytes(prefix, sizeof(prefix));
+            client->sendMessage(5);
+            bool rogueReported = false;
+            bool messageReceived = false;
+            while (!rogueReported || !messageReceived) {
+                auto entries = server->getNextMessages(std::chrono::seconds(5));
+                expect(!entries.empty());
+                if (entries.empty()) {
+                    break;
+                }
+                for (auto& entry: entries) {
+                    if (entry.message.isInvalid()) {
+                        expect(entry.error == std::errc::message_size);
+                        rogueReported = true;
+                    } else {
+                        expect(entry.message.read<int>(), isEqualTo(5));
+                        messageReceived = true;
+                    }
+                }
+            }
+            expect(server->getNumConnections(), isEqualTo(std::size_t(1)));
+            client.reset();
+            server->getNextMessages(std::chrono::seconds(5));
+        }
+    });
+
+    test("A closed connection is reported once", [&] {
+        auto client = createLocalClientSocket(pathname);
+        client->sendMessage(1);
+        client.reset();
+        std::vector<LocalSocketServer::Entry> entries;
+        while (entries.size() < 2) {
+            auto next = server->getNextMessages(std::chrono::seconds(5));
+            if (next.empty()) {
+                break;
+            }
+            for (auto& entry: next) {
+                entries.push_back(std::move(entry));
+            }
+        }
+        expect(entries.size(), isEqualTo(std::size_t(2)));
+        expect(entries[0].message.read<int>(), isEqualTo(1));
+        expect(entries[1].message.isInvalid(), isTrue);
+        expect(!entries[1].error);
+        expect(server->getWriter(entries[1].connection) == nullptr);
+        expect(server->getNumConnections(), isEqualTo(std::size_t(0)));
+        expect(server->getNextMessages(std::chrono::milliseconds(20)).empty());
+    });
+
+    test("Failing to accept a connection is reported", [&] {
+        auto client = createLocalClientSocket(pathname);
+        client->sendMessage(3);
+        // Leave no descriptor for the server to accept the connection with.
+        rlimit limit{};
+        getrlimit(RLIMIT_NOFILE, &limit);
+        int nextFD = dup(0);
+        ::close(nextFD);
+        rlimit lowered = limit;
+        lowered.rlim_cur = static_cast<rlim_t>(nextFD);
+        setrlimit(RLIMIT_NOFILE, &lowered);
+        auto entries = server->getNextMessages(std::chrono::seconds(5));
+        setrlimit(RLIMIT_NOFILE, &limit);
+        expect(entries.size(), isEqualTo(std::size_t(1)));
+        expect(entries[0].connection == LocalSocketServer::kNoConnection);
+        expect(entries[0].error == std::errc::too_many_files_open);
+        entries = server->getNextMessages(std::chrono::seconds(5));
+        expect(entries.size(), isEqualTo(std::size_t(1)));
+        expect(entries[0].message.read<int>(), isEqualTo(3));
+    });
+
+    test("Answering a client", [&] {
+        auto [reader, writer] = createLocalClientConnection(pathname);
+        writer->sendMessage(std::string("ping"));
+        auto entries = server->getNextMessages(std::chrono::seconds(5));
+        expect(entries.size(), isEqualTo(std::size_t(1)));
+        expect(entries[0].message.read<std::string>() == "ping");
+        server->getWriter(entries[0].connection)
+          ->sendMessage(std::string("pong"));
+        auto answer = reader->getNextMessage(std::chrono::seconds(5));
+        expect(answer.isInvalid(), isFalse);
+        expect(answer.read<std::string>() == "pong");
+    });
+
+    test("Collecting from forked clients", [&] {
+        std::vector<std::unique_ptr<Subprocess>> clients;
+        for (int i = 0; i < 8; i++) {
+            clients.push_back(Subprocess::Fork([&pathname, i] {
+                auto writer = createLocalClientSocket(pathname);
+                for (int j = 0; j < 100; j++) {
+                    writer->sendMessage(i, j);
+                }
+            }));
+        }
+        int numMessages = 0;
+        int numClosed = 0;
+        while (numClosed < 8) {
+            auto entries = server->getNextMessages(std::chrono::seconds(5));
+            if (entries.empty()) {
+                break;
+            }
+            for (auto& entry: entries) {
+                if (entry.message.isInvalid()) {
+                    numClosed += 1;
+                } else {
+                    numMessages += 1;
+                }
+            }
+        }
+        expect(numMessages, isEqualTo(800));
+        expect(numClosed, isEqualTo(8));
+        for (auto& client: clients) {
+            client->waitBlocking();
+        }
+    });
+}
@@ -1,22 +1,79 @@
 #include <cstring>
+#include <limits>
+#include <new>
+#include <system_error>
 
 #include <mcga/test.hpp>
 #include <mcga/test_ext/matchers.hpp>
 
 #include "mcga/proc/message.hpp"
+#include "mcga/proc/message_allocator.hpp"
 #include "mcga/proc/serialization_std.hpp"
 
 using namespace mcga::matchers;
 using namespace mcga::proc;
 
+struct CustomPoint {
+    int x;
+    int y;
+
+    void write_custom(binary_writer auto& writer) const {
+        write_from(writer, x, y);
+    }
+
+    void read_custom(binary_reader auto& reader) {
+        read_into(reader, x, y);
+    }
+};
+
+struct SizedCustomPoint : CustomPoint {
+    [[nodiscard]] std::size_t size_custom() const {
+        return 2 * sizeof(int);
+    }
+};
+
 template<class... Args>
-Message buildMessage(const Args&... args) {
+std::size_t countSerializedBytes(const Args&... args) {
+    byte_counter counter;
+    write_from(counter, args...);
+    return counter.numBytes;
+}
+
+template<class T>
+std::vector<std::uint8_t> serialize(const T& value) {
+    std::vector<std::uint8_t> buffer;
+    Message::Write(
+      [&buffer](const void* data, std::size_t size) {
+          auto bytes = static_cast<const std::uint8_t*>(data);
+          buffer.insert(buffer.end(), bytes, bytes + size);
+      },
+      value);
+    expect(buffer.size(),
+           isEqualTo(Message::prefixSize + serialized_size(value)));
+    return buffer;
+}
+
+template<class T>
+T roundTrip(const T& value) {
+    auto buffer = serialize(value);
+    auto message = Message::Read(buffer.data(), buffer.size());
+    return message.template read<T>();
+}
+
+template<class... Args>
+Message buildMessageWithAllocator(MessageAllocator* allocator,
+                                  const Args&... args) {
     char buffer[128];
     Message::Write([buf = buffer](const void* data, std::size_t size) mutable {
         std::memcpy(buf, data, size);
         buf += size;
     }, args...);
-    return Message::Read(buffer, 128);
+    return Message::Read(buffer, 128, allocator);
+}
+
+template<class... Args>
+Message buildMessage(const Args&... args) {
+    return buildMessageWithAllocator(nullptr, args...);
 }
 
 TEST_CASE("Message") {
@@ -138,4 +195,206 @@ TEST_CASE("Message") {
         message >> actualContent;
         expect(actualContent, isEqualTo(messageContent));
     });
+
+    test("Reading a message view from a buffer", [] {
+        uint8_t buffer[100];
+        size_t messageSize = 2 * sizeof(int);
+        int messageContent[2] = {42, 43};
+        memcpy(buffer, &messageSize, sizeof(size_t));
+        memcpy(buffer + Message::prefixSize, messageContent, messageSize);
+
+        MessageView view = MessageView::Read(buffer, 100);
+        expect(view.isInvalid(), isFalse);
+        expect(view.size(), isEqualTo(Message::prefixSize + messageSize));
+        Message detached = view.detach();
+        expect(view.read<int>(), isEqualTo(42));
+        expect(view.read<int>(), isEqualTo(43));
+
+        // The view reads from the buffer in place, the detached copy doesn't.
+        messageContent[0] = 7;
+        memcpy(buffer + Message::prefixSize, messageContent, messageSize);
+        expect(MessageView::Read(buffer, 100).read<int>(), isEqualTo(7));
+        expect(detached.read<int>(), isEqualTo(42));
+        expect(detached.read<int>(), isEqualTo(43));
+    });
+
+    test("Reading a message view from an incomplete buffer", [] {
+        uint8_t buffer[100];
+        size_t messageSize = 200;
+        memcpy(buffer, &messageSize, sizeof(size_t));
+        expect(MessageView::Read(buffer, 100).isInvalid(), isTrue);
+        expect(MessageView::Read(buffer, 4).isInvalid(), isTrue);
+        expect(MessageView().detach().isInvalid(), isTrue);
+    });
+
+    test("Pooled allocator reuses the payloads of destroyed messages", [] {
+        PooledMessageAllocator allocator;
+        for (int i = 0; i < 100; i++) {
+            auto message = buildMessageWithAllocator(&allocator, i, i + 1);
+            auto copy = message;
+            expect(copy.read<int>(), isEqualTo(i));
+            expect(copy.read<int>(), isEqualTo(i + 1));
+        }
+        auto stats = allocator.getStats();
+        expect(stats.allocations, isEqualTo(200u));
+        expect(stats.deallocations, isEqualTo(200u));
+        expect(stats.systemAllocations, isEqualTo(2u));
+    });
+
+    test("Pooled allocator hands oversized payloads to malloc", [] {
+        PooledMessageAllocator allocator(1024);
+        auto payload = allocator.allocate(4096);
+        allocator.deallocate(payload, 4096);
+        bool thrown = false;
+        // E.g. a corrupted size prefix. Volatile, so the compiler does not
+        // warn about the size passed to malloc.
+        volatile std::size_t hugeSize = std::numeric_limits<std::size_t>::max();
+        try {
+            allocator.allocate(hugeSize);
+        } catch (const std::bad_alloc&) {
+            thrown = true;
+        }
+        expect(thrown, isTrue);
+        expect(allocator.getStats().systemAllocations, isEqualTo(2u));
+    });
+
+    test("Default allocator can be replaced", [] {
+        PooledMessageAllocator allocator;
+        MessageAllocator::SetDefault(&allocator);
+        {
+            auto message = buildMessage(1, 2, 3);
+            expect(allocator.getStats().allocations, isEqualTo(1u));
+        }
+        MessageAllocator::SetDefault(nullptr);
+        expect(allocator.getStats().deallocations, isEqualTo(1u));
+        auto message = buildMessage(1, 2, 3);
+        expect(allocator.getStats().allocations, isEqualTo(1u));
+    });
+
+    test("serialized_size matches the number of serialized bytes", [] {
+        static_assert(serialized_size(1, 2.0, 'c') == 13);
+        std::string s = "abcdef";
+        std::vector<int> ints{1, 2, 3};
+        std::vector<std::string> strings{"a", "bc", ""};
+        std::optional<std::string> some = "xyz";
+        std::optional<std::string> none;
+        CustomPoint point{1, 2};
+        SizedCustomPoint sizedPoint;
+        expect(serialized_size(s), isEqualTo(countSerializedBytes(s)));
+        expect(serialized_size(ints), isEqualTo(countSerializedBytes(ints)));
+        expect(serialized_size(strings),
+               isEqualTo(countSerializedBytes(strings)));
+        expect(serialized_size(some, none),
+               isEqualTo(countSerializedBytes(some, none)));
+        expect(serialized_size(point), isEqualTo(2 * sizeof(int)));
+        expect(serialized_size(sizedPoint), isEqualTo(2 * sizeof(int)));
+        expect(serialized_size(), isEqualTo(0u));
+    });
+
+    test("Building & reading a message containing custom types", [] {
+        auto message = buildMessage(CustomPoint{3, 4}, 5);
+        CustomPoint point{};
+        int z;
+        message >> point >> z;
+        expect(point.x, isEqualTo(3));
+        expect(point.y, isEqualTo(4));
+        expect(z, isEqualTo(5));
+    });
+
+    test("Vectors of raw types are written with one call per vector", [] {
+        std::vector<double> samples(10000, 0.5);
+        int numCalls = 0;
+        Message::Write(
+          [&numCalls](const void*, std::size_t) {
+              numCalls += 1;
+          },
+          samples);
+        // One call for the prefix, one for the size, one for the elements.
+        expect(numCalls, isEqualTo(3));
+        expect(roundTrip(samples) == samples);
+    });
+
+    test("Serializing contiguous containers", [] {
+        std::vector<bool> bools{true, false, true};
+        expect(roundTrip(bools) == bools);
+
+        std::vector<CustomPoint> points{{1, 2}, {3, 4}};
+        auto pointsCopy = roundTrip(points);
+        expect(pointsCopy.size(), isEqualTo(2u));
+        expect(pointsCopy[1].x, isEqualTo(3));
+        expect(pointsCopy[1].y, isEqualTo(4));
+
+        std::array<int, 3> ints{1, 2, 3};
+        expect(roundTrip(ints) == ints);
+
+        std::array<std::string, 2> strings{"abc", "de"};
+        expect(roundTrip(strings) == strings);
+
+        std::vector<int> source{4, 5, 6};
+        auto buffer = serialize(std::span<const int>(source));
+        expect(buffer == serialize(source));
+        std::vector<int> target(3);
+        std::span<int> targetSpan(target);
+        Message::Read(buffer.data(), buffer.size()) >> targetSpan;
+        expect(target == source);
+    });
+
+    test("Building & reading a message containing C arrays", [] {
+        int ints[4] = {1, 2, 3, 4};
+        std::string strings[2] = {"a", "bc"};
+        auto message = buildMessage(ints, strings);
+        int intsCopy[4];
+        std::string stringsCopy[2];
+        message >> intsCopy >> stringsCopy;
+        expect(intsCopy[3], isEqualTo(4));
+        expect(stringsCopy[1], isEqualTo(std::string("bc")));
+    });
+
+    test("Compact framing uses varint headers and lengths", [] {
+        std::vector<std::uint8_t> buffer;
+        auto append = [&buffer](const void* data, std::size_t size) {
+            auto bytes = static_cast<const std::uint8_t*>(data);
+            buffer.insert(buffer.end(), bytes, bytes + size);
+        };
+        std::vector<std::string> strings{"abc", std::string(200, 'x')};
+        Message::Write<Framing::COMPACT>(append, 7, strings);
+        // An int, then 1-byte lengths for the vector and the first string,
+        // and a 2-byte one for the second string. The header takes 2 bytes.
+        std::size_t contentSize = sizeof(int) + 1 + (1 + 3) + (2 + 200);
+        expect(buffer.size(), isEqualTo(2 + contentSize));
+
+        auto view = MessageView::Read(
+          buffer.data(), buffer.size(), Framing::COMPACT);
+        expect(view.size(), isEqualTo(buffer.size()));
+        expect(view.read<int>(), isEqualTo(7));
+        expect(view.read<std::vector<std::string>>() == strings);
+
+        auto message
+          = Message::Read(buffer.data(), buffer.size(), {}, Framing::COMPACT);
+        auto copy = message;
+        expect(copy.read<int>(), isEqualTo(7));
+        expect(copy.read<std::vector<std::string>>() == strings);
+    });
+
+    test("Compact message headers can be incomplete or invalid", [] {
+        std::vector<std::uint8_t> buffer;
+        Message::Write<Framing::COMPACT>(
+          [&buffer](const void* data, std::size_t size) {
+              auto bytes = static_cast<const std::uint8_t*>(data);
+              buffer.insert(buffer.end(), bytes, bytes + size);
+          },
+          std::string(300, 'y'));
+        for (std::size_t size: {0, 1, 2, 200}) {
+            expect(MessageView::Read(buffer.data(), size, Framing::COMPACT)
+                     .isInvalid());
+        }
+        std::vector<std::uint8_t> invalid(16, 0xFF);
+        bool thrown = false;
+        try {
+            MessageView::Read(invalid.data(), invalid.size(), Framing::COMPACT);
+        } catch (const std::system_error&) {
+            thrown = true;
+        }
+        expect(thrown, isTrue);
+    });
 }
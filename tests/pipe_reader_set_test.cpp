@@ -0,0 +1,270 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <mcga/test.hpp>
+#include <mcga/test_ext/matchers.hpp>
+
+#include "mcga/proc/pipe_reader_set.hpp"
+#include "mcga/proc/worker_subprocess.hpp"
+
+using namespace mcga::matchers;
+using namespace mcga::proc;
+
+// Implements only what every Subprocess must.
+class MinimalSubprocess : public Subprocess {
+  public:
+    bool isFinished() override {
+        return false;
+    }
+
+    bool isExited() override {
+        return false;
+    }
+
+    int getReturnCode() override {
+        return -1;
+    }
+
+    bool isSignaled() override {
+        return false;
+    }
+
+    int getSignal() override {
+        return -1;
+    }
+
+    KillResult kill() override {
+        return ALREADY_DEAD;
+    }
+
+    FinishStatus getFinishStatus() override {
+        return NO_EXIT;
+    }
+
+    void waitBlocking() override {
+    }
+};
+
+TEST_CASE("PipeReaderSet") {
+    std::vector<std::unique_ptr<PipeReader>> readers;
+    std::vector<std::unique_ptr<PipeWriter>> writers;
+    PipeReaderSet* readerSet = nullptr;
+
+    setUp([&] {
+        readerSet = new PipeReaderSet();
+        for (int i = 0; i < 20; i++) {
+            auto [reader, writer] = createAnonymousPipe();
+            readerSet->add(reader.get());
+            readers.push_back(std::move(reader));
+            writers.push_back(std::move(writer));
+        }
+    });
+
+    tearDown([&] {
+        delete readerSet;
+        readers.clear();
+        writers.clear();
+    });
+
+    test("Waiting without any message times out", [&] {
+        auto messages
+          = readerSet->getNextMessages(std::chrono::milliseconds(20));
+        expect(messages.empty());
+    });
+
+    test("Messages are returned along with their reader", [&] {
+        writers[3]->sendMessage(3);
+        writers[17]->sendMessage(17);
+        writers[17]->sendMessage(170);
+
+        std::vector<PipeReaderSet::Entry> messages;
+        while (messages.size() < 3) {
+            auto batch = readerSet->getNextMessages(std::chrono::seconds(5));
+            expect(!batch.empty());
+            std::move(batch.begin(), batch.end(), std::back_inserter(messages));
+        }
+        expect(messages.size(), isEqualTo(3u));
+        for (auto& [reader, message]: messages) {
+            expect(!message.isInvalid());
+            auto value = message.read<int>();
+            if (reader == readers[3].get()) {
+                expect(value, isEqualTo(3));
+            } else {
+                expect(reader == readers[17].get());
+                expect(value == 17 || value == 170);
+            }
+        }
+    });
+
+    test("Closed readers are reported once and removed", [&] {
+        writers[5].reset();
+        auto messages = readerSet->getNextMessages(std::chrono::seconds(5));
+        expect(messages.size(), isEqualTo(1u));
+        expect(messages[0].first == readers[5].get());
+        expect(messages[0].second.isInvalid());
+        expect(!readerSet->contains(readers[5].get()));
+        expect(readerSet->size(), isEqualTo(19u));
+        expect(readerSet->getNextMessages(std::chrono::milliseconds(10))
+                 .empty());
+    });
+
+    test("Readable descriptors are reported by wait()", [&] {
+        int fds[2];
+        expect(pipe(fds), isEqualTo(0));
+        readerSet->add(fds[0]);
+        auto events = readerSet->wait(std::chrono::milliseconds(20));
+        expect(events.readyDescriptors.empty());
+        char byte = 0;
+        expect(write(fds[1], &byte, 1), isEqualTo(1));
+        // Only wait() reports them.
+        expect(readerSet->getNextMessages(std::chrono::milliseconds(20))
+                 .empty());
+        events = readerSet->wait(std::chrono::seconds(5));
+        expect(events.messages.empty());
+        expect(events.readyDescriptors.size(), isEqualTo(1u));
+        expect(events.readyDescriptors[0], isEqualTo(fds[0]));
+        readerSet->remove(fds[0]);
+        ::close(fds[0]);
+        ::close(fds[1]);
+    });
+
+    test("Readers that fail are reported as closed, with the error", [&] {
+        std::size_t hugeSize = std::size_t{1} << 46;
+        std::uint8_t prefix[Message::prefixSize] = {};
+        std::memcpy(prefix, &hugeSize, sizeof(hugeSize));
+        writers[2]->sendBytes(prefix, sizeof(prefix));
+        auto events = readerSet->wait(std::chrono::seconds(5));
+        expect(events.messages.size(), isEqualTo(1u));
+        expect(events.messages[0].first == readers[2].get());
+        expect(events.messages[0].second.isInvalid());
+        expect(events.failedReaders.size(), isEqualTo(1u));
+        expect(events.failedReaders[0].second == std::errc::message_size);
+        expect(!readerSet->contains(readers[2].get()));
+    });
+
+    test("Subprocesses without an exit descriptor are refused", [&] {
+        MinimalSubprocess subprocess;
+        expect(subprocess.getExitDescriptor(), isEqualTo(-1));
+        bool thrown = false;
+        try {
+            readerSet->add(&subprocess);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        expect(thrown, isTrue);
+        expect(!readerSet->contains(&subprocess));
+    });
+
+    test("Subprocesses that cannot be terminated say so", [&] {
+        MinimalSubprocess subprocess;
+        bool thrown = false;
+        try {
+            subprocess.terminate();
+        } catch (const std::system_error& error) {
+            thrown = error.code() == std::errc::not_supported;
+        }
+        expect(thrown, isTrue);
+    });
+
+    test("Subprocesses may not report their resource usage", [&] {
+        MinimalSubprocess subprocess;
+        expect(!subprocess.getResourceUsage().has_value());
+    });
+
+    test("Collecting messages from many workers", [&] {
+        PipeReaderSet workerSet;
+        std::vector<std::unique_ptr<WorkerSubprocess>> workers;
+        for (int i = 0; i < 16; i++) {
+            workers.push_back(std::make_unique<WorkerSubprocess>(
+              std::chrono::seconds(5),
+              [i](std::unique_ptr<PipeWriter> writer) {
+                  writer->sendMessage(i);
+              }));
+            workerSet.add(workers.back()->getPipeReader());
+        }
+        std::vector<int> values;
+        while (!workerSet.empty()) {
+            for (auto& [reader, message]:
+                 workerSet.getNextMessages(std::chrono::seconds(5))) {
+                if (!message.isInvalid()) {
+                    values.push_back(message.read<int>());
+                }
+            }
+        }
+        std::sort(values.begin(), values.end());
+        expect(values.size(), isEqualTo(16u));
+        for (int i = 0; i < static_cast<int>(values.size()); i++) {
+            expect(values[i], isEqualTo(i));
+        }
+        for (auto& worker: workers) {
+            worker->waitBlocking();
+        }
+    });
+
+    test("Finished subprocesses are reported by wait()", [&] {
+        PipeReaderSet processSet;
+        auto quick = Subprocess::Fork([] {});
+        auto slow = Subprocess::Fork([] {
+            std::this_thread::sleep_for(std::chrono::seconds(10));
+        });
+        processSet.add(quick.get());
+        processSet.add(slow.get());
+        auto start = std::chrono::steady_clock::now();
+        auto events = processSet.wait(std::chrono::seconds(5));
+        expect(std::chrono::steady_clock::now() - start
+               < std::chrono::seconds(5));
+        expect(events.messages.empty());
+        expect(events.finishedSubprocesses.size(), isEqualTo(1u));
+        expect(events.finishedSubprocesses[0] == quick.get());
+        expect(quick->getFinishStatus() == Subprocess::ZERO_EXIT);
+        expect(!processSet.contains(quick.get()));
+        expect(processSet.contains(slow.get()));
+
+        events = processSet.wait(std::chrono::milliseconds(20));
+        expect(events.finishedSubprocesses.empty());
+        processSet.remove(slow.get());
+        slow->kill();
+        slow->waitBlocking();
+    });
+
+    test("Waiting on a worker's messages and exit at once", [&] {
+        PipeReaderSet workerSet;
+        WorkerSubprocess worker(std::chrono::seconds(5),
+                                [](std::unique_ptr<PipeWriter> writer) {
+                                    writer->sendMessage(42);
+                                });
+        workerSet.add(worker.getPipeReader());
+        workerSet.add(&worker);
+        std::vector<int> values;
+        bool finished = false;
+        while (!finished) {
+            auto events = workerSet.wait(std::chrono::seconds(5));
+            for (auto& [reader, message]: events.messages) {
+                if (!message.isInvalid()) {
+                    values.push_back(message.read<int>());
+                }
+            }
+            finished = !events.finishedSubprocesses.empty();
+        }
+        expect(worker.getFinishStatus() == Subprocess::ZERO_EXIT);
+        // The message was sent before the worker exited.
+        while (values.empty()) {
+            for (auto& [reader, message]:
+                 workerSet.getNextMessages(std::chrono::seconds(5))) {
+                if (!message.isInvalid()) {
+                    values.push_back(message.read<int>());
+                }
+            }
+        }
+        expect(values.size(), isEqualTo(1u));
+        expect(values[0], isEqualTo(42));
+    });
+}
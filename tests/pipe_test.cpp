@@ -1,7 +1,15 @@
+#include <chrono>
+#include <string>
+#include <system_error>
+#include <thread>
+
 #include <mcga/test.hpp>
 #include <mcga/test_ext/matchers.hpp>
 
 #include "mcga/proc/pipe.hpp"
+#include "mcga/proc/serialization_std.hpp"
+
+#include "recording_pipe_writer.hpp"
 
 using namespace mcga::matchers;
 using namespace mcga::proc;
@@ -92,4 +100,385 @@ TEST_CASE("Pipe") {
         Message message = reader->getNextMessage(100);  // 100 read attempts
         expect(message.isInvalid(), isTrue);
     });
+
+    test("Reading a message with a timeout without writing one", [&] {
+        auto timeout = std::chrono::milliseconds(20);
+        auto start = std::chrono::steady_clock::now();
+        Message message = reader->getNextMessage(timeout);
+        expect(message.isInvalid(), isTrue);
+        expect(std::chrono::steady_clock::now() - start >= timeout);
+    });
+
+    test("Blocking read wakes up when a message is sent", [&] {
+        std::thread sender([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            writer->sendMessage(4, 5, 6);
+        });
+        Message message = reader->getNextMessage();
+        sender.join();
+        expect(message.isInvalid(), isFalse);
+        int x, y, z;
+        message >> x >> y >> z;
+        expect(x, isEqualTo(4));
+        expect(y, isEqualTo(5));
+        expect(z, isEqualTo(6));
+    });
+
+    test("Reading with a timeout returns a message sent meanwhile", [&] {
+        std::thread sender([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            writer->sendMessage(7);
+        });
+        Message message = reader->getNextMessage(std::chrono::seconds(5));
+        sender.join();
+        expect(message.isInvalid(), isFalse);
+        expect(message.read<int>(), isEqualTo(7));
+    });
+
+    test("Blocking read after the writer is closed is invalid", [&] {
+        writer->sendMessage(1);
+        writer.reset();
+        expect(reader->getNextMessage().isInvalid(), isFalse);
+        expect(reader->getNextMessage().isInvalid(), isTrue);
+    });
+
+    test("Reading a message larger than the initial read size", [&] {
+        tie(reader, writer) = createAnonymousPipe(
+          {.initialReadSize = 16, .maxReadSize = 64});
+        std::string payload(32 * 1024, 'x');
+        for (int i = 0; i < 3; i++) {
+            writer->sendMessage(i, payload);
+            auto message = reader->getNextMessage(std::chrono::seconds(5));
+            expect(message.isInvalid(), isFalse);
+            int index;
+            std::string content;
+            message >> index >> content;
+            expect(index, isEqualTo(i));
+            expect(content == payload);
+        }
+    });
+
+    test("Reading message views", [&] {
+        for (int i = 1; i <= 10; ++i) {
+            writer->sendMessage(i, std::string(i, 'a'));
+        }
+        for (int i = 1; i <= 10; ++i) {
+            auto view = reader->getNextMessageView(std::chrono::seconds(5));
+            expect(view.isInvalid(), isFalse);
+            int index;
+            std::string content;
+            view >> index >> content;
+            expect(index, isEqualTo(i));
+            expect(content, isEqualTo(std::string(i, 'a')));
+        }
+        expect(reader->getNextMessageView(0).isInvalid(), isTrue);
+    });
+
+    test("Reading every buffered message at once", [&] {
+        std::vector<Message> batch;
+        expect(reader->getMessages(batch), isEqualTo(0u));
+        for (int i = 0; i < 100; i++) {
+            writer->sendMessage(i);
+        }
+        expect(reader->getMessages(batch, std::chrono::seconds(5)),
+               isEqualTo(100u));
+        for (int i = 0; i < 100; i++) {
+            expect(batch[i].read<int>(), isEqualTo(i));
+        }
+        if constexpr (kMetricsEnabled) {
+            expect(reader->getMetrics().numReads, isEqualTo(1u));
+        }
+        writer->sendMessage(100);
+        expect(reader->getMessages(batch), isEqualTo(1u));
+        expect(batch.back().read<int>(), isEqualTo(100));
+        writer.reset();
+        expect(reader->getMessages(batch, std::chrono::seconds(5)),
+               isEqualTo(0u));
+        expect(reader->isClosed(), isTrue);
+    });
+
+    test("Metrics are only counted when enabled", [&] {
+        for (int i = 0; i < 3; ++i) {
+            writer->sendMessage(i, std::string(100, 'm'));
+        }
+        for (int i = 0; i < 3; ++i) {
+            expect(reader->getNextMessage().isInvalid(), isFalse);
+        }
+        auto readerMetrics = reader->getMetrics();
+        auto writerMetrics = writer->getMetrics();
+        if constexpr (kMetricsEnabled) {
+            expect(readerMetrics.numMessages, isEqualTo(3u));
+            expect(readerMetrics.numReads >= 1);
+            expect(readerMetrics.readSizes.count,
+                   isEqualTo(readerMetrics.numReads));
+            expect(writerMetrics.numSends, isEqualTo(3u));
+            expect(writerMetrics.numBytesWritten,
+                   isEqualTo(readerMetrics.numBytesRead));
+        } else {
+            expect(readerMetrics.numMessages, isEqualTo(0u));
+            expect(writerMetrics.numSends, isEqualTo(0u));
+        }
+    });
+}
+
+TEST_CASE("PipeWriter") {
+    test("Small messages are sent with one call", [] {
+        RecordingPipeWriter writer;
+        writer.sendMessage(1, 2, 3);
+        expect(writer.numCalls, isEqualTo(1));
+        auto message = Message::Read(writer.bytes.data(), writer.bytes.size());
+        expect(message.size(), isEqualTo(writer.bytes.size()));
+    });
+
+    test("Large payloads are sent along with the buffered bytes", [] {
+        RecordingPipeWriter writer;
+        std::string payload(10000, 'p');
+        std::vector<int> numbers(1000, 7);
+        writer.sendMessage(1, payload, numbers, 2);
+        expect(writer.numCalls, isEqualTo(1));
+        auto message = Message::Read(writer.bytes.data(), writer.bytes.size());
+        expect(message.isInvalid(), isFalse);
+        int a, b;
+        std::string payloadCopy;
+        std::vector<int> numbersCopy;
+        message >> a >> payloadCopy >> numbersCopy >> b;
+        expect(a, isEqualTo(1));
+        expect(payloadCopy == payload);
+        expect(numbersCopy == numbers);
+        expect(b, isEqualTo(2));
+    });
+
+    test("Many large payloads are sent with one call", [] {
+        RecordingPipeWriter writer;
+        std::vector<std::string> payloads(100, std::string(1000, 'p'));
+        writer.sendMessage(payloads);
+        expect(writer.numCalls, isEqualTo(1));
+        auto message = Message::Read(writer.bytes.data(), writer.bytes.size());
+        expect(message.read<std::vector<std::string>>() == payloads);
+    });
+
+    test("Messages with too many payloads are split", [] {
+        RecordingPipeWriter writer;
+        // More ranges than a writev() call takes (IOV_MAX).
+        std::vector<std::string> payloads(2000, std::string(5000, 'p'));
+        writer.sendMessage(payloads);
+        expect(writer.numCalls > 1);
+        auto message = Message::Read(writer.bytes.data(), writer.bytes.size());
+        expect(message.read<std::vector<std::string>>() == payloads);
+    });
+
+    test("The buffer size can be chosen at the call site", [] {
+        RecordingPipeWriter writer;
+        writer.sendMessage<8>(1, 2, 3);
+        // The prefix alone does not fit in 8 bytes, it is copied elsewhere.
+        expect(writer.numCalls, isEqualTo(1));
+        auto message = Message::Read(writer.bytes.data(), writer.bytes.size());
+        expect(message.read<int>(), isEqualTo(1));
+        expect(message.read<int>(), isEqualTo(2));
+        expect(message.read<int>(), isEqualTo(3));
+    });
+
+    test("Sending large messages through a pipe", [] {
+        auto [reader, writer] = createAnonymousPipe();
+        std::string payload(20000, 'q');
+        writer->sendMessage(payload, payload);
+        auto message = reader->getNextMessage(std::chrono::seconds(5));
+        expect(message.isInvalid(), isFalse);
+        expect(message.read<std::string>() == payload);
+        expect(message.read<std::string>() == payload);
+    });
+
+    test("A full pipe blocks the writer until the reader catches up", [] {
+        auto [reader, writer] = createAnonymousPipe();
+        std::string payload(1 << 20, 'r');
+        std::thread sender([&, &writer = writer] {
+            writer->sendMessage(payload);
+        });
+        auto message = reader->getNextMessage(std::chrono::seconds(5));
+        sender.join();
+        expect(message.isInvalid(), isFalse);
+        expect(message.read<std::string>() == payload);
+    });
+
+    test("A full pipe queues the data with the BUFFER policy", [] {
+        std::size_t highWaterMarkBytes = 0;
+        auto [reader, writer] = createAnonymousPipe(
+          {},
+          {
+            .policy = PipeWriterOptions::BUFFER,
+            .maxBufferedBytes = 4 << 20,
+            .highWaterMark = 1 << 18,
+            .onHighWaterMark =
+              [&](std::size_t numBytes) {
+                  highWaterMarkBytes = numBytes;
+              },
+          });
+        std::string payload(1 << 20, 's');
+        writer->sendMessage(payload);
+        writer->sendMessage(1);
+        expect(writer->getPendingBytes() > 0);
+        expect(highWaterMarkBytes >= (1u << 18));
+        expect(writer->flush(std::chrono::milliseconds(10)), isFalse);
+
+        std::thread sender([&, &writer = writer] {
+            writer->flush();
+        });
+        auto message = reader->getNextMessage(std::chrono::seconds(5));
+        auto secondMessage = reader->getNextMessage(std::chrono::seconds(5));
+        sender.join();
+        expect(writer->getPendingBytes(), isEqualTo(0u));
+        expect(message.read<std::string>() == payload);
+        expect(secondMessage.read<int>(), isEqualTo(1));
+    });
+
+    test("BUFFER policy blocks once the queue is full", [] {
+        PipeWriterOptions options;
+        options.policy = PipeWriterOptions::BUFFER;
+        options.maxBufferedBytes = 1024;
+        auto [reader, writer] = createAnonymousPipe({}, options);
+        std::string payload(1 << 20, 't');
+        std::thread sender([&, &writer = writer] {
+            writer->sendMessage(payload);
+        });
+        auto message = reader->getNextMessage(std::chrono::seconds(5));
+        sender.join();
+        expect(message.read<std::string>() == payload);
+    });
+
+    test("Closing drops the queue if the reader does not catch up", [] {
+        PipeWriterOptions options;
+        options.policy = PipeWriterOptions::BUFFER;
+        options.maxBufferedBytes = 4 << 20;
+        options.closeTimeout = std::chrono::milliseconds(10);
+        auto [reader, writer] = createAnonymousPipe({}, options);
+        writer->sendMessage(std::string(1 << 20, 'u'));
+        expect(writer->getPendingBytes() > 0);
+        auto start = std::chrono::steady_clock::now();
+        writer.reset();
+        expect(std::chrono::steady_clock::now() - start
+               < std::chrono::seconds(5));
+    });
+}
+
+TEST_CASE("Receive buffer") {
+    test("Messages wrapping around the ring are read whole", [] {
+        auto [reader, writer]
+          = createAnonymousPipe({.initialReadSize = 4096, .maxReadSize = 4096});
+        auto contentOf = [](int i) {
+            return std::string(1000 + i % 37, static_cast<char>('a' + i % 26));
+        };
+        std::thread sender([&, &writer = writer] {
+            for (int i = 0; i < 1000; i++) {
+                writer->sendMessage(i, contentOf(i));
+            }
+        });
+        for (int i = 0; i < 1000; i++) {
+            auto view = reader->getNextMessageView(std::chrono::seconds(5));
+            expect(view.isInvalid(), isFalse);
+            int index;
+            std::string content;
+            view >> index >> content;
+            expect(index, isEqualTo(i));
+            expect(content == contentOf(i));
+        }
+        sender.join();
+    });
+
+    test("Messages above the maximum size are refused", [] {
+        auto [reader, writer]
+          = createAnonymousPipe({.maxMessageSize = 1024}, {});
+        writer->sendMessage(std::string(100, 's'));
+        writer->sendMessage(std::string(2000, 'l'));
+        expect(reader->getNextMessage().read<std::string>().size(),
+               isEqualTo(100u));
+        bool thrown = false;
+        try {
+            reader->getNextMessage(std::chrono::seconds(5));
+        } catch (const std::system_error& error) {
+            thrown = error.code() == std::errc::message_size;
+        }
+        expect(thrown, isTrue);
+    });
+
+    test("The buffer shrinks back after a large message", [] {
+        auto [reader, writer] = createAnonymousPipe();
+        std::string payload(8 << 20, 'l');
+        std::thread sender([&, &writer = writer] {
+            writer->sendMessage(payload);
+            writer->sendMessage(1);
+        });
+        auto message = reader->getNextMessage(std::chrono::seconds(5));
+        expect(message.read<std::string>() == payload);
+        expect(reader->getNextMessage().read<int>(), isEqualTo(1));
+        sender.join();
+        // Only shrinks once the following reads did not need the space.
+        for (int i = 0; i < 100; i++) {
+            writer->sendMessage(i);
+            expect(reader->getNextMessage().read<int>(), isEqualTo(i));
+        }
+        auto* buffered
+          = dynamic_cast<internal::BufferedPipeReader*>(reader.get());
+        expect(buffered != nullptr);
+        expect(buffered->getBufferCapacity() < payload.size());
+        expect(buffered->getBufferCapacity()
+               >= PipeReaderOptions().maxReadSize);
+        if constexpr (kMetricsEnabled) {
+            auto metrics = reader->getMetrics();
+            expect(metrics.numBufferGrowths >= 1);
+            expect(metrics.numBufferShrinks, isEqualTo(1u));
+        }
+    });
+}
+
+TEST_CASE("Compact framing") {
+    PipeReaderOptions readerOptions{.framing = Framing::COMPACT};
+    PipeWriterOptions writerOptions;
+    writerOptions.framing = Framing::COMPACT;
+
+    test("Small messages take less than half the bytes", [&] {
+        auto [reader, writer] = createAnonymousPipe();
+        auto [compactReader, compactWriter]
+          = createAnonymousPipe(readerOptions, writerOptions);
+        for (auto* pipe: {writer.get(), compactWriter.get()}) {
+            pipe->sendMessage(std::int32_t{1}, std::string("cpu"));
+        }
+        auto view = reader->getNextMessageView(std::chrono::seconds(5));
+        auto compactView
+          = compactReader->getNextMessageView(std::chrono::seconds(5));
+        expect(view.size(), isEqualTo(16u + 4u + 8u + 3u));
+        expect(compactView.size(), isEqualTo(1u + 4u + 1u + 3u));
+        expect(compactView.read<std::int32_t>(), isEqualTo(1));
+        expect(compactView.read<std::string>(), isEqualTo("cpu"));
+    });
+
+    test("Messages of any size are read whole", [&] {
+        auto [reader, writer]
+          = createAnonymousPipe(readerOptions, writerOptions);
+        std::vector<std::size_t> sizes{0, 1, 127, 128, 20000, 1 << 21};
+        std::thread sender([&, &writer = writer] {
+            for (auto size: sizes) {
+                writer->sendMessage(std::string(size, 'c'), size);
+            }
+        });
+        for (auto size: sizes) {
+            auto message = reader->getNextMessage(std::chrono::seconds(5));
+            expect(message.isInvalid(), isFalse);
+            expect(message.read<std::string>() == std::string(size, 'c'));
+            expect(message.read<std::size_t>(), isEqualTo(size));
+        }
+        sender.join();
+        writer.reset();
+        expect(reader->getNextMessage().isInvalid(), isTrue);
+        expect(reader->isClosed(), isTrue);
+    });
+
+    test("Shared memory channels use the reader's framing", [&] {
+        auto [reader, writer]
+          = createSharedMemoryChannel(1 << 16, readerOptions);
+        expect(writer->getFraming() == Framing::COMPACT);
+        std::vector<std::string> strings{"a", "bc", std::string(5000, 'd')};
+        writer->sendMessage(strings);
+        auto message = reader->getNextMessage(std::chrono::seconds(5));
+        expect(message.read<std::vector<std::string>>() == strings);
+    });
 }
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "mcga/proc/pipe.hpp"
+
+// PipeWriter that keeps everything sent through it, counting the calls.
+class RecordingPipeWriter : public mcga::proc::PipeWriter {
+  public:
+    void sendBytes(const std::uint8_t* data, std::size_t numBytes) override {
+        numCalls += 1;
+        bytes.insert(bytes.end(), data, data + numBytes);
+    }
+
+    void sendBytesVectored(
+      std::span<const mcga::proc::ByteSpan> ranges) override {
+        numCalls += 1;
+        for (auto range: ranges) {
+            bytes.insert(bytes.end(), range.begin(), range.end());
+        }
+    }
+
+    int numCalls = 0;
+    std::vector<std::uint8_t> bytes;
+};
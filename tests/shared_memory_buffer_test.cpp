@@ -0,0 +1,216 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <mcga/test.hpp>
+#include <mcga/test_ext/matchers.hpp>
+
+#include "mcga/proc/local_socket_server.hpp"
+#include "mcga/proc/serialization_std.hpp"
+#include "mcga/proc/shared_memory_buffer.hpp"
+#include "mcga/proc/subprocess.hpp"
+
+using namespace mcga::matchers;
+using namespace mcga::proc;
+
+namespace {
+
+SharedMemoryBuffer filledBuffer(std::size_t size, std::uint8_t seed) {
+    auto buffer = SharedMemoryBuffer::Create(size);
+    for (std::size_t i = 0; i < size; i++) {
+        buffer.data()[i] = static_cast<std::uint8_t>(seed + i);
+    }
+    return buffer;
+}
+
+bool hasContents(const SharedMemoryBuffer& buffer,
+                 std::size_t size,
+                 std::uint8_t seed) {
+    if (buffer.size() != size) {
+        return false;
+    }
+    for (std::size_t i = 0; i < size; i++) {
+        if (buffer.data()[i] != static_cast<std::uint8_t>(seed + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Serialized like a SharedMemoryBuffer, claiming any size for a descriptor.
+struct ForgedBuffer {
+    int fd;
+    std::uint64_t size;
+
+    [[nodiscard]] std::size_t size_custom() const {
+        return sizeof(std::uint64_t) * 2;
+    }
+
+    template<binary_writer Writer>
+    void write_custom(Writer& writer) const {
+        std::uint64_t index = writer.attachFileDescriptor(fd);
+        writer(&index, sizeof(index));
+        writer(&size, sizeof(size));
+    }
+};
+
+}  // namespace
+
+TEST_CASE("Shared memory buffer") {
+    std::string pathname;
+    LocalSocketServer* server = nullptr;
+
+    setUp([&] {
+        pathname = "/tmp/mcga_proc_shm_test_" + std::to_string(getpid())
+                   + ".sock";
+        server = new LocalSocketServer(pathname);
+    });
+
+    tearDown([&] {
+        delete server;
+        server = nullptr;
+    });
+
+    test("Sending a buffer from another process", [&] {
+        auto client = Subprocess::Fork([&pathname] {
+            auto writer = createLocalClientSocket(pathname);
+            writer->sendMessage(7, filledBuffer(1 << 23, 3), std::string("x"));
+        });
+        // The closed connection may be reported along with the message.
+        auto entries = server->getNextMessages(std::chrono::seconds(5));
+        expect(entries.empty(), isFalse);
+        auto& message = entries[0].message;
+        expect(message.getNumFileDescriptors(), isEqualTo(std::size_t(1)));
+        expect(message.read<int>(), isEqualTo(7));
+        auto buffer = message.read<SharedMemoryBuffer>();
+        expect(message.read<std::string>() == "x");
+        expect(hasContents(buffer, 1 << 23, 3));
+        expect(buffer.data() == nullptr);
+        client->waitBlocking();
+    });
+
+    test("Buffers and plain messages in a row", [&] {
+        auto [reader, writer] = createLocalClientConnection(pathname);
+        for (int i = 0; i < 20; i++) {
+            if (i % 3 == 0) {
+                writer->sendMessage(i, filledBuffer(4096 + i, i));
+            } else {
+                writer->sendMessage(i);
+            }
+        }
+        int numReceived = 0;
+        while (numReceived < 20) {
+            auto entries = server->getNextMessages(std::chrono::seconds(5));
+            if (entries.empty()) {
+                break;
+            }
+            for (auto& entry: entries) {
+                auto i = entry.message.read<int>();
+                expect(i, isEqualTo(numReceived));
+                numReceived += 1;
+                if (i % 3 != 0) {
+                    expect(entry.message.getNumFileDescriptors(),
+                           isEqualTo(std::size_t(0)));
+                    continue;
+                }
+                auto buffer = entry.message.read<SharedMemoryBuffer>();
+                expect(hasContents(buffer, 4096 + i, i));
+            }
+        }
+        expect(numReceived, isEqualTo(20));
+    });
+
+    test("Several buffers in one message", [&] {
+        auto [reader, writer] = createLocalClientConnection(pathname);
+        std::vector<SharedMemoryBuffer> buffers;
+        for (int i = 0; i < 4; i++) {
+            buffers.push_back(filledBuffer(100 * (i + 1), i));
+        }
+        writer->sendMessage(buffers[0], buffers[1], buffers[2], buffers[3]);
+        auto entries = server->getNextMessages(std::chrono::seconds(5));
+        expect(entries.size(), isEqualTo(std::size_t(1)));
+        auto& message = entries[0].message;
+        expect(message.getNumFileDescriptors(), isEqualTo(std::size_t(4)));
+        for (int i = 0; i < 4; i++) {
+            auto buffer = message.read<SharedMemoryBuffer>();
+            expect(hasContents(buffer, 100 * (i + 1), i));
+        }
+    });
+
+    test("Received descriptors are closed with the message", [&] {
+        auto [reader, writer] = createLocalClientConnection(pathname);
+        writer->sendMessage(filledBuffer(16, 0));
+        auto entries = server->getNextMessages(std::chrono::seconds(5));
+        expect(entries.size(), isEqualTo(std::size_t(1)));
+        int fd = entries[0].message.getFileDescriptor(0);
+        expect(fcntl(fd, F_GETFD) >= 0);
+        expect(entries[0].message.getFileDescriptor(1), isEqualTo(-1));
+        auto buffer = entries[0].message.read<SharedMemoryBuffer>();
+        entries.clear();
+        expect(fcntl(fd, F_GETFD), isEqualTo(-1));
+        // The mapping outlives the descriptor.
+        expect(hasContents(buffer, 16, 0));
+    });
+
+    test("Sending a buffer makes it read-only", [&] {
+        auto [reader, writer] = createLocalClientConnection(pathname);
+        auto buffer = filledBuffer(64, 5);
+        writer->sendMessage(buffer);
+        expect(buffer.data() == nullptr);
+        expect(hasContents(buffer, 64, 5));
+        auto entries = server->getNextMessages(std::chrono::seconds(5));
+        expect(entries.size(), isEqualTo(std::size_t(1)));
+#ifdef __linux__
+        int seals = fcntl(entries[0].message.getFileDescriptor(0), F_GET_SEALS);
+        expect((seals & F_SEAL_WRITE) != 0);
+        expect((seals & F_SEAL_SHRINK) != 0);
+#endif
+        expect(hasContents(
+          entries[0].message.read<SharedMemoryBuffer>(), 64, 5));
+    });
+
+    test("Sizes past the end of the descriptor are rejected", [&] {
+        auto [reader, writer] = createLocalClientConnection(pathname);
+        int fd = internal::CreateAnonymousFile("test");
+        expect(ftruncate(fd, 16), isEqualTo(0));
+        writer->sendMessage(ForgedBuffer{fd, 1 << 20});
+        close(fd);
+        auto entries = server->getNextMessages(std::chrono::seconds(5));
+        expect(entries.size(), isEqualTo(std::size_t(1)));
+        bool thrown = false;
+        try {
+            entries[0].message.read<SharedMemoryBuffer>();
+        } catch (const std::system_error&) {
+            thrown = true;
+        }
+        expect(thrown, isTrue);
+    });
+
+    test("Only sockets can carry buffers", [&] {
+        auto [reader, writer] = createAnonymousPipe();
+        bool thrown = false;
+        try {
+            writer->sendMessage(filledBuffer(16, 0));
+        } catch (const std::system_error&) {
+            thrown = true;
+        }
+        expect(thrown, isTrue);
+        // Refused before the bytes ahead of the buffer went out.
+        thrown = false;
+        try {
+            writer->sendMessage(std::vector<int>(1 << 12, 9),
+                                filledBuffer(16, 0));
+        } catch (const std::system_error&) {
+            thrown = true;
+        }
+        expect(thrown, isTrue);
+        writer->sendMessage(1);
+        expect(reader->getNextMessage().read<int>(), isEqualTo(1));
+    });
+}
@@ -0,0 +1,165 @@
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <mcga/test.hpp>
+#include <mcga/test_ext/matchers.hpp>
+
+#include "mcga/proc/pipe_reader_set.hpp"
+#include "mcga/proc/serialization_std.hpp"
+#include "mcga/proc/worker_subprocess.hpp"
+
+using namespace mcga::matchers;
+using namespace mcga::proc;
+
+TEST_CASE("Shared memory channel") {
+    std::unique_ptr<PipeReader> reader;
+    std::unique_ptr<PipeWriter> writer;
+
+    setUp([&] {
+        tie(reader, writer) = createSharedMemoryChannel(1024);
+    });
+
+    tearDown([&] {
+        reader.reset();
+        writer.reset();
+    });
+
+    test("Sending one message", [&] {
+        writer->sendMessage(1, 2, 3);
+
+        Message message = reader->getNextMessage();
+        int x, y, z;
+        message >> x >> y >> z;
+        expect(x, isEqualTo(1));
+        expect(y, isEqualTo(2));
+        expect(z, isEqualTo(3));
+    });
+
+    test("Sending messages that wrap around the ring", [&] {
+        for (int i = 0; i < 1000; i++) {
+            writer->sendMessage(i, std::string(i % 100, 'x'));
+            auto message = reader->getNextMessage(std::chrono::seconds(5));
+            expect(message.isInvalid(), isFalse);
+            int index;
+            std::string content;
+            message >> index >> content;
+            expect(index, isEqualTo(i));
+            expect(content.size(), isEqualTo(std::size_t(i % 100)));
+        }
+    });
+
+    test("A view keeps its bytes until the next read", [&] {
+        writer->sendMessage(std::string(3000, 'a'));
+        auto view = reader->getNextMessageView(std::chrono::seconds(5));
+        expect(view.isInvalid(), isFalse);
+        // The ring has no room for this one while the view is held.
+        std::thread sender([&] {
+            writer->sendMessage(std::string(3000, 'b'));
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::string content;
+        view >> content;
+        expect(content == std::string(3000, 'a'));
+        auto message = reader->getNextMessage(std::chrono::seconds(5));
+        sender.join();
+        expect(message.isInvalid(), isFalse);
+        expect(message.read<std::string>() == std::string(3000, 'b'));
+    });
+
+    test("Reading with a timeout without writing anything", [&] {
+        auto timeout = std::chrono::milliseconds(20);
+        auto start = std::chrono::steady_clock::now();
+        expect(reader->getNextMessage(timeout).isInvalid(), isTrue);
+        expect(std::chrono::steady_clock::now() - start >= timeout);
+    });
+
+    test("Blocking read wakes up when a message is sent", [&] {
+        std::thread sender([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            writer->sendMessage(4);
+        });
+        Message message = reader->getNextMessage();
+        sender.join();
+        expect(message.isInvalid(), isFalse);
+        expect(message.read<int>(), isEqualTo(4));
+    });
+
+    test("Messages larger than the ring block the writer", [&] {
+        std::string payload(100 * 1024, 'y');
+        std::thread sender([&] {
+            for (int i = 0; i < 5; i++) {
+                writer->sendMessage(i, payload);
+            }
+        });
+        for (int i = 0; i < 5; i++) {
+            auto message = reader->getNextMessage(std::chrono::seconds(5));
+            expect(message.isInvalid(), isFalse);
+            int index;
+            std::string content;
+            message >> index >> content;
+            expect(index, isEqualTo(i));
+            expect(content == payload);
+        }
+        sender.join();
+    });
+
+    test("Reading after the writer is closed is invalid", [&] {
+        writer->sendMessage(1);
+        writer.reset();
+        expect(reader->getNextMessage().isInvalid(), isFalse);
+        expect(reader->getNextMessage().isInvalid(), isTrue);
+        expect(reader->isClosed(), isTrue);
+    });
+
+    test("Writing after the reader is closed throws", [&] {
+        reader.reset();
+        bool thrown = false;
+        try {
+            writer->sendMessage(std::string(4096, 'z'));
+        } catch (const std::system_error&) {
+            thrown = true;
+        }
+        expect(thrown, isTrue);
+    });
+
+    test("Waiting in a PipeReaderSet", [&] {
+        PipeReaderSet readerSet;
+        readerSet.add(reader.get());
+        auto timeout = std::chrono::milliseconds(20);
+        expect(readerSet.getNextMessages(timeout).empty());
+        std::thread sender([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            writer->sendMessage(8);
+        });
+        auto messages = readerSet.getNextMessages(std::chrono::seconds(5));
+        sender.join();
+        expect(messages.size(), isEqualTo(std::size_t(1)));
+        expect(messages[0].second.read<int>(), isEqualTo(8));
+    });
+}
+
+TEST_CASE("Shared memory worker subprocess") {
+    test("Streaming many messages from a worker", [] {
+        WorkerOptions options{.transport = WorkerOptions::SHARED_MEMORY,
+                              .sharedMemoryCapacity = 4096};
+        auto proc = new WorkerSubprocess(
+          std::chrono::seconds(5),
+          [](std::unique_ptr<PipeWriter> writer) {
+              for (int i = 0; i < 10000; i++) {
+                  writer->sendMessage(i);
+              }
+          },
+          options);
+        cleanup([&] {
+            proc->kill();
+            delete proc;
+        });
+        for (int i = 0; i < 10000; i++) {
+            auto message = proc->getNextMessage(std::chrono::seconds(5));
+            expect(message.isInvalid(), isFalse);
+            expect(message.read<int>(), isEqualTo(i));
+        }
+        expect(proc->getNextMessage().isInvalid(), isTrue);
+    });
+}
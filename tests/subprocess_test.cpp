@@ -1,16 +1,39 @@
 #include <mcga/test.hpp>
 
+#include <poll.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
 #include <csignal>
 #include <iostream>
+#include <system_error>
 
 #include <array>
+#include <atomic>
+#include <vector>
 #include <thread>
 
+#include "mcga/proc/numa.hpp"
 #include "mcga/proc/subprocess.hpp"
 
 using namespace mcga::proc;
 
 TEST_CASE("Subprocess") {
+    test("Process metrics count forks and reaped children", [] {
+        auto before = getProcessMetrics();
+        auto proc = Subprocess::Fork([] {});
+        proc->waitBlocking();
+        auto after = getProcessMetrics();
+        if constexpr (kMetricsEnabled) {
+            expect(after.numForks == before.numForks + 1);
+            expect(after.numReaped == before.numReaped + 1);
+            expect(after.startTimesUs.count == before.startTimesUs.count + 1);
+        } else {
+            expect(after.numForks == 0);
+        }
+    });
+
     test("Fork into process doing nothing, after 50ms", [] {
         auto proc = Subprocess::Fork([] {});
         std::this_thread::sleep_for(std::chrono::milliseconds(50));
@@ -132,4 +155,319 @@ TEST_CASE("Subprocess") {
         expect(proc->isExited());
         expect(proc->getReturnCode() == 0);
     });
+
+    test("Spawn a process and get its exit code", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "exit 3"},
+        });
+        proc->waitBlocking();
+        expect(proc->isExited());
+        expect(proc->getReturnCode() == 3);
+    });
+
+    test("Spawning a missing executable throws", [&] {
+        int error = 0;
+        try {
+            Subprocess::Spawn({.executable = "/does/not/exist"});
+        } catch (const std::system_error& exception) {
+            error = exception.code().value();
+        }
+        expect(error == ENOENT);
+    });
+
+    test("Spawn in another working directory", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "test \"$(pwd)\" = /"},
+          .workingDirectory = "/",
+        });
+        proc->waitBlocking();
+        expect(proc->getReturnCode() == 0);
+    });
+
+    test("Spawn with environment overrides", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "test \"$MCGA_PROC_VAR\" = value"},
+          .environmentOverrides = {{"MCGA_PROC_VAR", "value"}},
+        });
+        proc->waitBlocking();
+        expect(proc->getReturnCode() == 0);
+    });
+
+    test("Spawn with a remapped standard output", [&] {
+        int fds[2];
+        expect(pipe(fds) == 0);
+        auto proc = Subprocess::Spawn({
+          .executable = "echo",
+          .searchPath = true,
+          .arguments = {"echo", "hello"},
+          .fileDescriptorMappings = {{fds[1], STDOUT_FILENO}},
+        });
+        close(fds[1]);
+        proc->waitBlocking();
+        char output[16] = {};
+        auto numBytes = read(fds[0], output, sizeof(output));
+        close(fds[0]);
+        expect(std::string(output, numBytes) == "hello\n");
+        expect(proc->getReturnCode() == 0);
+    });
+
+    test("The exit descriptor becomes readable when the process exits", [&] {
+        auto proc = Subprocess::Fork([] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        });
+        pollfd pollFD{proc->getExitDescriptor(), POLLIN, 0};
+        // Without pidfds, the descriptor might also wake us up spuriously.
+        int numWakeUps = 0;
+        while (!proc->isFinished() && numWakeUps < 100) {
+            // poll() can also be interrupted by SIGCHLD itself.
+            expect(poll(&pollFD, 1, 5000) != 0);
+            numWakeUps += 1;
+        }
+        expect(proc->isFinished());
+        expect(proc->getFinishStatus() == Subprocess::ZERO_EXIT);
+    });
+
+    test("Resource usage is collected when the process is reaped", [&] {
+        constexpr std::size_t numBytes = 64 << 20;
+        auto proc = Subprocess::Fork([] {
+            std::vector<char> memory(numBytes, 1);
+            auto endTime = std::chrono::steady_clock::now()
+                           + std::chrono::milliseconds(50);
+            std::atomic_int spins = 0;
+            while (std::chrono::steady_clock::now() < endTime) {
+                spins += memory[spins % numBytes];
+            }
+        });
+        expect(!proc->getResourceUsage().has_value());
+        proc->waitBlocking();
+        auto usage = proc->getResourceUsage();
+        expect(usage.has_value());
+        expect(usage->userTime + usage->systemTime
+               >= std::chrono::milliseconds(10));
+        expect(usage->maxResidentSetSize >= numBytes);
+        expect(usage->minorPageFaults > 0);
+    });
+}
+
+TEST_CASE("Process options") {
+    test("Forked child runs with the requested niceness", [&] {
+        auto proc = Subprocess::Fork(
+          [] {
+              exit(getpriority(PRIO_PROCESS, 0));
+          },
+          {.niceness = 7});
+        proc->waitBlocking();
+        expect(proc->getReturnCode() == 7);
+    });
+
+    test("Forked child runs with the requested resource limits", [&] {
+        auto proc = Subprocess::Fork(
+          [] {
+              rlimit limit{};
+              getrlimit(RLIMIT_NOFILE, &limit);
+              exit(limit.rlim_cur == 32 && limit.rlim_max == 64 ? 0 : 1);
+          },
+          {.resourceLimits = {{RLIMIT_NOFILE, 32, 64}}});
+        proc->waitBlocking();
+        expect(proc->getReturnCode() == 0);
+    });
+
+#ifdef __linux__
+    test("Forked child is pinned to the requested CPU", [&] {
+        int cpu = getNumaNodeCPUs().back().back();
+        auto proc = Subprocess::Fork(
+          [cpu] {
+              cpu_set_t cpuSet;
+              sched_getaffinity(0, sizeof(cpuSet), &cpuSet);
+              exit(CPU_COUNT(&cpuSet) == 1 && CPU_ISSET(cpu, &cpuSet) ? 0 : 1);
+          },
+          {.cpuAffinity = {cpu}});
+        proc->waitBlocking();
+        expect(proc->getReturnCode() == 0);
+    });
+#endif
+
+    test("Failing to apply an option throws in the parent", [&] {
+        std::string what;
+        try {
+            Subprocess::Fork([] {}, {.cgroupPath = "/does/not/exist"});
+        } catch (const std::system_error& exception) {
+            what = exception.what();
+        }
+        expect(what.find("Subprocess:cgroup") != std::string::npos);
+    });
+
+    test("Spawned process runs with the requested resource limits", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "test \"$(ulimit -n)\" = 48"},
+          .process = {.resourceLimits = {{RLIMIT_NOFILE, 48, 48}}},
+        });
+        proc->waitBlocking();
+        expect(proc->getReturnCode() == 0);
+    });
+
+    test("Workers are pinned to one CPU each", [&] {
+        auto nodes = getNumaNodeCPUs();
+        expect(!nodes.empty() && !nodes[0].empty());
+        auto affinities
+          = planWorkerAffinities(5, WorkerPlacement::PIN_TO_CPUS);
+        expect(affinities.size() == 5);
+        for (const auto& affinity: affinities) {
+            expect(affinity.size() == 1);
+        }
+        expect(affinities[0][0] == nodes[0][0]);
+    });
+
+    test("Workers are spread over the NUMA nodes", [&] {
+        auto nodes = getNumaNodeCPUs();
+        auto affinities = planWorkerAffinities(4);
+        expect(affinities.size() == 4);
+        for (std::size_t i = 0; i < affinities.size(); i++) {
+            expect(affinities[i] == nodes[i % nodes.size()]);
+        }
+    });
+}
+
+TEST_CASE("Standard streams") {
+    test("Reading the standard output line by line", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "echo first; echo; printf last"},
+          .standardStreams = {.output = StandardStreamOptions::CAPTURE},
+        });
+        auto output = proc->getStandardOutput();
+        expect(output != nullptr);
+        expect(proc->getStandardError() == nullptr);
+        expect(output->readLine() == "first");
+        expect(output->readLine() == "");
+        expect(output->readLine() == "last");
+        expect(!output->readLine().has_value());
+        expect(output->isClosed());
+        proc->waitBlocking();
+    });
+
+    test("Reading a line with a timeout", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "printf partial; sleep 0.1; echo"},
+          .standardStreams = {.output = StandardStreamOptions::CAPTURE},
+        });
+        auto output = proc->getStandardOutput();
+        expect(!output->readLine(std::chrono::milliseconds(20)).has_value());
+        expect(output->readLine(std::chrono::seconds(5)) == "partial");
+        proc->waitBlocking();
+    });
+
+    test("Reading what is available, a few bytes at a time", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "printf 0123456789"},
+          .standardStreams = {.output = StandardStreamOptions::CAPTURE},
+        });
+        proc->waitBlocking();
+        auto output = proc->getStandardOutput();
+        expect(output->readAvailable(4) == "0123");
+        expect(!output->isClosed());
+        expect(output->readAvailable() == "456789");
+        expect(output->readAvailable().empty());
+        expect(output->isClosed());
+    });
+
+    test("Merging the standard error into the output", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "echo out; echo err >&2"},
+          .standardStreams
+          = {.output = StandardStreamOptions::CAPTURE,
+             .error = StandardStreamOptions::MERGE_WITH_OUTPUT},
+        });
+        expect(proc->getStandardOutput()->readAll() == "out\nerr\n");
+        proc->waitBlocking();
+    });
+
+    test("Discarding the standard output", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "echo out; echo err >&2"},
+          .standardStreams = {.output = StandardStreamOptions::DISCARD,
+                              .error = StandardStreamOptions::CAPTURE},
+        });
+        expect(proc->getStandardOutput() == nullptr);
+        expect(proc->getStandardError()->readAll() == "err\n");
+        proc->waitBlocking();
+    });
+
+    test("Invoke with a captured standard output", [&] {
+        std::string sh = "/bin/sh";
+        std::string flag = "-c";
+        std::string script = "echo invoked";
+        char* argv[] = {sh.data(), flag.data(), script.data(), nullptr};
+        auto proc = Subprocess::Invoke(
+          sh.data(),
+          argv,
+          nullptr,
+          {.output = StandardStreamOptions::CAPTURE});
+        expect(proc->getStandardOutput()->readAll() == "invoked\n");
+        proc->waitBlocking();
+        expect(proc->getReturnCode() == 0);
+    });
+
+    test("Communicating does not deadlock when every pipe is full", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "head -c 1000000 /dev/zero >&2; cat"},
+          .standardStreams = {.input = StandardStreamOptions::CAPTURE,
+                              .output = StandardStreamOptions::CAPTURE,
+                              .error = StandardStreamOptions::CAPTURE},
+        });
+        std::string input(1000000, 'x');
+        auto captured = communicate(*proc, input);
+        expect(captured.output == input);
+        expect(captured.error.size() == 1000000);
+        expect(proc->getStandardInput() == nullptr);
+        proc->waitBlocking();
+        expect(proc->getReturnCode() == 0);
+    });
+
+    test("Communicating with a process that does not read its input", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh", "-c", "exec 0<&-; echo done"},
+          .standardStreams = {.input = StandardStreamOptions::CAPTURE,
+                              .output = StandardStreamOptions::CAPTURE},
+        });
+        auto captured = communicate(*proc, std::string(1000000, 'x'));
+        expect(captured.output == "done\n");
+        proc->waitBlocking();
+    });
+
+    test("Streaming lines from both outputs at once", [&] {
+        auto proc = Subprocess::Spawn({
+          .executable = "/bin/sh",
+          .arguments = {"sh",
+                        "-c",
+                        "head -c 1000000 /dev/zero >&2;"
+                        "echo out; echo err >&2"},
+          .standardStreams = {.output = StandardStreamOptions::CAPTURE,
+                              .error = StandardStreamOptions::CAPTURE},
+        });
+        StreamReader* readers[]
+          = {proc->getStandardOutput(), proc->getStandardError()};
+        std::vector<std::string> outputLines;
+        std::size_t numErrorBytes = 0;
+        while (auto entry = readLineFromAny(readers, std::chrono::seconds(5))) {
+            if (entry->first == readers[0]) {
+                outputLines.push_back(entry->second);
+            } else {
+                numErrorBytes += entry->second.size();
+            }
+        }
+        expect(outputLines.size() == 1 && outputLines[0] == "out");
+        expect(numErrorBytes == 1000000 + 3);
+        proc->waitBlocking();
+    });
 }
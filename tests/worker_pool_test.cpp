@@ -0,0 +1,164 @@
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <csignal>
+
+#include <chrono>
+#include <cstdlib>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <mcga/test.hpp>
+#include <mcga/test_ext/matchers.hpp>
+
+#include "mcga/proc/numa.hpp"
+#include "mcga/proc/worker_pool.hpp"
+
+using namespace mcga::matchers;
+using namespace mcga::proc;
+
+namespace {
+
+// Answers with the task's number squared and the pid of the worker. A negative
+// number crashes the worker, and zero makes it hang.
+void squareHandler(Message& task, PipeWriter& results) {
+    auto number = task.read<int>();
+    if (number < 0) {
+        std::abort();
+    }
+    if (number == 0) {
+        std::this_thread::sleep_for(std::chrono::seconds(10));
+    }
+    results.sendMessage(number * number, static_cast<int>(getpid()));
+}
+
+std::vector<WorkerPool::Result> collectAll(WorkerPool& pool) {
+    std::vector<WorkerPool::Result> results;
+    while (pool.getNumPendingTasks() > 0) {
+        for (auto& result: pool.getResults()) {
+            results.push_back(std::move(result));
+        }
+    }
+    return results;
+}
+
+}  // namespace
+
+TEST_CASE("WorkerPool") {
+    WorkerPool* pool = nullptr;
+
+    setUp([&] {
+        pool = new WorkerPool(squareHandler,
+                              {.numWorkers = 3,
+                               .taskTimeout = std::chrono::milliseconds(500)});
+    });
+
+    tearDown([&] {
+        delete pool;
+    });
+
+    test("Getting results without tasks returns nothing", [&] {
+        expect(pool->getResults().empty());
+        expect(pool->getNumWorkers(), isEqualTo(std::size_t(3)));
+    });
+
+    test("Tasks are spread over the pre-forked workers", [&] {
+        std::vector<std::uint64_t> taskIds;
+        for (int i = 1; i <= 100; i++) {
+            taskIds.push_back(pool->submit(i));
+        }
+        expect(pool->getNumPendingTasks(), isEqualTo(std::size_t(100)));
+        auto results = collectAll(*pool);
+        expect(results.size(), isEqualTo(std::size_t(100)));
+        std::set<int> pids;
+        for (auto& result: results) {
+            expect(result.status, isEqualTo(WorkerPool::Result::OK));
+            int square, pid;
+            result.message >> square >> pid;
+            auto number = static_cast<int>(result.taskId - taskIds[0]) + 1;
+            expect(square, isEqualTo(number * number));
+            pids.insert(pid);
+        }
+        expect(pids.size() <= 3);
+    });
+
+    test("A crashed worker is replaced", [&] {
+        auto crashId = pool->submit(-1);
+        auto results = collectAll(*pool);
+        expect(results.size(), isEqualTo(std::size_t(1)));
+        expect(results[0].taskId, isEqualTo(crashId));
+        expect(results[0].status, isEqualTo(WorkerPool::Result::WORKER_DIED));
+        expect(results[0].message.isInvalid());
+
+        for (int i = 1; i <= 10; i++) {
+            pool->submit(i);
+        }
+        for (auto& result: collectAll(*pool)) {
+            expect(result.status, isEqualTo(WorkerPool::Result::OK));
+        }
+    });
+
+    test("A task that takes too long times out", [&] {
+        auto start = std::chrono::steady_clock::now();
+        auto hangId = pool->submitWithTimeout(std::chrono::milliseconds(50), 0);
+        auto okId = pool->submit(3);
+        auto results = collectAll(*pool);
+        expect(std::chrono::steady_clock::now() - start
+               < std::chrono::seconds(5));
+        expect(results.size(), isEqualTo(std::size_t(2)));
+        for (auto& result: results) {
+            if (result.taskId == hangId) {
+                expect(result.status, isEqualTo(WorkerPool::Result::TIMEOUT));
+            } else {
+                expect(result.taskId, isEqualTo(okId));
+                expect(result.status, isEqualTo(WorkerPool::Result::OK));
+            }
+        }
+    });
+
+    test("An idle worker killed from outside is replaced", [&] {
+        WorkerPool singlePool(squareHandler, {.numWorkers = 1});
+        singlePool.submit(2);
+        auto results = collectAll(singlePool);
+        expect(results.size(), isEqualTo(std::size_t(1)));
+        int square, pid;
+        results[0].message >> square >> pid;
+        ::kill(pid, SIGKILL);
+        // Let the kernel close the worker's end of the task pipe.
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        singlePool.submit(3);
+        results = collectAll(singlePool);
+        expect(results.size(), isEqualTo(std::size_t(1)));
+        expect(results[0].status, isEqualTo(WorkerPool::Result::OK));
+        results[0].message >> square >> pid;
+        expect(square, isEqualTo(9));
+    });
+
+    test("Waiting for results with a timeout", [&] {
+        pool->submitWithTimeout(std::chrono::seconds(5), 0);
+        auto timeout = std::chrono::milliseconds(20);
+        expect(pool->getResults(timeout).empty());
+        expect(pool->getNumPendingTasks(), isEqualTo(std::size_t(1)));
+    });
+}
+
+TEST_CASE("WorkerPool process options") {
+    test("Process options apply to every worker", [&] {
+        WorkerPool pool(
+          [](Message&, PipeWriter& results) {
+              results.sendMessage(getpriority(PRIO_PROCESS, 0));
+          },
+          {.numWorkers = 2,
+           .process = {.niceness = 5},
+           .workerAffinities = planWorkerAffinities(2)});
+        pool.submit(1);
+        pool.submit(2);
+        auto results = collectAll(pool);
+        expect(results.size(), isEqualTo(std::size_t(2)));
+        for (auto& result: results) {
+            expect(result.status, isEqualTo(WorkerPool::Result::OK));
+            expect(result.message.read<int>(), isEqualTo(5));
+        }
+    });
+}
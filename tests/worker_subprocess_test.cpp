@@ -1,4 +1,7 @@
+#include <unistd.h>
+
 #include <chrono>
+#include <csignal>
 #include <thread>
 
 #include <mcga/test.hpp>
@@ -65,4 +68,167 @@ TEST_CASE("Worker subprocess") {
         std::this_thread::sleep_for(2 * fifty_ms);
         expect(proc->getFinishStatus(), Subprocess::TIMEOUT);
     });
+
+    test("Enforced time limit: a blocked reader is woken up", [&] {
+        auto proc = new WorkerSubprocess(
+          fifty_ms,
+          [](std::unique_ptr<PipeWriter>) {
+              while (true) {
+                  pause();
+              }
+          },
+          {.enforceTimeLimit = true});
+        cleanup([&] {
+            proc->kill();
+            delete proc;
+        });
+        auto start = std::chrono::steady_clock::now();
+        expect(proc->getNextMessage().isInvalid());
+        expect(std::chrono::steady_clock::now() - start
+               < std::chrono::seconds(5));
+        proc->waitBlocking();
+        expect(proc->getSignal() == SIGKILL);
+        expect(proc->getFinishStatus() == Subprocess::TIMEOUT);
+    });
+
+    test("Enforced time limit: SIGTERM first, then SIGKILL", [&] {
+        auto proc = new WorkerSubprocess(
+          fifty_ms,
+          [](std::unique_ptr<PipeWriter>) {
+              signal(SIGTERM, SIG_IGN);
+              while (true) {
+                  pause();
+              }
+          },
+          {.enforceTimeLimit = true, .gracePeriod = 2 * fifty_ms});
+        cleanup([&] {
+            proc->kill();
+            delete proc;
+        });
+        auto start = std::chrono::steady_clock::now();
+        proc->waitBlocking();
+        expect(std::chrono::steady_clock::now() - start >= 3 * fifty_ms);
+        expect(proc->getSignal() == SIGKILL);
+        expect(proc->getFinishStatus() == Subprocess::TIMEOUT);
+    });
+
+    test("Enforced time limit: SIGTERM is enough for most workers", [&] {
+        auto proc = new WorkerSubprocess(
+          fifty_ms,
+          [](std::unique_ptr<PipeWriter>) {
+              while (true) {
+                  pause();
+              }
+          },
+          {.enforceTimeLimit = true, .gracePeriod = std::chrono::seconds(5)});
+        cleanup([&] {
+            proc->kill();
+            delete proc;
+        });
+        proc->waitBlocking();
+        expect(proc->getSignal() == SIGTERM);
+        expect(proc->getFinishStatus() == Subprocess::TIMEOUT);
+    });
+
+    test("Enforced time limit: workers finishing in time are left alone", [&] {
+        auto proc = new WorkerSubprocess(
+          fifty_ms,
+          [](std::unique_ptr<PipeWriter> writer) {
+              writer->sendMessage(1);
+          },
+          {.enforceTimeLimit = true});
+        cleanup([&] {
+            proc->kill();
+            delete proc;
+        });
+        proc->waitBlocking();
+        std::this_thread::sleep_for(2 * fifty_ms);
+        expect(proc->getFinishStatus() == Subprocess::ZERO_EXIT);
+        expect(!proc->getNextMessage().isInvalid());
+    });
+}
+
+TEST_CASE("Duplex worker subprocess") {
+    test("Pipelining requests to a single worker", [&] {
+        auto proc = new WorkerSubprocess(
+          std::chrono::seconds(5),
+          [](std::unique_ptr<PipeWriter> writer,
+             std::unique_ptr<PipeReader> reader) {
+              while (true) {
+                  auto request = reader->getNextMessage();
+                  if (request.isInvalid()) {
+                      break;
+                  }
+                  writer->sendMessage(2 * request.read<int>());
+              }
+          });
+        cleanup([&] {
+            proc->kill();
+            delete proc;
+        });
+        expect(proc->getPipeWriter() != nullptr);
+        for (int i = 0; i < 100; i++) {
+            proc->sendMessage(i);
+        }
+        for (int i = 0; i < 100; i++) {
+            auto response = proc->getNextMessage(std::chrono::seconds(5));
+            expect(!response.isInvalid());
+            expect(response.read<int>() == 2 * i);
+        }
+        proc->closeInput();
+        expect(proc->getPipeWriter() == nullptr);
+        proc->waitBlocking();
+        expect(proc->getFinishStatus() == Subprocess::ZERO_EXIT);
+    });
+
+    test("Duplex worker over shared memory", [&] {
+        auto proc = new WorkerSubprocess(
+          std::chrono::seconds(5),
+          [](std::unique_ptr<PipeWriter> writer,
+             std::unique_ptr<PipeReader> reader) {
+              auto request = reader->getNextMessage();
+              writer->sendMessage(request.read<int>() + 1);
+          },
+          {.transport = WorkerOptions::SHARED_MEMORY});
+        cleanup([&] {
+            proc->kill();
+            delete proc;
+        });
+        proc->sendMessage(41);
+        auto response = proc->getNextMessage(std::chrono::seconds(5));
+        expect(!response.isInvalid());
+        expect(response.read<int>() == 42);
+    });
+
+    test("The worker notices the parent closing its input", [&] {
+        auto proc = new WorkerSubprocess(
+          std::chrono::seconds(5),
+          [](std::unique_ptr<PipeWriter>, std::unique_ptr<PipeReader> reader) {
+              exit(reader->getNextMessage().isInvalid() ? 3 : 4);
+          });
+        cleanup([&] {
+            proc->kill();
+            delete proc;
+        });
+        proc->closeInput();
+        proc->waitBlocking();
+        expect(proc->getReturnCode() == 3);
+    });
+
+    test("Sending to a worker that takes no input throws", [&] {
+        auto proc = new WorkerSubprocess(std::chrono::seconds(5),
+                                         [](std::unique_ptr<PipeWriter>) {});
+        cleanup([&] {
+            proc->kill();
+            delete proc;
+        });
+        expect(proc->getPipeWriter() == nullptr);
+        bool thrown = false;
+        try {
+            proc->sendMessage(1);
+        } catch (const std::logic_error&) {
+            thrown = true;
+        }
+        expect(thrown);
+    });
 }